@@ -0,0 +1,171 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_admin_bench.cc
+ *        Created:  06/12/15 21:14:09
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  管理接口和游戏请求共用事件循环
+ *                  在进程内构造战场, 测每个管理接口在事件循环中占用的时间
+ *
+ * =============================================================================
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <alpha/logger.h>
+#include "sect_battle_protocol.pb.h"
+#include "sect_battle_server.h"
+#include "sect_battle_store.h"
+
+DEFINE_int32(store_size_mb, 256, "BattleStore大小(MiB)");
+DEFINE_int32(combatants, 200000, "参战人数, 通过JoinBattle加入, 顺便填充统计数据");
+DEFINE_int32(max_level, 100, "玩家最高等级");
+DEFINE_int32(iterations, 2000, "每项测试的次数");
+DEFINE_uint64(bench_seed, 20150612, "随机数种子");
+
+namespace {
+    using namespace SectBattle;
+    using Clock = std::chrono::steady_clock;
+
+    class Bench {
+        public:
+            Bench() :server_(nullptr), rng_(FLAGS_bench_seed) {}
+
+            bool Init();
+            void Populate();
+            void Run();
+
+        private:
+            //每次调用单独计时, params每次调用前生成, 不计时
+            void Measure(const std::string& name, const std::string& path,
+                    std::function<Server::AdminParams()> params);
+            Pos RandomPos();
+
+            Server server_;
+            BattleStore* store_ = nullptr;
+            std::vector<char> buffer_;
+            std::mt19937_64 rng_;
+            std::vector<UinType> uins_;
+    };
+
+    bool Bench::Init() {
+        buffer_.resize(static_cast<size_t>(FLAGS_store_size_mb) << 20);
+        if (!server_.RunInMemory(buffer_.data(), buffer_.size())) {
+            return false;
+        }
+        store_ = server_.store();
+        return true;
+    }
+
+    void Bench::Populate() {
+        std::uniform_int_distribution<int> level_dist(1, FLAGS_max_level);
+        ProtocolMessage wrapper;
+        JoinBattleRequest req;
+        std::string packet;
+        std::vector<char> out(65536);
+        UinType uin = 10000;
+        for (int i = 0; i < FLAGS_combatants; ++i, ++uin) {
+            req.set_uin(uin);
+            req.set_level(level_dist(rng_));
+            wrapper.set_name(req.GetDescriptor()->full_name());
+            req.SerializeToString(wrapper.mutable_payload());
+            wrapper.SerializeToString(&packet);
+            if (server_.HandleMessage(alpha::Slice(packet.data(), packet.size()),
+                        out.data()) >= 0 && store_->FindCombatant(uin)) {
+                uins_.push_back(uin);
+            }
+        }
+        ::printf("combatants = %zu\n", store_->size());
+    }
+
+    Pos Bench::RandomPos() {
+        std::uniform_int_distribution<int> dist(0, Pos::kMaxPos);
+        return Pos::Create(dist(rng_), dist(rng_));
+    }
+
+    void Bench::Measure(const std::string& name, const std::string& path,
+            std::function<Server::AdminParams()> params) {
+        std::vector<uint32_t> us;
+        us.reserve(FLAGS_iterations);
+        uint64_t bytes = 0;
+        for (int i = 0; i < FLAGS_iterations; ++i) {
+            auto p = params();
+            auto start = Clock::now();
+            auto response = server_.HandleAdminRequest(path, p);
+            us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                        Clock::now() - start).count());
+            bytes += response.body.size();
+        }
+        std::sort(us.begin(), us.end());
+        double sum = 0;
+        for (auto n : us) {
+            sum += n;
+        }
+        auto at = [&us](double q) -> uint32_t {
+            return us[std::min(us.size() - 1, static_cast<size_t>(q * us.size()))];
+        };
+        ::printf("%-28s %10zu %10.1f %10u %10u %10u %10.0f\n", name.c_str(), us.size(),
+                sum / us.size(), at(0.5), at(0.99), us.back(),
+                static_cast<double>(bytes) / us.size());
+    }
+
+    void Bench::Run() {
+        ::printf("%-28s %10s %10s %10s %10s %10s %10s\n",
+                "case", "ops", "mean(us)", "p50", "p99", "max", "bytes");
+        auto none = [] { return Server::AdminParams(); };
+        Measure("/status", "/status", none);
+        Measure("/metrics", "/metrics", none);
+        Measure("/phases", "/phases", none);
+        Measure("/stalls", "/stalls", none);
+        Measure("/player", "/player", [this] {
+            std::uniform_int_distribution<size_t> dist(0, uins_.size() - 1);
+            return Server::AdminParams{{"uin", std::to_string(uins_[dist(rng_)])}};
+        });
+        auto field = [this](const char* members) {
+            return [this, members] {
+                auto pos = RandomPos();
+                Server::AdminParams params{{"x", std::to_string(pos.X())},
+                    {"y", std::to_string(pos.Y())}};
+                if (members) {
+                    params["members"] = members;
+                }
+                return params;
+            };
+        };
+        Measure("/field", "/field", field(nullptr));
+        Measure("/field?members=100", "/field", field("100"));
+        Measure("/field?members=1000", "/field", field("1000"));
+        auto sect = [this](const char* members) {
+            return [this, members] {
+                std::uniform_int_distribution<int> dist(1,
+                        static_cast<int>(SectType::kMax) - 1);
+                return Server::AdminParams{{"type", std::to_string(dist(rng_))},
+                    {"members", members}};
+            };
+        };
+        Measure("/sect?members=100", "/sect", sect("100"));
+        Measure("/sect?members=1000", "/sect", sect("1000"));
+        Measure("usage (bad request)", "/nonexistent", none);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("In-process benchmark of admin server requests");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    alpha::Logger::Init(argv[0]);
+
+    Bench bench;
+    CHECK (bench.Init()) << "Init failed";
+    bench.Populate();
+    bench.Run();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,473 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_bench.cc
+ *        Created:  06/10/15 15:20:33
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  sect_battle_svrd的UDP压测工具
+ *                  模拟大量玩家按比例发送各种请求, 统计吞吐和延迟分位数
+ *
+ * =============================================================================
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gflags/gflags.h>
+#include <alpha/logger.h>
+#include "sect_battle_protocol.pb.h"
+#include "sect_battle_server_def.h"
+
+DEFINE_string(server_ip, "127.0.0.1", "服务器IP地址");
+DEFINE_int32(server_port, 9123, "服务器端口");
+DEFINE_int32(threads, 4, "压测线程数, 每个线程一个socket, 同步收发");
+DEFINE_int32(uins, 10000, "模拟的玩家数, 平均分给各个线程");
+DEFINE_uint64(uin_base, 100000000, "模拟玩家的起始uin");
+DEFINE_int32(duration, 10, "压测时间(秒)");
+DEFINE_int32(timeout_ms, 1000, "等待回包的超时时间(毫秒)");
+DEFINE_int32(max_level, 100, "玩家最高等级");
+DEFINE_string(mix, "query:50,move:20,change_opponent:15,check_fight:15",
+        "各种请求的权重, 没加入战场的玩家总是先发JoinBattle");
+DEFINE_int32(report_percent, 80, "CheckFight成功后上报战斗结果的概率(百分比)");
+DEFINE_bool(compact, false, "请求紧凑格式的战场并带上已有的版本号");
+DEFINE_uint64(seed, 20150610, "随机数种子, 每个线程再加上线程序号");
+
+namespace {
+    using namespace SectBattle;
+    using Clock = std::chrono::steady_clock;
+
+    enum MessageType {
+        kQueryBattleField = 0,
+        kJoinBattle,
+        kMove,
+        kChangeOpponent,
+        kCheckFight,
+        kReportFight,
+        kMessageTypeCount
+    };
+
+    const char* kMessageNames[kMessageTypeCount] = {
+        "QueryBattleField", "JoinBattle", "Move",
+        "ChangeOpponent", "CheckFight", "ReportFight"
+    };
+
+    //每个线程自己统计, 结束后再合并
+    struct Statistics {
+        std::vector<uint32_t> latencies[kMessageTypeCount]; //微秒
+        uint64_t timeouts[kMessageTypeCount] = {};
+        uint64_t errors[kMessageTypeCount] = {}; //发送失败或者回包解析失败
+        uint64_t not_ok[kMessageTypeCount] = {}; //code不为0
+    };
+
+    //客户端看到的玩家状态
+    struct Player {
+        UinType uin;
+        LevelType level;
+        bool joined;
+        Pos pos;
+        OpponentList opponents[Combatant::kMaxDirection];
+        uint64_t grid_version;
+    };
+
+    std::atomic<uint64_t> total_requests(0);
+    std::atomic<bool> stop(false);
+
+    bool ParseMix(const std::string& mix, std::array<int, kMessageTypeCount>* weights) {
+        static const std::pair<const char*, MessageType> kKeys[] = {
+            {"query", kQueryBattleField},
+            {"move", kMove},
+            {"change_opponent", kChangeOpponent},
+            {"check_fight", kCheckFight},
+        };
+        weights->fill(0);
+        std::istringstream iss(mix);
+        std::string item;
+        while (std::getline(iss, item, ',')) {
+            auto colon = item.find(':');
+            if (colon == std::string::npos) {
+                return false;
+            }
+            auto key = item.substr(0, colon);
+            auto it = std::find_if(std::begin(kKeys), std::end(kKeys),
+                    [&key](const std::pair<const char*, MessageType>& p) {
+                return key == p.first;
+            });
+            if (it == std::end(kKeys)) {
+                return false;
+            }
+            (*weights)[it->second] = std::atoi(item.c_str() + colon + 1);
+        }
+        return std::any_of(weights->begin(), weights->end(), [](int w) { return w > 0; });
+    }
+
+    class Worker {
+        public:
+            Worker(int id, UinType first_uin, int uins,
+                    const std::array<int, kMessageTypeCount>& weights)
+                :rng_(FLAGS_seed + id), weights_(weights.begin(), weights.end()) {
+                std::uniform_int_distribution<int> level_dist(1, FLAGS_max_level);
+                for (int i = 0; i < uins; ++i) {
+                    LevelType level = level_dist(rng_);
+                    Player player = {first_uin + i, level, false, Pos::CreateInvalid(), {}, 0};
+                    players_.push_back(player);
+                }
+            }
+
+            bool Connect();
+            void Run();
+            const Statistics& statistics() const { return statistics_; }
+
+        private:
+            void Step(Player* player);
+            void UpdateFromBattleField(Player* player, const BattleField& battle_field);
+            //发送req并等待uin对应的回包, 超时或出错返回false
+            template<typename Response>
+            bool Call(MessageType type, const google::protobuf::Message& req,
+                    Player* player, Response* resp);
+            Direction RandomDirection();
+
+            int fd_ = -1;
+            std::mt19937_64 rng_;
+            std::discrete_distribution<int> weights_;
+            std::vector<Player> players_;
+            Statistics statistics_;
+            ProtocolMessage wrapper_;
+            std::string send_buffer_;
+            std::array<char, 65536> recv_buffer_;
+    };
+
+    bool Worker::Connect() {
+        fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd_ < 0) {
+            ::perror("socket");
+            return false;
+        }
+        struct sockaddr_in addr;
+        ::memset(&addr, 0x0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(FLAGS_server_port);
+        if (::inet_pton(AF_INET, FLAGS_server_ip.c_str(), &addr.sin_addr) != 1) {
+            ::fprintf(stderr, "Invalid server_ip %s\n", FLAGS_server_ip.c_str());
+            return false;
+        }
+        if (::connect(fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::perror("connect");
+            return false;
+        }
+        struct timeval tv;
+        tv.tv_sec = FLAGS_timeout_ms / 1000;
+        tv.tv_usec = (FLAGS_timeout_ms % 1000) * 1000;
+        if (::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+            ::perror("setsockopt");
+            return false;
+        }
+        return true;
+    }
+
+    void Worker::Run() {
+        std::uniform_int_distribution<size_t> player_dist(0, players_.size() - 1);
+        while (!stop.load(std::memory_order_relaxed)) {
+            Step(&players_[player_dist(rng_)]);
+        }
+        ::close(fd_);
+    }
+
+    Direction Worker::RandomDirection() {
+        std::uniform_int_distribution<int> dist(static_cast<int>(Direction::kUp),
+                static_cast<int>(Direction::kRight));
+        return static_cast<Direction>(dist(rng_));
+    }
+
+    void Worker::UpdateFromBattleField(Player* player, const BattleField& battle_field) {
+        if (battle_field.has_self_position()) {
+            Pos pos = Pos::Create(battle_field.self_position().x(),
+                    battle_field.self_position().y());
+            if (pos != player->pos) {
+                //换了格子之后之前刷新的对手都没用了
+                for (auto & opponents : player->opponents) {
+                    opponents.clear();
+                }
+            }
+            player->pos = pos;
+        }
+        if (battle_field.has_version()) {
+            player->grid_version = battle_field.version();
+        }
+    }
+
+    template<typename Response>
+    bool Worker::Call(MessageType type, const google::protobuf::Message& req,
+            Player* player, Response* resp) {
+        wrapper_.Clear();
+        wrapper_.set_name(req.GetDescriptor()->full_name());
+        req.SerializeToString(wrapper_.mutable_payload());
+        if (FLAGS_compact) {
+            wrapper_.set_battle_field_format(1);
+            if (player->grid_version != 0) {
+                wrapper_.set_grid_version(player->grid_version);
+            }
+        }
+        wrapper_.SerializeToString(&send_buffer_);
+
+        auto start = Clock::now();
+        if (::send(fd_, send_buffer_.data(), send_buffer_.size(), 0) < 0) {
+            ++statistics_.errors[type];
+            return false;
+        }
+        while (true) {
+            ssize_t n = ::recv(fd_, recv_buffer_.data(), recv_buffer_.size(), 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    ++statistics_.timeouts[type];
+                } else {
+                    ++statistics_.errors[type];
+                }
+                return false;
+            }
+            resp->Clear();
+            if (!resp->ParseFromArray(recv_buffer_.data(), n)) {
+                ++statistics_.errors[type];
+                return false;
+            }
+            //之前超时的回包晚到了, 丢掉继续等
+            if (resp->uin() == player->uin) {
+                break;
+            }
+        }
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - start).count();
+        statistics_.latencies[type].push_back(us);
+        if (resp->code() != 0) {
+            ++statistics_.not_ok[type];
+        }
+        if (resp->has_battle_field()) {
+            UpdateFromBattleField(player, resp->battle_field());
+        }
+        total_requests.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void Worker::Step(Player* player) {
+        std::uniform_int_distribution<int> percent(0, 99);
+        if (!player->joined) {
+            JoinBattleRequest req;
+            req.set_uin(player->uin);
+            req.set_level(player->level);
+            JoinBattleResponse resp;
+            if (Call(kJoinBattle, req, player, &resp)) {
+                auto code = static_cast<Code>(resp.code());
+                player->joined = code == Code::kOk || code == Code::kJoinedBattle;
+            }
+            return;
+        }
+
+        switch (weights_(rng_)) {
+            case kQueryBattleField: {
+                QueryBattleFieldRequest req;
+                req.set_uin(player->uin);
+                req.set_level(player->level);
+                QueryBattleFieldResponse resp;
+                Call(kQueryBattleField, req, player, &resp);
+                break;
+            }
+            case kMove: {
+                auto direction = RandomDirection();
+                auto res = player->pos.Apply(direction);
+                if (!res.second) {
+                    break;
+                }
+                MoveRequest req;
+                req.set_uin(player->uin);
+                req.set_level(player->level);
+                req.set_direction(static_cast<uint32_t>(direction));
+                req.set_can_move(true);
+                req.mutable_destination()->set_x(res.first.X());
+                req.mutable_destination()->set_y(res.first.Y());
+                MoveResponse resp;
+                if (Call(kMove, req, player, &resp)
+                        && static_cast<Code>(resp.code()) == Code::kOccupied) {
+                    auto & opponents = player->opponents[static_cast<int>(direction) - 1];
+                    opponents.clear();
+                    for (auto uin : resp.opponents()) {
+                        opponents.push_back(uin);
+                    }
+                }
+                break;
+            }
+            case kChangeOpponent: {
+                auto direction = RandomDirection();
+                if (!player->pos.Apply(direction).second) {
+                    break;
+                }
+                ChangeOpponentRequest req;
+                req.set_uin(player->uin);
+                req.set_level(player->level);
+                req.set_direction(static_cast<uint32_t>(direction));
+                ChangeOpponentResponse resp;
+                if (Call(kChangeOpponent, req, player, &resp)
+                        && static_cast<Code>(resp.code()) == Code::kOk) {
+                    auto & opponents = player->opponents[static_cast<int>(direction) - 1];
+                    opponents.clear();
+                    for (auto uin : resp.opponents()) {
+                        opponents.push_back(uin);
+                    }
+                }
+                break;
+            }
+            case kCheckFight: {
+                auto direction = RandomDirection();
+                auto & opponents = player->opponents[static_cast<int>(direction) - 1];
+                if (opponents.empty()) {
+                    break;
+                }
+                std::uniform_int_distribution<size_t> dist(0, opponents.size() - 1);
+                UinType opponent = opponents[dist(rng_)];
+                CheckFightRequest req;
+                req.set_uin(player->uin);
+                req.set_opponent(opponent);
+                req.set_direction(static_cast<uint32_t>(direction));
+                CheckFightResponse resp;
+                if (!Call(kCheckFight, req, player, &resp)
+                        || static_cast<Code>(resp.code()) != Code::kOk
+                        || percent(rng_) >= FLAGS_report_percent) {
+                    break;
+                }
+                //和CGI一样, CheckFight成功后马上上报结果
+                //别的线程可能恰好移动了这个对手, 所以要压Release版本的服务器
+                bool win = percent(rng_) < 50;
+                ReportFightRequest report;
+                report.set_uin(player->uin);
+                report.set_opponent(opponent);
+                report.set_loser(win ? opponent : player->uin);
+                report.set_direction(static_cast<uint32_t>(direction));
+                report.set_reset_self(!win && percent(rng_) < 30);
+                report.set_reset_opponent(win && percent(rng_) < 30);
+                report.set_level(player->level);
+                report.set_opponent_level(player->level);
+                ReportFightResponse report_resp;
+                Call(kReportFight, report, player, &report_resp);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    void PrintStatistics(const std::vector<Statistics>& all, double seconds) {
+        ::printf("%-18s %10s %8s %8s %8s %9s %8s %8s %8s %8s %8s\n",
+                "message", "count", "qps", "not_ok", "timeout", "error",
+                "p50(us)", "p90", "p99", "p999", "max");
+        std::vector<uint32_t> total;
+        uint64_t total_timeouts = 0, total_errors = 0, total_not_ok = 0;
+        auto print = [seconds](const char* name, std::vector<uint32_t>& latencies,
+                uint64_t not_ok, uint64_t timeouts, uint64_t errors) {
+            std::sort(latencies.begin(), latencies.end());
+            auto at = [&latencies](double q) -> uint32_t {
+                if (latencies.empty()) {
+                    return 0;
+                }
+                return latencies[std::min(latencies.size() - 1,
+                        static_cast<size_t>(q * latencies.size()))];
+            };
+            ::printf("%-18s %10zu %8.0f %8lu %8lu %9lu %8u %8u %8u %8u %8u\n",
+                    name, latencies.size(), latencies.size() / seconds,
+                    static_cast<unsigned long>(not_ok),
+                    static_cast<unsigned long>(timeouts),
+                    static_cast<unsigned long>(errors),
+                    at(0.5), at(0.9), at(0.99), at(0.999),
+                    latencies.empty() ? 0 : latencies.back());
+        };
+        for (int type = 0; type < kMessageTypeCount; ++type) {
+            std::vector<uint32_t> latencies;
+            uint64_t timeouts = 0, errors = 0, not_ok = 0;
+            for (const auto & statistics : all) {
+                latencies.insert(latencies.end(), statistics.latencies[type].begin(),
+                        statistics.latencies[type].end());
+                timeouts += statistics.timeouts[type];
+                errors += statistics.errors[type];
+                not_ok += statistics.not_ok[type];
+            }
+            total.insert(total.end(), latencies.begin(), latencies.end());
+            total_timeouts += timeouts;
+            total_errors += errors;
+            total_not_ok += not_ok;
+            print(kMessageNames[type], latencies, not_ok, timeouts, errors);
+        }
+        print("total", total, total_not_ok, total_timeouts, total_errors);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("UDP load generator for sect_battle_svrd");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    alpha::Logger::Init(argv[0]);
+
+    std::array<int, kMessageTypeCount> weights;
+    if (!ParseMix(FLAGS_mix, &weights)) {
+        ::fprintf(stderr, "Invalid mix: %s\n", FLAGS_mix.c_str());
+        return EXIT_FAILURE;
+    }
+    if (FLAGS_threads <= 0 || FLAGS_uins < FLAGS_threads) {
+        ::fprintf(stderr, "Need at least one uin per thread\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    const int uins_per_thread = FLAGS_uins / FLAGS_threads;
+    for (int i = 0; i < FLAGS_threads; ++i) {
+        UinType first_uin = FLAGS_uin_base + i * uins_per_thread;
+        workers.emplace_back(new Worker(i, first_uin, uins_per_thread, weights));
+        if (!workers.back()->Connect()) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (auto & worker : workers) {
+        threads.emplace_back(&Worker::Run, worker.get());
+    }
+    uint64_t last = 0;
+    for (int second = 1; second <= FLAGS_duration; ++second) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(second));
+        uint64_t current = total_requests.load(std::memory_order_relaxed);
+        ::printf("[%3ds] %lu req/s\n", second, static_cast<unsigned long>(current - last));
+        ::fflush(stdout);
+        last = current;
+    }
+    stop.store(true, std::memory_order_relaxed);
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<Statistics> all;
+    for (const auto & worker : workers) {
+        all.push_back(worker->statistics());
+    }
+    ::printf("threads = %d, uins = %d, duration = %.2fs, mix = %s, compact = %d\n",
+            FLAGS_threads, uins_per_thread * FLAGS_threads, seconds, FLAGS_mix.c_str(),
+            static_cast<int>(FLAGS_compact));
+    PrintStatistics(all, seconds);
+    return EXIT_SUCCESS;
+}
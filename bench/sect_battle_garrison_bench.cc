@@ -0,0 +1,155 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_garrison_bench.cc
+ *        Created:  06/05/15 10:42:17
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  在内存中模拟大量战斗请求, 测试格子驻军更新的开销
+ *
+ * =============================================================================
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <gflags/gflags.h>
+#include <alpha/logger.h>
+#include "sect_battle_store.h"
+
+DEFINE_int32(store_size_mb, 256, "BattleStore大小(MiB)");
+DEFINE_int32(combatants, 1000000, "参战人数");
+DEFINE_int32(fights, 1000000, "模拟的战斗次数");
+DEFINE_int32(max_level, 100, "玩家最高等级");
+DEFINE_int32(reset_percent, 30, "战败方被重置回出生点的概率(百分比)");
+DEFINE_int32(level_up_percent, 5, "查询战场时等级变化的概率(百分比)");
+DEFINE_uint64(seed, 20150605, "随机数种子");
+
+namespace {
+    using namespace SectBattle;
+
+    using Clock = std::chrono::steady_clock;
+    struct OpCost {
+        const char* name;
+        uint64_t count;
+        Clock::duration total;
+    };
+
+    template<typename Function>
+    void Measure(OpCost* cost, Function f) {
+        auto start = Clock::now();
+        f();
+        cost->total += Clock::now() - start;
+        ++cost->count;
+    }
+
+    void PrintCost(const OpCost& cost) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(cost.total).count();
+        ::printf("%-24s %12lu ops %12.1f ns/op\n", cost.name,
+                static_cast<unsigned long>(cost.count),
+                cost.count ? static_cast<double>(ns) / cost.count : 0);
+    }
+
+    Pos RandomPos(std::mt19937_64& rng) {
+        std::uniform_int_distribution<int> dist(0, Pos::kMaxPos);
+        return Pos::Create(dist(rng), dist(rng));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("Benchmark garrison updates under fight-heavy traffic");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    alpha::Logger::Init(argv[0]);
+
+    std::vector<char> buffer(static_cast<size_t>(FLAGS_store_size_mb) << 20);
+    auto store = BattleStore::Create(buffer.data(), buffer.size());
+    CHECK (store) << "Create BattleStore failed";
+    for (int x = 0; x <= Pos::kMaxPos; ++x) {
+        for (int y = 0; y <= Pos::kMaxPos; ++y) {
+            store->InitField(Pos::Create(x, y), SectType::kNone, FieldType::kDefault);
+        }
+    }
+    for (int sect = 1; sect < static_cast<int>(SectType::kMax); ++sect) {
+        store->InitSect(static_cast<SectType>(sect), Pos::Create(sect, 0));
+    }
+
+    std::mt19937_64 rng(FLAGS_seed);
+    std::uniform_int_distribution<int> level_dist(1, FLAGS_max_level);
+    std::uniform_int_distribution<int> sect_dist(1, static_cast<int>(SectType::kMax) - 1);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::vector<UinType> uins;
+    OpCost add = {"AddCombatant", 0, Clock::duration::zero()};
+    for (int i = 0; i < FLAGS_combatants; ++i) {
+        UinType uin = i + 10000;
+        auto sect = static_cast<SectType>(sect_dist(rng));
+        auto pos = RandomPos(rng);
+        LevelType level = level_dist(rng);
+        Combatant* combatant = nullptr;
+        Measure(&add, [&] {
+            combatant = store->AddCombatant(uin, sect, pos, level);
+        });
+        if (combatant == nullptr) {
+            break;
+        }
+        uins.push_back(uin);
+    }
+    CHECK (!uins.empty()) << "No combatant added";
+
+    //一次战斗: 查询战场(可能升级), 刷新对手, 打败对手(进入保护期, 可能被重置)
+    OpCost query = {"UpdateLevel", 0, Clock::duration::zero()};
+    OpCost refresh = {"GetOpponents", 0, Clock::duration::zero()};
+    OpCost defeat = {"UpdateLastDefeatedTime", 0, Clock::duration::zero()};
+    OpCost reset = {"MoveCombatant", 0, Clock::duration::zero()};
+    std::uniform_int_distribution<size_t> uin_dist(0, uins.size() - 1);
+    alpha::TimeStamp now = 1433472000000; //2015-06-05
+    const alpha::TimeStamp kProtection = 60 * 1000;
+    uint64_t opponents_found = 0;
+    store->SetProtection(kProtection, now);
+    for (int i = 0; i < FLAGS_fights; ++i) {
+        now += 1;
+        store->AdvanceProtection(now);
+        Combatant* self = store->FindCombatant(uins[uin_dist(rng)]);
+        assert (self);
+        LevelType level = self->Level();
+        if (percent(rng) < FLAGS_level_up_percent && level < FLAGS_max_level) {
+            ++level;
+        }
+        Measure(&query, [&] {
+            store->UpdateLevel(self, level);
+        });
+
+        auto target = RandomPos(rng);
+        OpponentList opponents;
+        Measure(&refresh, [&] {
+            opponents = store->GetOpponents(target, level);
+        });
+        if (opponents.empty()) {
+            continue;
+        }
+        opponents_found += opponents.size();
+
+        Combatant* opponent = store->FindCombatant(opponents[0]);
+        assert (opponent);
+        Measure(&defeat, [&] {
+            store->UpdateLastDefeatedTime(opponent, now);
+        });
+
+        if (percent(rng) < FLAGS_reset_percent) {
+            auto born_pos = store->GetSect(opponent->CurrentSect()).BornPos();
+            Measure(&reset, [&] {
+                store->MoveCombatant(opponent, born_pos, opponent->Level());
+            });
+        }
+    }
+
+    ::printf("combatants = %zu, fights = %d, opponents per refresh = %.2f\n",
+            store->size(), FLAGS_fights,
+            refresh.count ? static_cast<double>(opponents_found) / refresh.count : 0);
+    for (const auto & cost : {add, query, refresh, defeat, reset}) {
+        PrintCost(cost);
+    }
+    return EXIT_SUCCESS;
+}
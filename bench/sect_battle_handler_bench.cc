@@ -0,0 +1,516 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_handler_bench.cc
+ *        Created:  06/11/15 10:05:48
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  不经过网络和TT, 在进程内构造战场, 直接测每种请求的处理开销
+ *                  以及BattleStore和战场编码的开销
+ *
+ * =============================================================================
+ */
+
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <alpha/logger.h>
+#include "sect_battle_protocol.pb.h"
+#include "sect_battle_server.h"
+#include "sect_battle_store.h"
+#include "sect_battle_field_encoder.h"
+#include "sect_battle_alloc_counter.h"
+
+DEFINE_int32(store_size_mb, 256, "BattleStore大小(MiB)");
+DEFINE_int32(combatants, 200000, "参战人数");
+DEFINE_int32(fields, 81, "驻军分布在多少个格子里(越少越密集)");
+DEFINE_string(level_distribution, "uniform", "等级分布: uniform, normal或者top_heavy");
+DEFINE_int32(max_level, 100, "玩家最高等级");
+DEFINE_int32(protected_percent, 30, "初始时在保护期的人的比例(百分比)");
+DEFINE_int32(iterations, 200000, "每项测试的次数");
+DEFINE_bool(compact, false, "请求紧凑格式的战场");
+DEFINE_uint64(bench_seed, 20150611, "随机数种子");
+DEFINE_int32(warmup, 1000, "每项测试的前多少次不统计堆分配");
+DEFINE_bool(check_allocations, true, "预热之后处理请求时还有堆分配就返回失败");
+DEFINE_int32(battle_field_rounds, 20000, "检查紧凑格式的轮数, 每轮改一次战场再让一个客户端同步\n"
+        "客户端从回包还原战场, 和store不一致就返回失败, 为0时不检查");
+DEFINE_int32(battle_field_clients, 16, "检查紧凑格式时的客户端个数, 越多每个客户端落后的版本越多");
+
+namespace {
+    using namespace SectBattle;
+    using Clock = std::chrono::steady_clock;
+
+    struct Result {
+        std::string name;
+        std::vector<uint32_t> ns;
+        uint64_t allocations = 0; //预热之后f中operator new的次数
+    };
+
+    std::vector<Result> results;
+
+    //每次调用单独计时, prepare不计时
+    template<typename Prepare, typename Function>
+    void Measure(const std::string& name, Prepare prepare, Function f) {
+        Result result;
+        result.name = name;
+        result.ns.reserve(FLAGS_iterations);
+        for (int i = 0; i < FLAGS_iterations; ++i) {
+            if (!prepare()) {
+                continue;
+            }
+            const auto allocations = ThreadHeapAllocations();
+            auto start = Clock::now();
+            f();
+            result.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        Clock::now() - start).count());
+            if (i >= FLAGS_warmup) {
+                result.allocations += ThreadHeapAllocations() - allocations;
+            }
+        }
+        results.push_back(std::move(result));
+    }
+
+    void PrintResults() {
+        ::printf("%-28s %10s %10s %10s %10s %10s %10s\n",
+                "case", "ops", "mean(ns)", "p50", "p99", "max", "allocs");
+        for (auto & result : results) {
+            auto & ns = result.ns;
+            std::sort(ns.begin(), ns.end());
+            double sum = 0;
+            for (auto n : ns) {
+                sum += n;
+            }
+            auto at = [&ns](double q) -> uint32_t {
+                return ns.empty() ? 0
+                    : ns[std::min(ns.size() - 1, static_cast<size_t>(q * ns.size()))];
+            };
+            ::printf("%-28s %10zu %10.0f %10u %10u %10u %10" PRIu64 "\n",
+                    result.name.c_str(), ns.size(), ns.empty() ? 0 : sum / ns.size(),
+                    at(0.5), at(0.99), ns.empty() ? 0 : ns.back(), result.allocations);
+        }
+    }
+
+    //稳定状态下处理请求不应该分配内存, 只检查经过HandleMessage的
+    bool CheckAllocations() {
+        bool ok = true;
+        for (const auto & result : results) {
+            if (result.name.compare(0, 6, "Handle") == 0 && result.allocations != 0) {
+                ::fprintf(stderr, "%s allocated %" PRIu64 " times after warmup\n",
+                        result.name.c_str(), result.allocations);
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    class Bench {
+        public:
+            Bench()
+                :server_(nullptr), rng_(FLAGS_bench_seed),
+                level_(MakeLevelDistribution()) {
+            }
+
+            bool Init();
+            void Populate();
+            void RunStoreCases();
+            void RunHandlerCases();
+            //按紧凑格式的回包还原战场并和store比较, 顺便比较两种格式的大小
+            bool CheckBattleField();
+
+        private:
+            std::function<LevelType()> MakeLevelDistribution();
+            Combatant* RandomCombatant();
+            Direction RandomDirection();
+            //打包成ProtocolMessage放到packet_中
+            void Pack(const google::protobuf::Message& req);
+            bool Handle();
+
+            Server server_;
+            BattleStore* store_ = nullptr;
+            std::vector<char> buffer_;
+            std::mt19937_64 rng_;
+            std::function<LevelType()> level_;
+            std::vector<Pos> fields_; //放驻军的格子
+            std::vector<UinType> uins_;
+            UinType next_uin_ = 10000;
+            ProtocolMessage wrapper_;
+            std::string packet_;
+            std::array<char, 65536> out_;
+    };
+
+    std::function<LevelType()> Bench::MakeLevelDistribution() {
+        const int max_level = FLAGS_max_level;
+        auto clamp = [max_level](double level) {
+            return static_cast<LevelType>(std::max(1, std::min<int>(max_level, level)));
+        };
+        if (FLAGS_level_distribution == "normal") {
+            std::normal_distribution<double> dist(max_level / 2.0, max_level / 10.0);
+            return [this, dist, clamp]() mutable { return clamp(dist(rng_)); };
+        } else if (FLAGS_level_distribution == "top_heavy") {
+            //大部分人都在满级附近
+            std::exponential_distribution<double> dist(10.0 / max_level);
+            return [this, dist, clamp, max_level]() mutable {
+                return clamp(max_level - dist(rng_));
+            };
+        }
+        std::uniform_int_distribution<int> dist(1, max_level);
+        return [this, dist]() mutable { return static_cast<LevelType>(dist(rng_)); };
+    }
+
+    bool Bench::Init() {
+        buffer_.resize(static_cast<size_t>(FLAGS_store_size_mb) << 20);
+        if (!server_.RunInMemory(buffer_.data(), buffer_.size())) {
+            return false;
+        }
+        store_ = server_.store();
+        for (int y = 0; y <= Pos::kMaxPos; ++y) {
+            for (int x = 0; x <= Pos::kMaxPos; ++x) {
+                auto pos = Pos::Create(x, y);
+                if (store_->GetField(pos).Type() == FieldType::kDefault) {
+                    fields_.push_back(pos);
+                }
+            }
+        }
+        std::shuffle(fields_.begin(), fields_.end(), rng_);
+        fields_.erase(fields_.begin() + std::max(1, std::min<int>(FLAGS_fields, fields_.size())),
+                fields_.end());
+        return true;
+    }
+
+    void Bench::Populate() {
+        std::uniform_int_distribution<int> sect_dist(1, static_cast<int>(SectType::kMax) - 1);
+        std::uniform_int_distribution<size_t> field_dist(0, fields_.size() - 1);
+        std::uniform_int_distribution<int> percent(0, 99);
+        const auto now = alpha::Now();
+        for (int i = 0; i < FLAGS_combatants; ++i) {
+            auto sect = static_cast<SectType>(sect_dist(rng_));
+            auto pos = fields_[field_dist(rng_)];
+            alpha::TimeStamp last_defeated_time =
+                percent(rng_) < FLAGS_protected_percent ? now : 0;
+            if (store_->AddCombatant(next_uin_, sect, pos, level_(),
+                        last_defeated_time) == nullptr) {
+                break;
+            }
+            uins_.push_back(next_uin_++);
+        }
+        //有驻军的格子随机分给各个门派, 这样移动和刷新对手都有意义
+        for (auto pos : fields_) {
+            store_->ChangeOwner(pos, static_cast<SectType>(sect_dist(rng_)));
+        }
+        ::printf("combatants = %zu, fields = %zu, level_distribution = %s, "
+                "protected = %zu\n", store_->size(), fields_.size(),
+                FLAGS_level_distribution.c_str(), store_->ProtectedNum());
+    }
+
+    Combatant* Bench::RandomCombatant() {
+        std::uniform_int_distribution<size_t> dist(0, uins_.size() - 1);
+        const UinType uin = uins_[dist(rng_)];
+        auto combatant = store_->FindCombatant(uin);
+        //找不到说明战场被重置了或者加入失败了, 之后的结果都没有意义
+        CHECK (combatant) << "Combatant not found, uin = " << uin;
+        return combatant;
+    }
+
+    Direction Bench::RandomDirection() {
+        std::uniform_int_distribution<int> dist(static_cast<int>(Direction::kUp),
+                static_cast<int>(Direction::kRight));
+        return static_cast<Direction>(dist(rng_));
+    }
+
+    void Bench::RunStoreCases() {
+        std::uniform_int_distribution<size_t> field_dist(0, fields_.size() - 1);
+        Pos pos = fields_[0];
+        LevelType level = 0;
+        Measure("Store::GetOpponents", [&] {
+            pos = fields_[field_dist(rng_)];
+            level = level_();
+            return true;
+        }, [&] {
+            auto opponents = store_->GetOpponents(pos, level);
+            (void)opponents;
+        });
+
+        Combatant* combatant = nullptr;
+        Measure("Store::MoveCombatant", [&] {
+            combatant = RandomCombatant();
+            pos = fields_[field_dist(rng_)];
+            return true;
+        }, [&] {
+            store_->MoveCombatant(combatant, pos, combatant->Level());
+        });
+
+        Measure("Store::UpdateLastDefeatedTime", [&] {
+            combatant = RandomCombatant();
+            return true;
+        }, [&] {
+            store_->UpdateLastDefeatedTime(combatant, alpha::Now());
+        });
+
+        //每次都改一个格子, 强制重新编码
+        BattleFieldEncoder encoder;
+        std::uniform_int_distribution<int> sect_dist(1, static_cast<int>(SectType::kMax) - 1);
+        Measure("Encoder::Update", [&] {
+            store_->ChangeOwner(fields_[field_dist(rng_)],
+                    static_cast<SectType>(sect_dist(rng_)));
+            return true;
+        }, [&] {
+            encoder.Update(store_);
+        });
+        uint8_t* out = reinterpret_cast<uint8_t*>(out_.data());
+        Measure("Encoder::WriteToArray", [] { return true; }, [&] {
+            encoder.WriteToArray(3, pos, out);
+        });
+        Measure("Encoder::WriteCompactToArray", [] { return true; }, [&] {
+            encoder.WriteCompactToArray(3, pos, 0, out);
+        });
+    }
+
+    void Bench::Pack(const google::protobuf::Message& req) {
+        wrapper_.Clear();
+        wrapper_.set_name(req.GetDescriptor()->full_name());
+        req.SerializeToString(wrapper_.mutable_payload());
+        if (FLAGS_compact) {
+            wrapper_.set_battle_field_format(static_cast<uint32_t>(BattleFieldFormat::kCompact));
+        }
+        wrapper_.SerializeToString(&packet_);
+    }
+
+    bool Bench::Handle() {
+        return server_.HandleMessage(alpha::Slice(packet_.data(), packet_.size()),
+                out_.data()) >= 0;
+    }
+
+    void Bench::RunHandlerCases() {
+        auto handle = [this] {
+            auto ret = Handle();
+            assert (ret);
+            (void)ret;
+        };
+
+        Measure("HandleQueryBattleField", [this] {
+            auto combatant = RandomCombatant();
+            QueryBattleFieldRequest req;
+            req.set_uin(combatant->Uin());
+            req.set_level(combatant->Level());
+            Pack(req);
+            return true;
+        }, handle);
+
+        Measure("HandleJoinBattle", [this] {
+            JoinBattleRequest req;
+            req.set_uin(next_uin_);
+            req.set_level(level_());
+            uins_.push_back(next_uin_++);
+            Pack(req);
+            return true;
+        }, handle);
+
+        Measure("HandleMove", [this] {
+            auto combatant = RandomCombatant();
+            auto direction = RandomDirection();
+            auto res = combatant->CurrentPos().Apply(direction);
+            //出界和禁入点服务器直接拒绝, 不测
+            if (!res.second
+                    || store_->GetField(res.first).Type() == FieldType::kForbiddenField) {
+                return false;
+            }
+            MoveRequest req;
+            req.set_uin(combatant->Uin());
+            req.set_level(combatant->Level());
+            req.set_direction(static_cast<uint32_t>(direction));
+            req.set_can_move(true);
+            req.mutable_destination()->set_x(res.first.X());
+            req.mutable_destination()->set_y(res.first.Y());
+            Pack(req);
+            return true;
+        }, handle);
+
+        Measure("HandleChangeSect", [this] {
+            std::uniform_int_distribution<int> sect_dist(1,
+                    static_cast<int>(SectType::kMax) - 1);
+            auto combatant = RandomCombatant();
+            ChangeSectRequest req;
+            req.set_uin(combatant->Uin());
+            req.set_level(combatant->Level());
+            req.set_sect(sect_dist(rng_));
+            Pack(req);
+            return true;
+        }, handle);
+
+        Measure("HandleChangeOpponent", [this] {
+            auto combatant = RandomCombatant();
+            auto direction = RandomDirection();
+            if (!combatant->CurrentPos().Apply(direction).second) {
+                return false;
+            }
+            ChangeOpponentRequest req;
+            req.set_uin(combatant->Uin());
+            req.set_level(combatant->Level());
+            req.set_direction(static_cast<uint32_t>(direction));
+            Pack(req);
+            return true;
+        }, handle);
+
+        //只测刷新过对手的人, 和CGI的流程一致
+        auto pick_fight = [this](Combatant** self, Direction* direction, UinType* opponent) {
+            auto combatant = RandomCombatant();
+            auto d = RandomDirection();
+            auto res = combatant->CurrentPos().Apply(d);
+            auto opponents = combatant->GetOpponents(d);
+            if (!res.second || opponents.empty()) {
+                return false;
+            }
+            std::uniform_int_distribution<size_t> dist(0, opponents.size() - 1);
+            auto target = store_->FindCombatant(opponents[dist(rng_)]);
+            if (target == nullptr || target->CurrentPos() != res.first) {
+                return false;
+            }
+            *self = combatant;
+            *direction = d;
+            *opponent = target->Uin();
+            return true;
+        };
+
+        Measure("HandleCheckFight", [this, &pick_fight] {
+            Combatant* self;
+            Direction direction;
+            UinType opponent;
+            if (!pick_fight(&self, &direction, &opponent)) {
+                return false;
+            }
+            CheckFightRequest req;
+            req.set_uin(self->Uin());
+            req.set_opponent(opponent);
+            req.set_direction(static_cast<uint32_t>(direction));
+            Pack(req);
+            return true;
+        }, handle);
+
+        Measure("HandleReportFight", [this, &pick_fight] {
+            Combatant* self;
+            Direction direction;
+            UinType opponent;
+            if (!pick_fight(&self, &direction, &opponent)) {
+                return false;
+            }
+            std::uniform_int_distribution<int> percent(0, 99);
+            bool win = percent(rng_) < 50;
+            ReportFightRequest req;
+            req.set_uin(self->Uin());
+            req.set_opponent(opponent);
+            req.set_loser(win ? opponent : self->Uin());
+            req.set_direction(static_cast<uint32_t>(direction));
+            req.set_reset_self(!win && percent(rng_) < 30);
+            req.set_reset_opponent(win && percent(rng_) < 30);
+            req.set_level(self->Level());
+            req.set_opponent_level(store_->FindCombatant(opponent)->Level());
+            Pack(req);
+            return true;
+        }, handle);
+    }
+
+    bool Bench::CheckBattleField() {
+        struct Client {
+            uint64_t version = 0;
+            std::array<uint32_t, kBattleFieldCount> owners {};
+            std::array<uint32_t, kBattleFieldCount> garrison_nums {};
+        };
+        std::vector<Client> clients(std::max(FLAGS_battle_field_clients, 1));
+        std::uniform_int_distribution<size_t> client_dist(0, clients.size() - 1);
+        std::uniform_int_distribution<size_t> field_dist(0, fields_.size() - 1);
+        std::uniform_int_distribution<int> sect_dist(1, static_cast<int>(SectType::kMax) - 1);
+        std::uniform_int_distribution<int> percent(0, 99);
+        BattleFieldEncoder encoder;
+        QueryBattleFieldResponse resp;
+        uint8_t* out = reinterpret_cast<uint8_t*>(out_.data());
+        uint64_t legacy_bytes = 0, compact_bytes = 0, deltas = 0;
+        for (int round = 0; round < FLAGS_battle_field_rounds; ++round) {
+            //驻军人数每轮都可能变, 偶尔换一下主人
+            auto combatant = RandomCombatant();
+            store_->MoveCombatant(combatant, fields_[field_dist(rng_)], combatant->Level());
+            if (percent(rng_) < 10) {
+                store_->ChangeOwner(fields_[field_dist(rng_)],
+                        static_cast<SectType>(sect_dist(rng_)));
+            }
+            encoder.Update(store_);
+
+            Client& client = clients[client_dist(rng_)];
+            const int field_number = QueryBattleFieldResponse::kBattleFieldFieldNumber;
+            legacy_bytes += encoder.WriteToArray(field_number, fields_[0], out) - out;
+            auto end = encoder.WriteCompactToArray(field_number, fields_[0],
+                    client.version, out);
+            compact_bytes += end - out;
+            CHECK (resp.ParseFromArray(out, end - out)) << "Cannot parse compact battle field";
+            const BattleField& field = resp.battle_field();
+            if (field.has_base_version()) {
+                CHECK (field.base_version() == client.version)
+                    << "base_version = " << field.base_version()
+                    << ", client.version = " << client.version;
+                CHECK (field.owners_size() == field.changed_size()
+                        && field.garrison_nums_size() == field.changed_size());
+                for (int i = 0; i < field.changed_size(); ++i) {
+                    CHECK (field.changed(i) < static_cast<uint32_t>(kBattleFieldCount));
+                    client.owners[field.changed(i)] = field.owners(i);
+                    client.garrison_nums[field.changed(i)] = field.garrison_nums(i);
+                }
+                ++deltas;
+            } else {
+                CHECK (field.owners_size() == kBattleFieldCount
+                        && field.garrison_nums_size() == kBattleFieldCount);
+                std::copy(field.owners().begin(), field.owners().end(),
+                        client.owners.begin());
+                std::copy(field.garrison_nums().begin(), field.garrison_nums().end(),
+                        client.garrison_nums.begin());
+            }
+            client.version = field.version();
+
+            //和Pos的顺序一致(先按y再按x)
+            for (int i = 0; i < kBattleFieldCount; ++i) {
+                auto pos = Pos::Create(i % (Pos::kMaxPos + 1), i / (Pos::kMaxPos + 1));
+                const Field& expected = store_->GetField(pos);
+                if (client.owners[i] != static_cast<uint32_t>(expected.Owner())
+                        || client.garrison_nums[i] != expected.GarrisonNum()) {
+                    ::fprintf(stderr, "Battle field mismatch, round = %d, x = %d, y = %d, "
+                            "owner = %u/%d, garrison_num = %u/%u\n", round, pos.X(),
+                            pos.Y(), client.owners[i], static_cast<int>(expected.Owner()),
+                            client.garrison_nums[i], expected.GarrisonNum());
+                    return false;
+                }
+            }
+        }
+        if (FLAGS_battle_field_rounds > 0) {
+            ::printf("battle_field: rounds = %d, clients = %zu, deltas = %" PRIu64
+                    ", legacy = %.0f bytes, compact = %.0f bytes\n",
+                    FLAGS_battle_field_rounds, clients.size(), deltas,
+                    static_cast<double>(legacy_bytes) / FLAGS_battle_field_rounds,
+                    static_cast<double>(compact_bytes) / FLAGS_battle_field_rounds);
+        }
+        return true;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("In-process benchmark of request handlers");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    alpha::Logger::Init(argv[0]);
+
+    Bench bench;
+    CHECK (bench.Init()) << "Init failed";
+    bench.Populate();
+    bench.RunStoreCases();
+    bench.RunHandlerCases();
+    PrintResults();
+    bool ok = bench.CheckBattleField();
+    if (FLAGS_check_allocations && !CheckAllocations()) {
+        ok = false;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
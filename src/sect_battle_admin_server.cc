@@ -12,141 +12,229 @@
  */
 
 #include "sect_battle_server.h"
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
+#include <cstdio>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
 #include <alpha/logger.h>
 #include <alpha/http_message.h>
 #include <alpha/http_response_builder.h>
 #include "sect_battle_inspector.h"
 #include "sect_battle_backup_metadata.h"
 #include "sect_battle_backup_coroutine.h"
+#include "sect_battle_store.h"
+#include "sect_battle_phase_timer.h"
+#include "sect_battle_loop_monitor.h"
+#include "sect_battle_alloc_counter.h"
+#include "sect_battle_traffic_capture.h"
+#include "sect_battle_json_writer.h"
 
 namespace SectBattle {
+    namespace {
+        //按路径统计次数和耗时, 不认识的路径都算作other, 避免计数器无限增长
+        const char* AdminPathLabel(const std::string& path) {
+            static const char* const kPaths[] = {
+                "/status", "/metrics", "/stalls", "/phases", "/field",
+                "/player", "/forcebackup", "/sect", "/removeplayer",
+            };
+            for (auto p : kPaths) {
+                if (path == p) {
+                    return p;
+                }
+            }
+            return "other";
+        }
+
+        Server::AdminResponse JsonResponse(std::string body) {
+            return Server::AdminResponse{200, "OK", "application/json", std::move(body)};
+        }
+
+        Server::AdminResponse TextResponse(int status, const char* status_string,
+                const char* body) {
+            return Server::AdminResponse{status, status_string, "text/plain", body};
+        }
+
+        //members=N时最多列出N个, 超过kMaxAdminPageSize时按kMaxAdminPageSize算
+        unsigned PageSize(const Server::AdminParams& params, unsigned max_page_size) {
+            auto it = params.find("members");
+            if (it == params.end()) {
+                return 0;
+            }
+            return std::min<unsigned long>(std::stoul(it->second), max_page_size);
+        }
+
+        //驻军分页的游标是上一页最后一个人的"等级-uin"
+        CombatantIdentity ParseGarrisonCursor(const Server::AdminParams& params) {
+            auto it = params.find("after");
+            if (it == params.end()) {
+                return CombatantIdentity(0, 0);
+            }
+            const std::string& cursor = it->second;
+            auto sep = cursor.find('-');
+            if (sep == std::string::npos) {
+                throw std::invalid_argument("invalid cursor");
+            }
+            auto level = std::stoul(cursor.substr(0, sep));
+            auto uin = std::stoul(cursor.substr(sep + 1));
+            if (level > std::numeric_limits<LevelType>::max()
+                    || uin > std::numeric_limits<UinType>::max()) {
+                throw std::out_of_range("invalid cursor");
+            }
+            return CombatantIdentity(level, uin);
+        }
+    }
+
     void Server::AdminServerCallback(alpha::TcpConnectionPtr conn,
                     const alpha::HTTPMessage& message) {
-        auto path = message.Path();
+        LoopMonitor::Scope scope(loop_monitor_.get(), "AdminServerCallback");
+        const auto start = alpha::NowInMicroseconds();
+        auto response = HandleAdminRequest(message.Path(), message.Params());
+        alpha::HTTPResponseBuilder(conn)
+            .status(response.status, response.status_string)
+            .AddHeader("Server", "alpha::SimpleHTTPServer")
+            .AddHeader("Date", alpha::HTTPMessage::FormatDate(alpha::Now()))
+            .AddHeader("Connection", "close")
+            .AddHeader("Content-Type", response.content_type)
+            .body(std::move(response.body))
+            .SendWithEOM();
+        inspector_->RecordAdminRequest(AdminPathLabel(message.Path()),
+                alpha::NowInMicroseconds() - start);
+    }
+
+    Server::AdminResponse Server::HandleAdminRequest(const std::string& path,
+            const AdminParams& params) {
         try {
             if (path == "/status") {
-                WriteHTTPResponse(conn, 200, "OK", ServerStatus());
-                return;
+                return JsonResponse(ServerStatus());
+            } else if (path == "/metrics") {
+                return AdminResponse{200, "OK", "text/plain; version=0.0.4", MetricsText()};
+            } else if (path == "/stalls") {
+                return JsonResponse(StallStatus());
+            } else if (path == "/phases") {
+                return JsonResponse(PhaseStatus());
             } else if (path == "/field") {
-                auto x = std::stoul(message.Params().at("x"));
-                auto y = std::stoul(message.Params().at("y"));
+                auto x = std::stoul(params.at("x"));
+                auto y = std::stoul(params.at("y"));
                 if (x <= Pos::kMaxPos && y <= Pos::kMaxPos) {
                     auto pos = Pos::Create(x, y);
-                    WriteHTTPResponse(conn, 200, "OK", FieldStatus(pos));
-                    return;
+                    return JsonResponse(FieldStatus(pos, PageSize(params, kMaxAdminPageSize),
+                                ParseGarrisonCursor(params)));
                 }
             } else if (path == "/player") {
-                UinType uin = std::stoul(message.Params().at("uin"));
+                UinType uin = std::stoul(params.at("uin"));
                 auto reply = PlayerStatus(uin);
-                alpha::HTTPResponseBuilder builder(conn);
-                builder.AddHeader("Server", "alpha::SimpleHTTPServer")
-                    .AddHeader("Connection", "close")
-                    .AddHeader("Date", alpha::HTTPMessage::FormatDate(alpha::Now()));
                 if (reply.empty()) {
-                    builder.status(404, "Not Found")
-                    .AddHeader("Content-Type", "text/plain")
-                    .body(alpha::Slice("Not Found\n"));
-                } else {
-                    builder.status(200, "OK")
-                    .AddHeader("Content-Type", "application/json")
-                    .body(std::move(reply));
+                    return TextResponse(404, "Not Found", "Not Found\n");
                 }
-                builder.SendWithEOM();
-                return;
+                return JsonResponse(std::move(reply));
             } else if (path == "/forcebackup") {
                 ForceBackup();
-                WriteHTTPResponse(conn, 200, "OK", "");
-                return;
+                return JsonResponse("");
             } else if (path == "/sect") {
-                unsigned sect = std::stoul(message.Params().at("type"));
+                unsigned sect = std::stoul(params.at("type"));
+                //members=N时同时列出最多N个成员, after为上一页返回的Next
+                unsigned members = PageSize(params, kMaxAdminPageSize);
+                auto it = params.find("after");
+                UinType after = it == params.end() ? 0 : std::stoul(it->second);
                 if (IsValidSectType(sect)) {
-                    WriteHTTPResponse(conn, 200, "OK",
-                            SectStatus(static_cast<SectType>(sect)));
-                    return;
+                    return JsonResponse(SectStatus(static_cast<SectType>(sect),
+                                members, after));
                 }
             } else if (path == "/removeplayer") {
-                UinType uin = std::stoul(message.Params().at("uin"));
-                auto it = combatants_.find(uin);
-                if (it == combatants_.end()) {
-                    alpha::HTTPResponseBuilder(conn)
-                        .status(404, "Not Found")
-                        .AddHeader("Server", "alpha::SimpleHTTPServer")
-                        .AddHeader("Date", alpha::HTTPMessage::FormatDate(alpha::Now()))
-                        .AddHeader("Connection", "close")
-                        .AddHeader("Content-Type", "text/plain")
-                        .body(alpha::Slice("Not Found\n"))
-                        .SendWithEOM();
-                } else {
-                    RemoveCombatant(uin);
-                    alpha::HTTPResponseBuilder(conn)
-                        .status(200, "OK")
-                        .AddHeader("Server", "alpha::SimpleHTTPServer")
-                        .AddHeader("Date", alpha::HTTPMessage::FormatDate(alpha::Now()))
-                        .AddHeader("Connection", "close")
-                        .AddHeader("Content-Type", "text/plain")
-                        .body(alpha::Slice("Done\n"))
-                        .SendWithEOM();
+                UinType uin = std::stoul(params.at("uin"));
+                if (store_->FindCombatant(uin) == nullptr) {
+                    return TextResponse(404, "Not Found", "Not Found\n");
                 }
-                return;
+                RemoveCombatant(uin);
+                return TextResponse(200, "OK", "Done\n");
             } else {
             }
         } catch(std::invalid_argument& e) {
         } catch(std::out_of_range& e) {
         }
-        alpha::HTTPResponseBuilder(conn)
-            .status(400, "Bad Request")
-            .AddHeader("Server", "alpha::SimpleHTTPServer")
-            .AddHeader("Date", alpha::HTTPMessage::FormatDate(alpha::Now()))
-            .AddHeader("Connection", "close")
-            .AddHeader("Content-Type", "application/json")
-            .body(AdminServerUsage())
-            .SendWithEOM();
+        return AdminResponse{400, "Bad Request", "application/json", AdminServerUsage()};
     }
 
     std::string Server::ServerStatus() {
-        boost::property_tree::ptree pt;
-        std::vector<int> seconds = {60, 300, 1500};
-        boost::property_tree::ptree requests;
+        JsonWriter w;
+        w.BeginObject();
+        const int seconds[] = {60, 300, 1500};
+        char buf[20];
+        w.Key("Requests");
+        w.BeginArray();
         for (auto second : seconds) {
-            char buf[20];
             ::snprintf(buf, sizeof(buf), "%ds", second);
-            boost::property_tree::ptree array_element;
-            array_element.put(buf, inspector_->SampleRequests(second));
-            requests.push_back(std::make_pair("", array_element));
+            w.BeginObject();
+            w.Member(buf, inspector_->SampleRequests(second));
+            w.EndObject();
         }
-        pt.add_child("Requests", requests);
-        requests.clear();
+        w.EndArray();
+        w.Key("SucceedRequests");
+        w.BeginArray();
         for (auto second : seconds) {
-            char buf[20];
             ::snprintf(buf, sizeof(buf), "%ds", second);
-            boost::property_tree::ptree array_element;
-            array_element.put(buf, inspector_->SampleSucceedRequests(second));
-            requests.push_back(std::make_pair("", array_element));
-        }
-        pt.add_child("SucceedRequests", requests);
-        pt.put("AverageProcessTime(us)", inspector_->AverageProcessTime());
-        pt.put("MaxRequestProcessTime(us)", inspector_->MaxRequestProcessTime());
-        pt.put("RequestPerSecond", inspector_->RequestProcessedPerSeconds());
-        pt.put("Now", alpha::HTTPMessage::FormatDate(alpha::Now()));
-        pt.put("ProcessStartTime",
+            w.BeginObject();
+            w.Member(buf, inspector_->SampleSucceedRequests(second));
+            w.EndObject();
+        }
+        w.EndArray();
+        w.Member("AverageProcessTime(us)", inspector_->AverageProcessTime());
+        //每种消息最近1/5/15分钟的耗时分位数, All为所有消息
+        //三个窗口一次算出来, 每个名字只遍历一遍最近15分钟
+        const std::vector<int> windows = {60, 300, 900};
+        auto names = inspector_->RequestLatencyNames();
+        names.insert(names.begin(), "");
+        w.Key("Latency(us)");
+        w.BeginObject();
+        for (const auto & name : names) {
+            w.Key(name.empty() ? "All" : name);
+            w.BeginObject();
+            auto histograms = inspector_->SampleRequestLatency(name, windows);
+            for (size_t i = 0; i < windows.size(); ++i) {
+                const auto & histogram = histograms[i];
+                ::snprintf(buf, sizeof(buf), "%ds", windows[i]);
+                w.Key(buf);
+                w.BeginObject();
+                w.Member("Count", histogram.Count());
+                w.Member("P50", histogram.Percentile(0.5));
+                w.Member("P90", histogram.Percentile(0.9));
+                w.Member("P99", histogram.Percentile(0.99));
+                w.Member("P999", histogram.Percentile(0.999));
+                w.EndObject();
+            }
+            w.EndObject();
+        }
+        w.EndObject();
+        w.Member("MaxRequestProcessTime(us)", inspector_->MaxRequestProcessTime());
+        w.Member("RequestPerSecond", inspector_->RequestProcessedPerSeconds());
+        w.Member("Now", alpha::HTTPMessage::FormatDate(alpha::Now()));
+        w.Member("ProcessStartTime",
                 alpha::HTTPMessage::FormatDate(inspector_->ProcessStartTime()));
-        pt.put("ProcessUpTime(ms)", alpha::Now() - inspector_->ProcessStartTime());
-        pt.put("InfoLog", alpha::LogDestination::GetLogNum(alpha::kLogLevelInfo));
-        pt.put("WarnLog", alpha::LogDestination::GetLogNum(alpha::kLogLevelWarning));
-        pt.put("ErrorLog", alpha::LogDestination::GetLogNum(alpha::kLogLevelError));
-        pt.put("BackupStatus", backup_coroutine_ && !backup_coroutine_->IsDead() ? 1 : 0);
-        pt.put("BackupEndTime", alpha::HTTPMessage::FormatDate(backup_metadata_->EndTime()));
-        pt.put("BackupPrefixIndex", current_backup_prefix_index_);
-        pt.put("LastBattleFieldResetTime",
+        w.Member("ProcessUpTime(ms)", alpha::Now() - inspector_->ProcessStartTime());
+        w.Member("StartupTime(ms)", inspector_->StartupTime());
+        w.Member("InfoLog", alpha::LogDestination::GetLogNum(alpha::kLogLevelInfo));
+        w.Member("WarnLog", alpha::LogDestination::GetLogNum(alpha::kLogLevelWarning));
+        w.Member("ErrorLog", alpha::LogDestination::GetLogNum(alpha::kLogLevelError));
+        w.Member("BackupStatus", backup_coroutine_ && !backup_coroutine_->IsDead() ? 1 : 0);
+        w.Member("BackupEndTime", alpha::HTTPMessage::FormatDate(backup_metadata_->EndTime()));
+        w.Member("BackupPrefixIndex", current_backup_prefix_index_);
+        w.Member("LastBattleFieldResetTime",
                 alpha::HTTPMessage::FormatDate(
                     backup_metadata_->LatestBattleFieldResetTime()
                     * alpha::kMilliSecondsPerSecond));
-        pt.put("CombatantsNum", combatants_.size());
-        std::ostringstream oss;
-        boost::property_tree::write_json(oss, pt);
-        return oss.str();
+        w.Member("CombatantsNum", store_->size());
+        auto slab_stats = store_->GetSlabStats();
+        w.Key("CombatantSlab");
+        w.BeginObject();
+        w.Member("Allocations", slab_stats.allocations);
+        w.Member("Frees", slab_stats.frees);
+        w.Member("Live", slab_stats.live);
+        w.Member("HighWater", slab_stats.high_water);
+        w.Member("Capacity", slab_stats.capacity);
+        w.Member("Epoch", slab_stats.epoch);
+        w.EndObject();
+        w.EndObject();
+        return w.Release();
     }
 #if 0
     void Server::AdminServerHandlePlayer(alpha::TcpConnectionPtr& conn,
@@ -244,57 +332,323 @@ namespace SectBattle {
     }
 #endif
 
-    std::string Server::FieldStatus(Pos pos) {
+    std::string Server::FieldStatus(Pos pos, unsigned max_members,
+            const CombatantIdentity& after) {
         auto & field = CheckGetField(pos);
-        // owner, garrison num
-        boost::property_tree::ptree pt;
-        pt.put("owner", field.Owner());
-        pt.put("garrison_num", field.GarrisonNum());
-        std::ostringstream oss;
-        boost::property_tree::write_json(oss, pt);
-        return oss.str();
+        // owner, garrison num, eligible num
+        JsonWriter w;
+        w.BeginObject();
+        w.Member("owner", static_cast<int>(field.Owner()));
+        w.Member("garrison_num", field.GarrisonNum());
+        w.Member("eligible_num", store_->EligibleNum(pos));
+        if (max_members != 0) {
+            //多取一个, 取到了说明还有下一页
+            unsigned n = 0;
+            const Combatant* last = nullptr;
+            bool more = false;
+            w.Key("members");
+            w.BeginArray();
+            store_->ForEachGarrison(pos, after, [&](const Combatant& combatant) {
+                if (n == max_members) {
+                    more = true;
+                    return false;
+                }
+                w.BeginObject();
+                w.Member("uin", combatant.Uin());
+                w.Member("level", combatant.Level());
+                w.Member("sect", static_cast<int>(combatant.CurrentSect()));
+                w.Member("protected", store_->InProtection(&combatant));
+                w.Member("last_defeated_time", combatant.LastDefeatedTime());
+                w.EndObject();
+                last = &combatant;
+                ++n;
+                return true;
+            });
+            w.EndArray();
+            if (more) {
+                w.Member("next", std::to_string(last->Level()) + "-"
+                        + std::to_string(last->Uin()));
+            }
+        }
+        w.EndObject();
+        return w.Release();
     }
 
-    std::string Server::SectStatus(SectType sect_type) {
+    std::string Server::SectStatus(SectType sect_type, unsigned max_members,
+            UinType after) {
         auto & sect = CheckGetSect(sect_type);
-        boost::property_tree::ptree pt;
-        pt.put("Sect", sect.Type());
-        pt.put("MembersCount", sect.MemberCount());
-        std::ostringstream oss;
-        boost::property_tree::write_json(oss, pt);
-        return oss.str();
+        JsonWriter w;
+        w.BeginObject();
+        w.Member("Sect", static_cast<int>(sect.Type()));
+        w.Member("MembersCount", sect.MemberCount());
+        if (max_members != 0) {
+            unsigned n = 0;
+            UinType last = 0;
+            bool more = false;
+            auto f = [&](const Combatant& combatant) {
+                if (n == max_members) {
+                    more = true;
+                    return false;
+                }
+                w.Value(combatant.Uin());
+                last = combatant.Uin();
+                ++n;
+                return true;
+            };
+            w.Key("Members");
+            w.BeginArray();
+            if (after == 0) {
+                store_->ForEachSectMember(sect_type, f);
+            } else if (!store_->ForEachSectMember(sect_type, after, f)) {
+                throw std::invalid_argument("cursor is not a member of sect");
+            }
+            w.EndArray();
+            if (more) {
+                w.Member("Next", last);
+            }
+        }
+        w.EndObject();
+        return w.Release();
+    }
+
+    std::string Server::PhaseStatus() {
+        //各种消息处理时每个阶段的累计耗时, 时间单位都是ns
+        JsonWriter w;
+        w.BeginObject();
+        const double cycles_per_ns = PhaseTimer::CyclesPerNanosecond();
+        for (const auto & p : inspector_->AllPhaseStatistics()) {
+            w.Key(p.first);
+            w.BeginObject();
+            for (int i = 0; i < static_cast<int>(Phase::kMax); ++i) {
+                auto phase = static_cast<Phase>(i);
+                const auto & entry = p.second.Get(phase);
+                w.Key(PhaseName(phase));
+                w.BeginObject();
+                w.Member("Count", entry.count);
+                w.Member("Average", entry.count == 0 ? 0 : static_cast<uint64_t>(
+                            entry.total_cycles / cycles_per_ns / entry.count));
+                w.Member("Max", static_cast<uint64_t>(entry.max_cycles / cycles_per_ns));
+                w.Member("Total", static_cast<uint64_t>(entry.total_cycles / cycles_per_ns));
+                w.EndObject();
+            }
+            w.EndObject();
+        }
+        w.EndObject();
+        return w.Release();
+    }
+
+    std::string Server::MetricsText() {
+        //Prometheus文本格式, 只读计数器, 不做采样和排序, 可以频繁拉取
+        MetricsWriter w;
+        const auto & all_counters = inspector_->AllRequestCounters();
+        w.Declare("sect_battle_requests_total", "counter", "Requests by message type");
+        for (const auto & p : all_counters) {
+            w.Sample("sect_battle_requests_total", p.second.requests.Value(),
+                    {{"message", p.first}});
+        }
+        w.Declare("sect_battle_request_errors_total", "counter",
+                "Requests failed without response by message type");
+        for (const auto & p : all_counters) {
+            w.Sample("sect_battle_request_errors_total", p.second.errors.Value(),
+                    {{"message", p.first}});
+        }
+        w.Declare("sect_battle_response_bytes_total", "counter",
+                "Response bytes by message type");
+        for (const auto & p : all_counters) {
+            w.Sample("sect_battle_response_bytes_total", p.second.response_bytes.Value(),
+                    {{"message", p.first}});
+        }
+        w.Declare("sect_battle_battle_field_not_modified_total", "counter",
+                "Responses whose grid was omitted because the client was up to date");
+        for (const auto & p : all_counters) {
+            w.Sample("sect_battle_battle_field_not_modified_total",
+                    p.second.battle_field_not_modified.Value(), {{"message", p.first}});
+        }
+        w.Declare("sect_battle_request_allocations_total", "counter",
+                "Heap allocations while handling requests by message type");
+        for (const auto & p : all_counters) {
+            w.Sample("sect_battle_request_allocations_total", p.second.allocations.Value(),
+                    {{"message", p.first}});
+        }
+        w.Declare("sect_battle_heap_allocations_total", "counter",
+                "Heap allocations since process start");
+        w.Sample("sect_battle_heap_allocations_total", HeapAllocations());
+        w.Declare("sect_battle_responses_total", "counter",
+                "Responses by message type and code");
+        for (const auto & p : all_counters) {
+            for (int slot = 0; slot < RequestCounters::kCodeSlots; ++slot) {
+                auto n = p.second.codes[slot].Value();
+                if (n) {
+                    w.Sample("sect_battle_responses_total", n,
+                            {{"message", p.first},
+                            {"code", RequestCounters::CodeSlotLabel(slot)}});
+                }
+            }
+        }
+        w.Declare("sect_battle_invalid_packets_total", "counter",
+                "Packets dropped before dispatch");
+        w.Sample("sect_battle_invalid_packets_total", inspector_->InvalidPackets());
+
+        auto slab_stats = store_->GetSlabStats();
+        w.Declare("sect_battle_combatants", "gauge", "Combatants in battle store");
+        w.Sample("sect_battle_combatants", static_cast<uint64_t>(store_->size()));
+        w.Declare("sect_battle_combatants_max", "gauge", "Battle store max_size()");
+        w.Sample("sect_battle_combatants_max", static_cast<uint64_t>(store_->max_size()));
+        w.Declare("sect_battle_combatants_ratio", "gauge", "size() / max_size()");
+        w.Sample("sect_battle_combatants_ratio", store_->max_size() == 0 ? 0.0
+                : static_cast<double>(store_->size()) / store_->max_size());
+        w.Declare("sect_battle_combatants_high_water", "gauge",
+                "Highest slot ever used in battle store");
+        w.Sample("sect_battle_combatants_high_water",
+                static_cast<uint64_t>(slab_stats.high_water));
+
+        w.Declare("sect_battle_protected_combatants", "gauge",
+                "Combatants still in defeated protection");
+        w.Sample("sect_battle_protected_combatants",
+                static_cast<uint64_t>(store_->ProtectedNum()));
+
+        if (capture_) {
+            w.Declare("sect_battle_captured_packets_total", "counter",
+                    "Request packets written to the capture buffer");
+            w.Sample("sect_battle_captured_packets_total", capture_->captured());
+            w.Declare("sect_battle_capture_dropped_packets_total", "counter",
+                    "Request packets dropped because the capture buffer was full");
+            w.Sample("sect_battle_capture_dropped_packets_total", capture_->dropped());
+        }
+
+        const auto & backup = inspector_->GetBackupStatistics();
+        w.Declare("sect_battle_backups_total", "counter", "Finished backups");
+        w.Sample("sect_battle_backups_total", backup.total.Value());
+        w.Declare("sect_battle_backup_failures_total", "counter", "Failed backups");
+        w.Sample("sect_battle_backup_failures_total", backup.failures.Value());
+        w.Declare("sect_battle_backup_bytes_total", "counter", "Bytes written to backup TT");
+        w.Sample("sect_battle_backup_bytes_total", backup.bytes.Value());
+        w.Declare("sect_battle_last_backup_bytes", "gauge", "Bytes written by last backup");
+        w.Sample("sect_battle_last_backup_bytes", backup.last_bytes.Value());
+        w.Declare("sect_battle_last_backup_duration_seconds", "gauge",
+                "Duration of last backup");
+        w.Sample("sect_battle_last_backup_duration_seconds",
+                backup.last_duration_ms.Value() / 1000.0);
+        w.Declare("sect_battle_backup_running", "gauge", "1 if a backup is running");
+        w.Sample("sect_battle_backup_running", static_cast<uint64_t>(
+                    backup_coroutine_ && !backup_coroutine_->IsDead() ? 1 : 0));
+
+        w.Declare("sect_battle_loop_lag_last_seconds", "gauge",
+                "Latest event loop timer lag");
+        w.Sample("sect_battle_loop_lag_last_seconds", loop_monitor_->LastLag() / 1e6);
+        w.Declare("sect_battle_loop_lag_max_seconds", "gauge",
+                "Max event loop timer lag since start");
+        w.Sample("sect_battle_loop_lag_max_seconds", loop_monitor_->MaxLag() / 1e6);
+        const auto & lag = loop_monitor_->LagHistogram();
+        w.Declare("sect_battle_loop_lag_seconds", "histogram",
+                "Event loop timer lag");
+        //le取桶的上界, 比如100us所在的桶是[100, 103], le就是103us
+        //否则和桶的边界对不齐, 累计数会偏少
+        for (int us : {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000}) {
+            const int le = LatencyHistogram::UpperBound(us);
+            w.Sample("sect_battle_loop_lag_seconds_bucket", lag.CountAtMost(le),
+                    {{"le", std::to_string(le / 1e6)}});
+        }
+        w.Sample("sect_battle_loop_lag_seconds_bucket", lag.Count(), {{"le", "+Inf"}});
+        w.Sample("sect_battle_loop_lag_seconds_sum", loop_monitor_->LagSum() / 1e6);
+        w.Sample("sect_battle_loop_lag_seconds_count", lag.Count());
+        w.Declare("sect_battle_loop_stalls_total", "counter",
+                "Event loop stalls by the slowest callback since previous check");
+        for (const auto & p : loop_monitor_->StallsByCallback()) {
+            w.Sample("sect_battle_loop_stalls_total", p.second.Value(),
+                    {{"callback", p.first}});
+        }
+
+        //管理接口占用事件循环的时间, 不包括/metrics本次的耗时
+        const auto & admin_counters = inspector_->AllAdminCounters();
+        w.Declare("sect_battle_admin_requests_total", "counter", "Admin requests by path");
+        for (const auto & p : admin_counters) {
+            w.Sample("sect_battle_admin_requests_total", p.second.requests.Value(),
+                    {{"path", p.first}});
+        }
+        w.Declare("sect_battle_admin_seconds_total", "counter",
+                "Event loop time spent in admin requests by path");
+        for (const auto & p : admin_counters) {
+            w.Sample("sect_battle_admin_seconds_total", p.second.microseconds.Value() / 1e6,
+                    {{"path", p.first}});
+        }
+        w.Declare("sect_battle_admin_max_seconds", "gauge",
+                "Slowest admin request by path since start");
+        for (const auto & p : admin_counters) {
+            w.Sample("sect_battle_admin_max_seconds",
+                    p.second.max_microseconds.Value() / 1e6, {{"path", p.first}});
+        }
+
+        w.Declare("sect_battle_start_time_seconds", "gauge", "Process start time");
+        w.Sample("sect_battle_start_time_seconds",
+                static_cast<uint64_t>(inspector_->ProcessStartTime() / 1000));
+        return w.str();
+    }
+
+    std::string Server::StallStatus() {
+        JsonWriter w;
+        w.BeginObject();
+        w.Member("Interval(ms)", loop_monitor_->interval());
+        w.Member("StallThreshold(ms)", loop_monitor_->stall_threshold());
+        w.Key("Lag(us)");
+        w.BeginObject();
+        const std::vector<int> windows = {60, 300, 900};
+        auto histograms = loop_monitor_->SampleLag(windows);
+        for (size_t i = 0; i < windows.size(); ++i) {
+            const auto & histogram = histograms[i];
+            w.Key(std::to_string(windows[i]) + "s");
+            w.BeginObject();
+            w.Member("Count", histogram.Count());
+            w.Member("P50", histogram.Percentile(0.5));
+            w.Member("P99", histogram.Percentile(0.99));
+            w.Member("P999", histogram.Percentile(0.999));
+            w.EndObject();
+        }
+        w.EndObject();
+        w.Member("MaxLag(us)", loop_monitor_->MaxLag());
+        w.Key("RecentStalls");
+        w.BeginArray();
+        for (const auto & stall : loop_monitor_->RecentStalls()) {
+            w.BeginObject();
+            w.Member("Time", alpha::HTTPMessage::FormatDate(stall.time));
+            w.Member("Lag(us)", stall.lag);
+            w.Member("Callback", stall.callback);
+            w.Member("Duration(us)", stall.duration);
+            w.EndObject();
+        }
+        w.EndArray();
+        w.EndObject();
+        return w.Release();
     }
 
     std::string Server::PlayerStatus(UinType uin) {
-        auto it = combatants_.find(uin);
-        if (it == combatants_.end()) {
+        const Combatant* combatant = store_->FindCombatant(uin);
+        if (combatant == nullptr) {
             return "";
         }
 
-        auto & combatant = it->second;
-        boost::property_tree::ptree pt;
-        pt.put("Sect", combatant.CurrentSect()->Type());
-        pt.put("Pos-X", combatant.CurrentPos().X());
-        pt.put("Pos-Y", combatant.CurrentPos().Y());
-        auto & identity = *combatant.Iterator();
-        pt.put("Level", std::get<kCombatantLevel>(identity));
-        pt.put("LastDefeatedTime", std::get<kCombatantDefeatedTimeStamp>(identity));
-        pt.put("Uin", std::get<kCombatantUin>(identity));
-        std::ostringstream oss;
-        boost::property_tree::write_json(oss, pt);
-        return oss.str();
+        JsonWriter w;
+        w.BeginObject();
+        w.Member("Sect", static_cast<int>(combatant->CurrentSect()));
+        w.Member("Pos-X", combatant->CurrentPos().X());
+        w.Member("Pos-Y", combatant->CurrentPos().Y());
+        w.Member("Level", combatant->Level());
+        w.Member("LastDefeatedTime", combatant->LastDefeatedTime());
+        w.Member("Uin", combatant->Uin());
+        w.EndObject();
+        return w.Release();
     }
 
     std::string Server::AdminServerUsage() const {
-        std::ostringstream oss;
-        boost::property_tree::ptree pt;
-        boost::property_tree::ptree usage;
-        std::vector<std::string> usages = {
+        static const char* const kUsages[] = {
             "GET /player?uin=$UIN",
             "GET /removeplayer?uin=$UIN",
             "GET /status",
-            "GET /field?x=$X&y=$Y",
-            "GET /sect?type=$TYPE",
+            "GET /phases",
+            "GET /metrics",
+            "GET /stalls",
+            "GET /field?x=$X&y=$Y[&members=$LIMIT[&after=$NEXT]]",
+            "GET /sect?type=$TYPE[&members=$LIMIT[&after=$NEXT]]",
             "GET /forcebackup",
         };
 #if 0
@@ -307,15 +661,16 @@ namespace SectBattle {
             "POST /forcebackup",
         };
 #endif
-        for (const auto& msg : usages) {
-            boost::property_tree::ptree array_element;
-            array_element.put_value(msg);
-            usage.push_back(std::make_pair("", array_element));
+        JsonWriter w;
+        w.BeginObject();
+        w.Key("usage");
+        w.BeginArray();
+        for (auto usage : kUsages) {
+            w.Value(usage);
         }
-        pt.add_child("usage", usage);
-
-        boost::property_tree::write_json(oss, pt);
-        return oss.str();
+        w.EndArray();
+        w.EndObject();
+        return w.Release();
     }
 
     void Server::ForceBackup() {
@@ -323,28 +678,8 @@ namespace SectBattle {
     }
 
     void Server::RemoveCombatant(UinType uin) {
-        auto & combatant = CheckGetCombatant(uin);
-        auto & field = CheckGetField(combatant.CurrentPos());
-        field.ReduceGarrison(uin, combatant.Iterator());
-        auto & sect = CheckGetSect(combatant.CurrentSect()->Type());
-        sect.RemoveMember(uin);
-        combatants_.erase(uin);
-        combatant_map_->erase(uin);
-        opponent_map_->erase(uin);
-    }
-
-    void Server::WriteHTTPResponse(alpha::TcpConnectionPtr& conn,
-            int status,
-            alpha::Slice status_string,
-            alpha::Slice body) {
-
-        alpha::HTTPResponseBuilder builder(conn);
-        builder.status(status, status_string)
-            .AddHeader("Server", "alpha::SimpleHTTPServer")
-            .AddHeader("Connection", "close")
-            .AddHeader("Content-Type", "application/json")
-            .AddHeader("Date", alpha::HTTPMessage::FormatDate(alpha::Now()))
-            .body(body)
-            .SendWithEOM();
+        Combatant* combatant = store_->FindCombatant(uin);
+        assert (combatant);
+        store_->RemoveCombatant(combatant);
     }
 }
@@ -0,0 +1,47 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_alloc_counter.cc
+ *        Created:  06/09/15 17:03:40
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_alloc_counter.h"
+#include <cstdlib>
+#include <atomic>
+#include <new>
+
+namespace {
+    std::atomic<uint64_t> heap_allocations(0);
+    //常量初始化, 访问时不需要再分配
+    thread_local uint64_t thread_heap_allocations = 0;
+}
+
+namespace SectBattle {
+    uint64_t HeapAllocations() {
+        return heap_allocations.load(std::memory_order_relaxed);
+    }
+
+    uint64_t ThreadHeapAllocations() {
+        return thread_heap_allocations;
+    }
+}
+
+//new[]和delete[]默认会转调这两个
+void* operator new(std::size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    ++thread_heap_allocations;
+    void* p = ::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    ::free(p);
+}
@@ -0,0 +1,27 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_alloc_counter.h
+ *        Created:  06/09/15 16:55:02
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  替换全局的operator new, 统计堆分配的次数
+ *                  用来确认处理请求的过程中没有分配内存
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_ALLOC_COUNTER_H__
+#define  __SECT_BATTLE_ALLOC_COUNTER_H__
+
+#include <cstdint>
+
+namespace SectBattle {
+    //进程启动以来调用operator new的次数
+    uint64_t HeapAllocations();
+    //当前线程调用operator new的次数, 统计单个请求时用这个
+    //不会算上备份, 存档和抓包等后台线程的分配
+    uint64_t ThreadHeapAllocations();
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_ALLOC_COUNTER_H__  ----- */
@@ -14,6 +14,7 @@
 #include <alpha/logger.h>
 #include "tt_client.h"
 #include "sect_battle_backup_metadata.h"
+#include "sect_battle_crc32c.h"
 
 namespace SectBattle {
     BackupCoroutine::BackupCoroutine(tokyotyrant::Client* client, 
@@ -23,6 +24,7 @@ namespace SectBattle {
                     BackupMetadata* md)
             :client_(client), backup_server_address_(backup_server_address),
              backup_prefix_(backup_prefix.ToString()), 
+             manifest_(BackupManifest::Default(0)),
              backup_metadata_(md) {
             assert (md);
             assert (client);
@@ -43,6 +45,7 @@ namespace SectBattle {
         }
         md->SetBackupStartTime(alpha::Now());
         md->SetLatestBackupPrefix(backup_prefix_);
+        manifest_ = BackupManifest::Default(md->StartTime());
         client_->SetCoroutine(this);
         const int kDataExpireTime = 5 * 60 * 1000; //5mins in milliseconds
         auto connect_start_time = alpha::Now();
@@ -79,6 +82,11 @@ namespace SectBattle {
         }
         md->SetBackupEndTime(alpha::Now());
 
+        if (BackupManifestFile() == false) {
+            LOG_WARNING << "BackupManifestFile failed";
+            return;
+        }
+
         if(BackupMMapedFiles(true) == false) {
             LOG_WARNING << "Backup metadata failed";
             return;
@@ -94,6 +102,10 @@ namespace SectBattle {
         return succeed_;
     }
 
+    uint64_t BackupCoroutine::bytes_written() const {
+        return bytes_written_;
+    }
+
     bool BackupCoroutine::DeletePreviousBackup() {
         //先清空所有prefix开头的key
         std::vector<std::string> keys;
@@ -122,9 +134,6 @@ namespace SectBattle {
         //TT其实是有value大小限制的
         const size_t kMaxValueSize = 1 << 24;
         for (const auto& p : mmaped_file_copies_) {
-            int parts = 0;
-            std::string key = backup_prefix_ + "_" + p.first;
-
             if (!update_backup_metadata && p.first == kBackupMetaDataKey) {
                 //不备份metadata
                 continue;
@@ -134,46 +143,56 @@ namespace SectBattle {
                 continue;
             }
 
-            if (p.first == kBackupMetaDataKey) {
-                //metadata只有一份, 所以不需要前缀
-                key = p.first;
-            }
-
             const Buffer& buffer = p.second;
             alpha::Slice data = alpha::Slice(buffer.data(), buffer.size());
-            if (buffer.size() > kMaxValueSize) {
-                parts = buffer.size() / kMaxValueSize + 1;
+            if (p.first == kBackupMetaDataKey) {
+                //metadata只有一份, 所以不需要前缀
+                if (!BackupMMapedFilePart(p.first, data)) {
+                    return false;
+                }
+                continue;
             }
-            LOG_INFO << "key = " << key << ", buffer.size() = " << buffer.size()
-                << ", parts = " << parts;
 
-            //可以一次性备份的
-            if (parts == 0 && !BackupMMapedFilePart(key, data)) {
+            if (!manifest_.AddFile(p.first, data, kMaxValueSize)) {
                 return false;
             }
-
-            //需要多次备份的
-            if (parts != 0) {
-                for (int i = 0; i < parts; ++i) {
-                    std::string part_key = key + "_" + std::to_string(i + 1);
-                    alpha::Slice part_data = data.subslice(0, kMaxValueSize);
-                    if (!BackupMMapedFilePart(part_key, part_data)) {
-                        return false;
-                    } else {
-                        data.Advance(std::min(kMaxValueSize, data.size()));
-                    }
+            const auto* file = manifest_.FindFile(p.first);
+            assert (file);
+            LOG_INFO << "key = " << p.first << ", buffer.size() = " << buffer.size()
+                << ", parts = " << file->parts;
+
+            for (uint32_t part = 0; part < file->parts; ++part) {
+                auto part_key = BackupManifest::PartKey(backup_prefix_, p.first,
+                        part, file->parts);
+                alpha::Slice part_data = data.subslice(0, file->PartSize(part));
+                if (!BackupMMapedFilePart(part_key, part_data)) {
+                    return false;
                 }
-                assert (data.empty());
+                data.Advance(part_data.size());
             }
+            assert (data.empty());
         }
         return true;
     }
 
+    bool BackupCoroutine::BackupManifestFile() {
+        //manifest必须在metadata之前写入
+        //这样metadata指向的备份一定能找到对应的manifest
+        auto key = BackupManifest::ManifestKey(backup_prefix_);
+        LOG_INFO << "Backup manifest, key = " << key
+            << ", files = " << manifest_.FileCount()
+            << ", crc32c hardware accelerated = " << Crc32cHardwareAccelerated();
+        return BackupMMapedFilePart(key, manifest_.AsSlice());
+    }
+
     bool BackupCoroutine::BackupMMapedFilePart(alpha::Slice key, alpha::Slice data) {
         LOG_INFO << "key = " << key.data();
         int err = client_->Put(key, data);
         LOG_ERROR_IF(err != 0) << "Put failed, key = " << key.ToString()
             << ", err = " << err;
+        if (err == 0) {
+            bytes_written_ += data.size();
+        }
         return err == 0;
     }
 }
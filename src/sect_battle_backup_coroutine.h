@@ -20,6 +20,7 @@
 #include <alpha/net_address.h>
 #include "sect_battle_server_def.h"
 #include "sect_battle_backup_metadata.h"
+#include "sect_battle_backup_manifest.h"
 
 namespace tokyotyrant {
     class Client;
@@ -35,6 +36,8 @@ namespace SectBattle {
                     BackupMetadata* md);
             virtual void Routine() override;
             bool succeed() const;
+            //已经成功写到备份服务器的字节数
+            uint64_t bytes_written() const;
 
         private:
             using Buffer = std::vector<char>;
@@ -42,12 +45,15 @@ namespace SectBattle {
             bool DeletePreviousBackup();
             bool BackupMMapedFiles(bool only_backup_metadata);
             bool BackupMMapedFilePart(alpha::Slice key, alpha::Slice data);
+            bool BackupManifestFile();
             tokyotyrant::Client* client_;
             alpha::NetAddress backup_server_address_;
             std::string backup_prefix_;
             std::map<std::string, Buffer> mmaped_file_copies_;
+            BackupManifest manifest_;
             BackupMetadata* backup_metadata_;
             bool succeed_ = false;
+            uint64_t bytes_written_ = 0;
     };
 }
 
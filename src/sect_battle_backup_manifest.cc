@@ -0,0 +1,157 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_backup_manifest.cc
+ *        Created:  06/02/15 11:31:20
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_backup_manifest.h"
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
+#include <alpha/logger.h>
+#include "sect_battle_crc32c.h"
+
+namespace SectBattle {
+    static_assert (std::is_pod<BackupManifest>::value, "BackupManifest must be POD type");
+    const uint32_t BackupManifest::kFormatVersion;
+
+    std::string BackupManifest::FileEntry::Key() const {
+        return std::string(key, strnlen(key, sizeof(key)));
+    }
+
+    uint64_t BackupManifest::FileEntry::PartSize(uint32_t part) const {
+        assert (part < parts);
+        if (part + 1 != parts) {
+            return part_size;
+        }
+        return size - static_cast<uint64_t>(part_size) * part;
+    }
+
+    BackupManifest BackupManifest::Default(alpha::TimeStamp backup_start_time) {
+        BackupManifest manifest;
+        memset(&manifest, 0x0, sizeof(manifest));
+        manifest.magic_ = kMagic;
+        manifest.version_ = kFormatVersion;
+        manifest.backup_start_time_ = backup_start_time;
+        return manifest;
+    }
+
+    const BackupManifest* BackupManifest::Restore(const char* data, size_t size) {
+        if (size != sizeof(BackupManifest)) {
+            LOG_WARNING << "Invalid size = " << size
+                << ", sizeof(BackupManifest) = " << sizeof(BackupManifest);
+            return nullptr;
+        }
+        auto manifest = reinterpret_cast<const BackupManifest*>(data);
+        if (manifest->magic_ != kMagic) {
+            LOG_WARNING << "Mismatch magic, manifest->magic_ = " << manifest->magic_;
+            return nullptr;
+        }
+        if (manifest->version_ != kFormatVersion) {
+            LOG_WARNING << "Unsupported manifest version = " << manifest->version_
+                << ", expected = " << kFormatVersion;
+            return nullptr;
+        }
+        if (manifest->file_count_ < 0 || manifest->file_count_ > kMaxFiles) {
+            LOG_WARNING << "Invalid file_count_ = " << manifest->file_count_;
+            return nullptr;
+        }
+        for (int i = 0; i < manifest->file_count_; ++i) {
+            const FileEntry& file = manifest->files_[i];
+            if (std::find(std::begin(file.key), std::end(file.key), '\0')
+                    == std::end(file.key)) {
+                LOG_WARNING << "Invalid key, index = " << i;
+                return nullptr;
+            }
+            if (file.part_size == 0 || file.parts > kMaxParts
+                    || file.parts != std::max<uint64_t>(
+                        (file.size + file.part_size - 1) / file.part_size, 1)) {
+                LOG_WARNING << "Invalid parts, key = " << file.key
+                    << ", size = " << file.size
+                    << ", part_size = " << file.part_size
+                    << ", parts = " << file.parts;
+                return nullptr;
+            }
+        }
+        return manifest;
+    }
+
+    bool BackupManifest::AddFile(alpha::Slice key, alpha::Slice data, size_t part_size) {
+        assert (part_size);
+        if (file_count_ == kMaxFiles) {
+            LOG_ERROR << "Too many files in manifest, key = " << key.ToString();
+            return false;
+        }
+        if (key.size() >= kMaxKeySize || FindFile(key)) {
+            LOG_ERROR << "Invalid key = " << key.ToString();
+            return false;
+        }
+        uint64_t parts = std::max<uint64_t>((data.size() + part_size - 1) / part_size, 1);
+        if (parts > kMaxParts) {
+            LOG_ERROR << "Too many parts, key = " << key.ToString()
+                << ", data.size() = " << data.size()
+                << ", part_size = " << part_size;
+            return false;
+        }
+
+        FileEntry& file = files_[file_count_];
+        memset(&file, 0x0, sizeof(file));
+        ::memcpy(file.key, key.data(), key.size());
+        file.size = data.size();
+        file.part_size = part_size;
+        file.parts = parts;
+        for (uint32_t part = 0; part < file.parts; ++part) {
+            auto part_data = alpha::Slice(data.data() + part * part_size,
+                    file.PartSize(part));
+            file.crc[part] = Crc32c(part_data);
+        }
+        ++file_count_;
+        return true;
+    }
+
+    const BackupManifest::FileEntry* BackupManifest::FindFile(alpha::Slice key) const {
+        for (int i = 0; i < file_count_; ++i) {
+            if (files_[i].Key() == key.ToString()) {
+                return &files_[i];
+            }
+        }
+        return nullptr;
+    }
+
+    int BackupManifest::FileCount() const {
+        return file_count_;
+    }
+
+    const BackupManifest::FileEntry& BackupManifest::File(int index) const {
+        assert (index >= 0 && index < file_count_);
+        return files_[index];
+    }
+
+    alpha::TimeStamp BackupManifest::BackupStartTime() const {
+        return backup_start_time_;
+    }
+
+    alpha::Slice BackupManifest::AsSlice() const {
+        return alpha::Slice(reinterpret_cast<const char*>(this), sizeof(*this));
+    }
+
+    std::string BackupManifest::PartKey(alpha::Slice prefix, alpha::Slice key,
+            uint32_t part, uint32_t parts) {
+        assert (part < parts);
+        std::string res = prefix.ToString() + "_" + key.ToString();
+        if (parts == 1) {
+            return res;
+        }
+        return res + "_" + std::to_string(part + 1);
+    }
+
+    std::string BackupManifest::ManifestKey(alpha::Slice prefix) {
+        return prefix.ToString() + "_manifest";
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_backup_manifest.h
+ *        Created:  06/02/15 11:05:48
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  描述一次备份的内容, 恢复时用来校验
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_BACKUP_MANIFEST_H__
+#define  __SECT_BATTLE_BACKUP_MANIFEST_H__
+
+#include <string>
+#include <alpha/slice.h>
+#include <alpha/time_util.h>
+
+namespace SectBattle {
+    //和BackupMetadata一样直接以二进制的形式放到TT里
+    class BackupManifest {
+        public:
+            static const uint32_t kFormatVersion = 1;
+            static const int kMaxFiles = 8;
+            static const int kMaxParts = 32;
+            static const int kMaxKeySize = 32;
+            struct FileEntry {
+                char key[kMaxKeySize];
+                uint64_t size;
+                uint32_t part_size;
+                uint32_t parts;
+                uint32_t crc[kMaxParts];
+
+                std::string Key() const;
+                //第part块(从0开始)的大小
+                uint64_t PartSize(uint32_t part) const;
+            };
+
+            static BackupManifest Default(alpha::TimeStamp backup_start_time);
+            static const BackupManifest* Restore(const char* data, size_t size);
+            //把文件按part_size切块并计算每一块的CRC32C
+            bool AddFile(alpha::Slice key, alpha::Slice data, size_t part_size);
+            const FileEntry* FindFile(alpha::Slice key) const;
+            int FileCount() const;
+            const FileEntry& File(int index) const;
+            alpha::TimeStamp BackupStartTime() const;
+            alpha::Slice AsSlice() const;
+            //TT中存放第part块数据的key, 只有一块的时候不带后缀(兼容之前的备份)
+            static std::string PartKey(alpha::Slice prefix, alpha::Slice key,
+                    uint32_t part, uint32_t parts);
+            static std::string ManifestKey(alpha::Slice prefix);
+
+        private:
+            static const int64_t kMagic = 0x1f5b2a9e4c7d0366;
+            BackupManifest() = default;
+            int64_t magic_;
+            uint32_t version_;
+            int32_t file_count_;
+            alpha::TimeStamp backup_start_time_;
+            FileEntry files_[kMaxFiles];
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_BACKUP_MANIFEST_H__  ----- */
@@ -0,0 +1,88 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_crc32c.cc
+ *        Created:  06/02/15 10:27:04
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_crc32c.h"
+#include <cstring>
+
+namespace {
+    const uint32_t kCastagnoliPolynomial = 0x82f63b78; //reversed
+
+    struct Crc32cTable {
+        Crc32cTable() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; ++j) {
+                    crc = (crc >> 1) ^ (kCastagnoliPolynomial & (0 - (crc & 1)));
+                }
+                table[i] = crc;
+            }
+        }
+        uint32_t table[256];
+    };
+
+    uint32_t SoftwareCrc32c(uint32_t crc, const uint8_t* p, size_t size) {
+        static const Crc32cTable t;
+        while (size--) {
+            crc = t.table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    uint32_t HardwareCrc32c(uint32_t crc, const uint8_t* p, size_t size) {
+        uint64_t crc64 = crc;
+        while (size >= sizeof(uint64_t)) {
+            uint64_t val;
+            ::memcpy(&val, p, sizeof(val));
+            crc64 = __builtin_ia32_crc32di(crc64, val);
+            p += sizeof(val);
+            size -= sizeof(val);
+        }
+        crc = static_cast<uint32_t>(crc64);
+        while (size--) {
+            crc = __builtin_ia32_crc32qi(crc, *p++);
+        }
+        return crc;
+    }
+
+    bool HasHardwareCrc32c() {
+        static const bool supported = __builtin_cpu_supports("sse4.2");
+        return supported;
+    }
+#else
+    uint32_t HardwareCrc32c(uint32_t crc, const uint8_t* p, size_t size) {
+        return SoftwareCrc32c(crc, p, size);
+    }
+
+    bool HasHardwareCrc32c() {
+        return false;
+    }
+#endif
+}
+
+namespace SectBattle {
+    uint32_t Crc32c(alpha::Slice data, uint32_t crc) {
+        auto p = reinterpret_cast<const uint8_t*>(data.data());
+        crc = ~crc;
+        if (HasHardwareCrc32c()) {
+            crc = HardwareCrc32c(crc, p, data.size());
+        } else {
+            crc = SoftwareCrc32c(crc, p, data.size());
+        }
+        return ~crc;
+    }
+
+    bool Crc32cHardwareAccelerated() {
+        return HasHardwareCrc32c();
+    }
+}
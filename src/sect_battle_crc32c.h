@@ -0,0 +1,27 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_crc32c.h
+ *        Created:  06/02/15 10:21:37
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  CRC32C(Castagnoli), 支持SSE4.2的机器上使用硬件指令
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_CRC32C_H__
+#define  __SECT_BATTLE_CRC32C_H__
+
+#include <cstdint>
+#include <alpha/slice.h>
+
+namespace SectBattle {
+    //计算data的CRC32C, 传入上一段的结果可以接着计算
+    //Crc32c(a + b) == Crc32c(b, Crc32c(a))
+    uint32_t Crc32c(alpha::Slice data, uint32_t crc = 0);
+    //当前是否使用了硬件指令
+    bool Crc32cHardwareAccelerated();
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_CRC32C_H__  ----- */
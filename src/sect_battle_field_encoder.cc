@@ -0,0 +1,223 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_field_encoder.cc
+ *        Created:  06/09/15 11:30:15
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_field_encoder.h"
+#include <cassert>
+#include <cstring>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include "sect_battle_protocol.pb.h"
+#include "sect_battle_store.h"
+
+namespace SectBattle {
+    using google::protobuf::io::CodedOutputStream;
+    using google::protobuf::internal::WireFormatLite;
+
+    namespace {
+        uint8_t* WriteTag(int field_number, WireFormatLite::WireType type,
+                uint8_t* target) {
+            return CodedOutputStream::WriteTagToArray(
+                    WireFormatLite::MakeTag(field_number, type), target);
+        }
+
+        size_t TagSize(int field_number, WireFormatLite::WireType type) {
+            return CodedOutputStream::VarintSize32(
+                    WireFormatLite::MakeTag(field_number, type));
+        }
+
+        //get(i)返回第i个值, n为0时什么都不写
+        template<typename Getter>
+        uint8_t* WritePacked(int field_number, int n, Getter get, uint8_t* target) {
+            if (n == 0) {
+                return target;
+            }
+            uint32_t size = 0;
+            for (int i = 0; i < n; ++i) {
+                size += CodedOutputStream::VarintSize32(get(i));
+            }
+            target = WriteTag(field_number, WireFormatLite::WIRETYPE_LENGTH_DELIMITED,
+                    target);
+            target = CodedOutputStream::WriteVarint32ToArray(size, target);
+            for (int i = 0; i < n; ++i) {
+                target = CodedOutputStream::WriteVarint32ToArray(get(i), target);
+            }
+            return target;
+        }
+
+        uint8_t* WriteLengthDelimited(int field_number, const uint8_t* data,
+                size_t size, uint8_t* target) {
+            target = WriteTag(field_number, WireFormatLite::WIRETYPE_LENGTH_DELIMITED,
+                    target);
+            target = CodedOutputStream::WriteVarint32ToArray(size, target);
+            ::memcpy(target, data, size);
+            return target + size;
+        }
+    }
+
+    const int BattleFieldEncoder::kMaxSnapshots;
+    const int BattleFieldEncoder::kMaxCellSize;
+    const int BattleFieldEncoder::kMaxCompactSize;
+
+    bool BattleFieldEncoder::Update(BattleStore* store) {
+        if (store->FieldVersion() == version_) {
+            return false;
+        }
+        version_ = store->FieldVersion();
+        latest_snapshot_ = (latest_snapshot_ + 1) % kMaxSnapshots;
+        Snapshot& snapshot = snapshots_[latest_snapshot_];
+        snapshot.version = version_;
+
+        //和Pos的顺序保持一致(先按y再按x)
+        uint8_t* target = cells_.data();
+        int index = 0;
+        for (int y = 0; y <= Pos::kMaxPos; ++y) {
+            for (int x = 0; x <= Pos::kMaxPos; ++x, ++index) {
+                const Field& field = store->GetField(Pos::Create(x, y));
+                const auto owner = static_cast<uint32_t>(field.Owner());
+                const auto garrison_num = field.GarrisonNum();
+                snapshot.owners[index] = owner;
+                snapshot.garrison_nums[index] = garrison_num;
+                const size_t size = TagSize(PBField::kOwnerFieldNumber,
+                        WireFormatLite::WIRETYPE_VARINT)
+                    + CodedOutputStream::VarintSize32(owner)
+                    + TagSize(PBField::kGarrisonNumFieldNumber,
+                            WireFormatLite::WIRETYPE_VARINT)
+                    + CodedOutputStream::VarintSize32(garrison_num);
+                target = WriteTag(BattleField::kFieldFieldNumber,
+                        WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+                target = CodedOutputStream::WriteVarint32ToArray(size, target);
+                target = WriteTag(PBField::kOwnerFieldNumber,
+                        WireFormatLite::WIRETYPE_VARINT, target);
+                target = CodedOutputStream::WriteVarint32ToArray(owner, target);
+                target = WriteTag(PBField::kGarrisonNumFieldNumber,
+                        WireFormatLite::WIRETYPE_VARINT, target);
+                target = CodedOutputStream::WriteVarint32ToArray(garrison_num, target);
+            }
+        }
+        cells_size_ = target - cells_.data();
+        assert (cells_size_ <= cells_.size());
+
+        target = WritePacked(BattleField::kOwnersFieldNumber, kBattleFieldCount,
+                [&snapshot](int i) { return snapshot.owners[i]; }, compact_.data());
+        target = WritePacked(BattleField::kGarrisonNumsFieldNumber, kBattleFieldCount,
+                [&snapshot](int i) { return snapshot.garrison_nums[i]; }, target);
+        compact_size_ = target - compact_.data();
+        assert (compact_size_ <= compact_.size());
+        return true;
+    }
+
+    uint8_t* BattleFieldEncoder::WritePosition(Pos self_position, uint8_t* target) {
+        const size_t size = TagSize(PBPos::kXFieldNumber, WireFormatLite::WIRETYPE_VARINT)
+            + CodedOutputStream::VarintSize32SignExtended(self_position.X())
+            + TagSize(PBPos::kYFieldNumber, WireFormatLite::WIRETYPE_VARINT)
+            + CodedOutputStream::VarintSize32SignExtended(self_position.Y());
+        target = WriteTag(BattleField::kSelfPositionFieldNumber,
+                WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+        target = CodedOutputStream::WriteVarint32ToArray(size, target);
+        target = WriteTag(PBPos::kXFieldNumber, WireFormatLite::WIRETYPE_VARINT, target);
+        target = CodedOutputStream::WriteVarint32SignExtendedToArray(self_position.X(),
+                target);
+        target = WriteTag(PBPos::kYFieldNumber, WireFormatLite::WIRETYPE_VARINT, target);
+        return CodedOutputStream::WriteVarint32SignExtendedToArray(self_position.Y(),
+                target);
+    }
+
+    uint8_t* BattleFieldEncoder::WriteToArray(int field_number, Pos self_position,
+            uint8_t* target) const {
+        assert (version_ != 0);
+        //self_position和version, 旧格式的客户端也要知道版本才能带grid_version
+        uint8_t head[48];
+        uint8_t* p = WritePosition(self_position, head);
+        p = WriteTag(BattleField::kVersionFieldNumber, WireFormatLite::WIRETYPE_VARINT, p);
+        p = CodedOutputStream::WriteVarint64ToArray(version_, p);
+        const size_t head_size = p - head;
+        target = WriteTag(field_number, WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+        target = CodedOutputStream::WriteVarint32ToArray(head_size + cells_size_, target);
+        ::memcpy(target, head, head_size);
+        target += head_size;
+        ::memcpy(target, cells_.data(), cells_size_);
+        return target + cells_size_;
+    }
+
+    uint8_t* BattleFieldEncoder::WriteNotModifiedToArray(int field_number,
+            Pos self_position, uint64_t version, uint8_t* target) {
+        uint8_t body[64];
+        uint8_t* p = WritePosition(self_position, body);
+        p = WriteTag(BattleField::kVersionFieldNumber, WireFormatLite::WIRETYPE_VARINT, p);
+        p = CodedOutputStream::WriteVarint64ToArray(version, p);
+        return WriteLengthDelimited(field_number, body, p - body, target);
+    }
+
+    uint8_t* BattleFieldEncoder::WriteCompactToArray(int field_number,
+            Pos self_position, uint64_t base_version, uint8_t* target) {
+        assert (version_ != 0);
+        uint8_t* body = scratch_.data();
+        uint8_t* p = WritePosition(self_position, body);
+        p = WriteTag(BattleField::kVersionFieldNumber, WireFormatLite::WIRETYPE_VARINT, p);
+        p = CodedOutputStream::WriteVarint64ToArray(version_, p);
+
+        bool delta = false;
+        const Snapshot* base = base_version ? FindSnapshot(base_version) : nullptr;
+        if (base) {
+            uint8_t* q = WriteTag(BattleField::kBaseVersionFieldNumber,
+                    WireFormatLite::WIRETYPE_VARINT, p);
+            q = CodedOutputStream::WriteVarint64ToArray(base_version, q);
+            const size_t delta_size = EncodeDelta(*base, q);
+            //变化太多时还不如发完整的
+            if (static_cast<size_t>(q - p) + delta_size < compact_size_) {
+                p = q + delta_size;
+                delta = true;
+            }
+        }
+        if (!delta) {
+            ::memcpy(p, compact_.data(), compact_size_);
+            p += compact_size_;
+        }
+        assert (static_cast<size_t>(p - body) <= scratch_.size());
+        return WriteLengthDelimited(field_number, body, p - body, target);
+    }
+
+    const BattleFieldEncoder::Snapshot* BattleFieldEncoder::FindSnapshot(
+            uint64_t version) const {
+        for (int i = 0; i < kMaxSnapshots; ++i) {
+            //从新往旧找, 最常见的是刚刚拿到的版本
+            const Snapshot& snapshot =
+                snapshots_[(latest_snapshot_ - i + kMaxSnapshots) % kMaxSnapshots];
+            if (snapshot.version == 0) {
+                break;
+            }
+            if (snapshot.version == version) {
+                return &snapshot;
+            }
+        }
+        return nullptr;
+    }
+
+    size_t BattleFieldEncoder::EncodeDelta(const Snapshot& base, uint8_t* target) const {
+        const Snapshot& latest = snapshots_[latest_snapshot_];
+        std::array<uint32_t, kBattleFieldCount> changed;
+        int n = 0;
+        for (int i = 0; i < kBattleFieldCount; ++i) {
+            if (latest.owners[i] != base.owners[i]
+                    || latest.garrison_nums[i] != base.garrison_nums[i]) {
+                changed[n++] = i;
+            }
+        }
+        uint8_t* p = WritePacked(BattleField::kChangedFieldNumber, n,
+                [&changed](int i) { return changed[i]; }, target);
+        p = WritePacked(BattleField::kOwnersFieldNumber, n,
+                [&changed, &latest](int i) { return latest.owners[changed[i]]; }, p);
+        p = WritePacked(BattleField::kGarrisonNumsFieldNumber, n,
+                [&changed, &latest](int i) { return latest.garrison_nums[changed[i]]; }, p);
+        return p - target;
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_field_encoder.h
+ *        Created:  06/09/15 11:02:37
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  预先把81个格子编码成BattleField的字节
+ *                  回包时直接拷贝, 不用构造81个PBField
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_FIELD_ENCODER_H__
+#define  __SECT_BATTLE_FIELD_ENCODER_H__
+
+#include <array>
+#include <cstdint>
+#include "sect_battle_server_def.h"
+
+namespace SectBattle {
+    enum class BattleFieldFormat {
+        kLegacy = 0, //81个PBField
+        kCompact = 1, //packed的owners和garrison_nums, 可以只发变化的格子
+    };
+
+    class BattleStore;
+    class BattleFieldEncoder {
+        public:
+            //保留最近多少个版本用来算差异
+            static const int kMaxSnapshots = 64;
+
+            //store的FieldVersion变了才重新编码, 返回是否重新编码了
+            bool Update(BattleStore* store);
+            uint64_t version() const { return version_; }
+            //写入整个battle_field字段(包括tag, 长度和version), 返回写完之后的位置
+            uint8_t* WriteToArray(int field_number, Pos self_position,
+                    uint8_t* target) const;
+            //客户端的版本就是最新的, 只写self_position和version
+            static uint8_t* WriteNotModifiedToArray(int field_number, Pos self_position,
+                    uint64_t version, uint8_t* target);
+            //紧凑格式, base_version还在最近的快照中并且差异更小时只写变化的格子
+            uint8_t* WriteCompactToArray(int field_number, Pos self_position,
+                    uint64_t base_version, uint8_t* target);
+
+        private:
+            struct Snapshot {
+                uint64_t version;
+                std::array<uint32_t, kBattleFieldCount> owners;
+                std::array<uint32_t, kBattleFieldCount> garrison_nums;
+            };
+            //tag(1) + 长度(1) + owner(2) + garrison_num(1 + 5)
+            static const int kMaxCellSize = 10;
+            //两个packed字段, 每个值最多5字节, 再加上tag, 长度和下标
+            static const int kMaxCompactSize = 3 * (2 + 2 + kBattleFieldCount * 5);
+
+            const Snapshot* FindSnapshot(uint64_t version) const;
+            size_t EncodeDelta(const Snapshot& base, uint8_t* target) const;
+            static uint8_t* WritePosition(Pos self_position, uint8_t* target);
+
+            uint64_t version_ = 0;
+            size_t cells_size_ = 0;
+            std::array<uint8_t, kBattleFieldCount * kMaxCellSize> cells_;
+            //完整的紧凑格式, 不包括self_position和version
+            size_t compact_size_ = 0;
+            std::array<uint8_t, kMaxCompactSize> compact_;
+            //按版本顺序的环形数组, latest_snapshot_为最新的
+            std::array<Snapshot, kMaxSnapshots> snapshots_ {};
+            int latest_snapshot_ = 0;
+            //先编码到这里才知道长度
+            std::array<uint8_t, kMaxCompactSize + 64> scratch_;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_FIELD_ENCODER_H__  ----- */
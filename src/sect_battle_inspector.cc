@@ -11,27 +11,38 @@
  */
 
 #include "sect_battle_inspector.h"
+#include <cassert>
+#include <cmath>
 #include <cstring> //memset
 #include <algorithm>
 #include <alpha/logger.h>
+#include <alpha/compiler.h>
+#include "sect_battle_server_def.h"
 
 namespace SectBattle {
     const int PeriodStatisticQueue::kMaxSampleSeconds;
+    const int PeriodLatencyHistogram::kMaxSampleSeconds;
 
     void PeriodStatisticQueue::Add(alpha::TimeStamp time) {
-        RemoveOutdated(time);
-        statistics_[TimeStampToSeconds(time)]++;
+        auto seconds = TimeStampToSeconds(time);
+        auto & slot = statistics_[seconds % kMaxSampleSeconds];
+        if (slot.first != seconds) {
+            //这个位置上是kMaxSampleSeconds秒之前的数据了
+            slot.first = seconds;
+            slot.second = 0;
+        }
+        ++slot.second;
     }
 
     int32_t PeriodStatisticQueue::SampleAverage(alpha::TimeStamp now, int seconds) const {
         seconds = std::min(seconds, kMaxSampleSeconds);
         auto now_seconds = TimeStampToSeconds(now);
         int average = 0;
-        std::for_each(statistics_.lower_bound(now_seconds - seconds + 1),
-                statistics_.upper_bound(now_seconds),
-                [&average](const std::pair<int, int>& p) {
-                average += p.second;
-        });
+        for (const auto & slot : statistics_) {
+            if (slot.first > now_seconds - seconds && slot.first <= now_seconds) {
+                average += slot.second;
+            }
+        }
         return average;
     }
 
@@ -39,21 +50,142 @@ namespace SectBattle {
         return time / 1000;
     }
 
-    void PeriodStatisticQueue::RemoveOutdated(alpha::TimeStamp latest) {
-        auto preserved = TimeStampToSeconds(latest) - kMaxSampleSeconds;
-        if (statistics_.empty() || statistics_.begin()->first >= preserved) {
-            return;
+    const int LatencyHistogram::kBucketCount;
+
+    int LatencyHistogram::BucketIndex(int us) {
+        us = std::max(0, std::min(us, (1 << kMaxValueBits) - 1));
+        if (us < 2 * kSubBucketCount) {
+            return us;
+        }
+        int msb = 31 - __builtin_clz(us);
+        int shift = msb - kSubBucketBits;
+        return 2 * kSubBucketCount + (msb - kSubBucketBits - 1) * kSubBucketCount
+            + ((us >> shift) - kSubBucketCount);
+    }
+
+    int LatencyHistogram::BucketUpperBound(int index) {
+        assert (index >= 0 && index < kBucketCount);
+        if (index < 2 * kSubBucketCount) {
+            return index;
+        }
+        index -= 2 * kSubBucketCount;
+        int shift = index / kSubBucketCount + 1;
+        int sub = index % kSubBucketCount + kSubBucketCount;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void LatencyHistogram::Record(int us) {
+        ++counts_[BucketIndex(us)];
+    }
+
+    void LatencyHistogram::Merge(const LatencyHistogram& other) {
+        for (int i = 0; i < kBucketCount; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+    }
+
+    void LatencyHistogram::Clear() {
+        counts_.fill(0);
+    }
+
+    uint64_t LatencyHistogram::Count() const {
+        uint64_t count = 0;
+        for (auto n : counts_) {
+            count += n;
+        }
+        return count;
+    }
+
+    int LatencyHistogram::Percentile(double q) const {
+        assert (q > 0 && q <= 1);
+        auto count = Count();
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, std::ceil(q * count));
+        uint64_t seen = 0;
+        for (int i = 0; i < kBucketCount; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return BucketUpperBound(i);
+            }
+        }
+        return BucketUpperBound(kBucketCount - 1);
+    }
+
+    uint64_t LatencyHistogram::CountAtMost(int us) const {
+        uint64_t count = 0;
+        for (int i = 0; i < kBucketCount && BucketUpperBound(i) <= us; ++i) {
+            count += counts_[i];
         }
+        return count;
+    }
 
-        auto first = statistics_.begin();
-        auto last = statistics_.lower_bound(preserved);
-        if (last != statistics_.end() && last->first == preserved) {
-            if (last != statistics_.end()) {
-                ++last;
+    PeriodLatencyHistogram::PeriodLatencyHistogram()
+        :slots_(kMaxSampleSeconds) {
+        for (auto & slot : slots_) {
+            slot.second = -1;
+        }
+    }
+
+    void PeriodLatencyHistogram::Record(alpha::TimeStamp now, int us) {
+        int seconds = now / 1000;
+        auto & slot = slots_[seconds % kMaxSampleSeconds];
+        if (slot.second != seconds) {
+            slot.second = seconds;
+            slot.histogram.Clear();
+        }
+        slot.histogram.Record(us);
+    }
+
+    std::vector<LatencyHistogram> PeriodLatencyHistogram::Sample(alpha::TimeStamp now,
+            const std::vector<int>& windows) const {
+        assert (std::is_sorted(windows.begin(), windows.end()));
+        std::vector<LatencyHistogram> res(windows.size());
+        const int now_seconds = now / 1000;
+        LatencyHistogram merged;
+        size_t next = 0;
+        //已经合并了最近covered秒, 覆盖到的窗口可以输出了
+        auto finish = [&](int covered) {
+            while (next < windows.size()
+                    && std::min(windows[next], kMaxSampleSeconds) <= covered) {
+                res[next++] = merged;
+            }
+        };
+        finish(0);
+        const int longest = windows.empty() ? 0 : std::min(windows.back(), kMaxSampleSeconds);
+        for (int age = 0; age < longest; ++age) {
+            const int second = now_seconds - age;
+            const Slot& slot = slots_[second % kMaxSampleSeconds];
+            //这一秒没有记录过时, 位置上是更早的数据或者从没用过
+            if (slot.second == second) {
+                merged.Merge(slot.histogram);
             }
+            finish(age + 1);
         }
+        return res;
+    }
+
+    int RequestCounters::CodeSlot(int32_t code) {
+        const int32_t kFirstErrorCode = static_cast<int32_t>(Code::kOccupied);
+        if (code == 0) {
+            return 0;
+        } else if (code <= kFirstErrorCode && code > kFirstErrorCode - (kCodeSlots - 2)) {
+            return 1 + (kFirstErrorCode - code);
+        } else {
+            return kCodeSlots - 1;
+        }
+    }
 
-        statistics_.erase(first, last);
+    std::string RequestCounters::CodeSlotLabel(int slot) {
+        assert (slot >= 0 && slot < kCodeSlots);
+        if (slot == 0) {
+            return "0";
+        } else if (slot == kCodeSlots - 1) {
+            return "other";
+        } else {
+            return std::to_string(static_cast<int32_t>(Code::kOccupied) - (slot - 1));
+        }
     }
 
     Inspector::Inspector() = default;
@@ -62,6 +194,10 @@ namespace SectBattle {
         process_start_time_ = timestamp;
     }
 
+    void Inspector::RecordStartupTime(int ms) {
+        startup_time_ = ms;
+    }
+
     void Inspector::AddRequestNum(alpha::TimeStamp timestamp) {
         requests_.Add(timestamp);
     }
@@ -79,6 +215,90 @@ namespace SectBattle {
         max_request_process_time_ = std::max(us, max_request_process_time_);
     }
 
+    void Inspector::RecordRequestLatency(const std::string& name,
+            alpha::TimeStamp now, int us) {
+        latency_.Record(now, us);
+        if (name.empty()) {
+            return;
+        }
+        auto it = latency_by_name_.find(name);
+        if (unlikely(it == latency_by_name_.end())) {
+            //消息类型是固定的几种, 只有第一次会分配
+            it = latency_by_name_.emplace(name, std::unique_ptr<PeriodLatencyHistogram>(
+                        new PeriodLatencyHistogram)).first;
+        }
+        it->second->Record(now, us);
+    }
+
+    std::vector<LatencyHistogram> Inspector::SampleRequestLatency(const std::string& name,
+            const std::vector<int>& windows) const {
+        if (name.empty()) {
+            return latency_.Sample(alpha::Now(), windows);
+        }
+        auto it = latency_by_name_.find(name);
+        if (it == latency_by_name_.end()) {
+            return std::vector<LatencyHistogram>(windows.size());
+        }
+        return it->second->Sample(alpha::Now(), windows);
+    }
+
+    std::vector<std::string> Inspector::RequestLatencyNames() const {
+        std::vector<std::string> names;
+        for (const auto & p : latency_by_name_) {
+            names.push_back(p.first);
+        }
+        return names;
+    }
+
+    PhaseStatistics* Inspector::GetPhaseStatistics(const std::string& name) {
+        return &phases_by_name_[name];
+    }
+
+    const std::map<std::string, PhaseStatistics>& Inspector::AllPhaseStatistics() const {
+        return phases_by_name_;
+    }
+
+    RequestCounters* Inspector::GetRequestCounters(const std::string& name) {
+        return &counters_by_name_[name];
+    }
+
+    const std::map<std::string, RequestCounters>& Inspector::AllRequestCounters() const {
+        return counters_by_name_;
+    }
+
+    void Inspector::AddInvalidPacket() {
+        invalid_packets_.Add();
+    }
+
+    uint64_t Inspector::InvalidPackets() const {
+        return invalid_packets_.Value();
+    }
+
+    void Inspector::RecordAdminRequest(const std::string& path, int64_t us) {
+        auto & counters = admin_counters_[path];
+        counters.requests.Add();
+        counters.microseconds.Add(us);
+        counters.max_microseconds.SetMax(us);
+    }
+
+    const std::map<std::string, AdminCounters>& Inspector::AllAdminCounters() const {
+        return admin_counters_;
+    }
+
+    void Inspector::RecordBackup(bool succeed, uint64_t bytes, int ms) {
+        backup_.total.Add();
+        if (!succeed) {
+            backup_.failures.Add();
+        }
+        backup_.bytes.Add(bytes);
+        backup_.last_bytes.Set(bytes);
+        backup_.last_duration_ms.Set(ms);
+    }
+
+    const BackupStatistics& Inspector::GetBackupStatistics() const {
+        return backup_;
+    }
+
     double Inspector::RequestProcessedPerSeconds() const {
         auto sum = requests_.SampleAverage(alpha::Now(),
                 PeriodStatisticQueue::kMaxSampleSeconds);
@@ -102,6 +322,10 @@ namespace SectBattle {
         return process_start_time_;
     }
 
+    int Inspector::StartupTime() const {
+        return startup_time_;
+    }
+
     int Inspector::MaxRequestProcessTime() const {
         return max_request_process_time_;
     }
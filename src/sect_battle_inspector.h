@@ -15,9 +15,16 @@
 
 #include <alpha/time_util.h>
 #include <map>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
 #include <utility>
+#include "sect_battle_phase_timer.h"
+#include "sect_battle_metrics.h"
 
 namespace SectBattle {
+    //最近kMaxSampleSeconds秒每秒的计数, 固定大小的环形数组
     class PeriodStatisticQueue {
         public:
             static const int kMaxSampleSeconds = 900;
@@ -27,15 +34,116 @@ namespace SectBattle {
 
         private:
             int TimeStampToSeconds(alpha::TimeStamp time) const;
-            void RemoveOutdated(alpha::TimeStamp preserved);
-            std::map<int, int> statistics_;
+            //first为秒数, second为这一秒的计数
+            std::array<std::pair<int, int>, kMaxSampleSeconds> statistics_ {};
     };
+
+    //HDR风格的耗时直方图(微秒), 每个2的幂区间再均分成kSubBucketCount份
+    //相对误差不超过1/kSubBucketCount
+    class LatencyHistogram {
+        public:
+            static const int kSubBucketBits = 4;
+            static const int kSubBucketCount = 1 << kSubBucketBits;
+            static const int kMaxValueBits = 26; //约67s, 再大的都算在最后一个桶
+            static const int kBucketCount = 2 * kSubBucketCount
+                + (kMaxValueBits - kSubBucketBits - 1) * kSubBucketCount;
+
+            void Record(int us);
+            void Merge(const LatencyHistogram& other);
+            void Clear();
+            uint64_t Count() const;
+            //q取值(0, 1], 返回对应桶的上界
+            int Percentile(double q) const;
+            //上界不超过us的桶里的计数, 用来输出Prometheus的histogram
+            //us为某个桶的上界(见UpperBound)时才是准确的累计数
+            uint64_t CountAtMost(int us) const;
+            //us所在的桶的上界, 不小于us
+            static int UpperBound(int us) { return BucketUpperBound(BucketIndex(us)); }
+
+        private:
+            static int BucketIndex(int us);
+            static int BucketUpperBound(int index);
+            std::array<uint32_t, kBucketCount> counts_ {};
+    };
+
+    //最近kMaxSampleSeconds秒每秒一个直方图
+    class PeriodLatencyHistogram {
+        public:
+            static const int kMaxSampleSeconds = 900;
+
+            PeriodLatencyHistogram();
+            void Record(alpha::TimeStamp now, int us);
+            //最近windows[i]秒的分布, windows从小到大排列
+            //按环形数组的下标从now往前只走一遍, 只访问最长的窗口内的秒
+            std::vector<LatencyHistogram> Sample(alpha::TimeStamp now,
+                    const std::vector<int>& windows) const;
+
+        private:
+            struct Slot {
+                int second;
+                LatencyHistogram histogram;
+            };
+            std::vector<Slot> slots_;
+    };
+
+    //按消息类型的计数, 给/metrics用
+    struct RequestCounters {
+        //0, -1000 ~ -1015各占一个, 其余的都算在最后一个
+        static const int kCodeSlots = 18;
+        static int CodeSlot(int32_t code);
+        static std::string CodeSlotLabel(int slot);
+
+        void RecordCode(int32_t code) { codes[CodeSlot(code)].Add(); }
+
+        Counter requests;
+        Counter errors; //没有回包的请求
+        Counter allocations; //处理请求过程中operator new的次数
+        Counter response_bytes;
+        Counter battle_field_not_modified; //客户端的战场已经是最新的
+        std::array<Counter, kCodeSlots> codes;
+    };
+
+    //管理接口按路径的统计, 管理接口和游戏请求共用事件循环
+    struct AdminCounters {
+        Counter requests;
+        Counter microseconds;
+        Gauge max_microseconds;
+    };
+
+    struct BackupStatistics {
+        Counter total;
+        Counter failures;
+        Counter bytes;
+        Gauge last_duration_ms;
+        Gauge last_bytes;
+    };
+
     class Inspector {
         public:
             Inspector();
 
             void RecordProcessStartTime(alpha::TimeStamp timestamp);
+            void RecordStartupTime(int ms);
             void RecordProcessRequestTime(int us);
+            //按消息类型记录耗时, name为空时只记到汇总中
+            void RecordRequestLatency(const std::string& name, alpha::TimeStamp now, int us);
+            //同PeriodLatencyHistogram::Sample
+            std::vector<LatencyHistogram> SampleRequestLatency(const std::string& name,
+                    const std::vector<int>& windows) const;
+            std::vector<std::string> RequestLatencyNames() const;
+            //只应该用合法的消息名调用, 第一次调用时创建
+            PhaseStatistics* GetPhaseStatistics(const std::string& name);
+            const std::map<std::string, PhaseStatistics>& AllPhaseStatistics() const;
+            //同GetPhaseStatistics, 只应该用合法的消息名调用
+            RequestCounters* GetRequestCounters(const std::string& name);
+            const std::map<std::string, RequestCounters>& AllRequestCounters() const;
+            void AddInvalidPacket();
+            uint64_t InvalidPackets() const;
+            //path只应该是固定的几个路径, 第一次调用时创建
+            void RecordAdminRequest(const std::string& path, int64_t us);
+            const std::map<std::string, AdminCounters>& AllAdminCounters() const;
+            void RecordBackup(bool succeed, uint64_t bytes, int ms);
+            const BackupStatistics& GetBackupStatistics() const;
             void AddRequestNum(alpha::TimeStamp timestamp);
             void AddSucceedRequestNum(alpha::TimeStamp timestamp);
             double RequestProcessedPerSeconds() const;
@@ -43,6 +151,7 @@ namespace SectBattle {
             int32_t SampleSucceedRequests(int latest_seconds) const;
             int32_t AverageProcessTime() const;
             alpha::TimeStamp ProcessStartTime() const;
+            int StartupTime() const;
             int MaxRequestProcessTime() const;
 
         private:
@@ -50,10 +159,18 @@ namespace SectBattle {
             int32_t Sample(const int32_t* array, int latest_seconds) const;
 
             alpha::TimeStamp process_start_time_ = 0;
+            int startup_time_ = 0;
             int max_request_process_time_ = 0;
             std::pair<uint64_t, uint64_t> total_requests_;
             PeriodStatisticQueue requests_;
             PeriodStatisticQueue succeed_requests_;
+            PeriodLatencyHistogram latency_;
+            std::map<std::string, std::unique_ptr<PeriodLatencyHistogram>> latency_by_name_;
+            std::map<std::string, PhaseStatistics> phases_by_name_;
+            std::map<std::string, RequestCounters> counters_by_name_;
+            std::map<std::string, AdminCounters> admin_counters_;
+            Counter invalid_packets_;
+            BackupStatistics backup_;
     };
 }
 
@@ -0,0 +1,487 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_intrusive_tree.h
+ *        Created:  06/04/15 14:12:53
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  侵入式红黑树, 节点之间用数组下标而不是指针连接
+ *                  所以可以直接放在mmap文件里, 重新映射到别的地址也没问题
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_INTRUSIVE_TREE_H__
+#define  __SECT_BATTLE_INTRUSIVE_TREE_H__
+
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+
+namespace SectBattle {
+    //嵌在节点里的树结构
+    struct TreeLinks {
+        uint32_t parent;
+        uint32_t left;
+        uint32_t right;
+        uint32_t red;
+    };
+
+    //Accessor需要提供:
+    //  TreeLinks& Links(uint32_t index) const;
+    //  bool Less(uint32_t lhs, uint32_t rhs) const;
+    //下标0作为哨兵节点(nil), 必须可以通过Links(0)访问, 并且一直是黑色
+    template<typename Accessor>
+    class IntrusiveTree {
+        public:
+            static const uint32_t kNil = 0;
+
+            class Iterator : public std::iterator<std::bidirectional_iterator_tag,
+                uint32_t, std::ptrdiff_t, const uint32_t*, uint32_t> {
+                public:
+                    Iterator()
+                        :tree_(nullptr), node_(kNil) {
+                    }
+                    Iterator(const IntrusiveTree* tree, uint32_t node)
+                        :tree_(tree), node_(node) {
+                    }
+                    uint32_t operator*() const { return node_; }
+                    Iterator& operator++() {
+                        node_ = tree_->Next(node_);
+                        return *this;
+                    }
+                    Iterator operator++(int) {
+                        Iterator res(*this);
+                        ++*this;
+                        return res;
+                    }
+                    Iterator& operator--() {
+                        node_ = node_ == kNil ? tree_->Last() : tree_->Prev(node_);
+                        return *this;
+                    }
+                    Iterator operator--(int) {
+                        Iterator res(*this);
+                        --*this;
+                        return res;
+                    }
+                    bool operator==(const Iterator& rhs) const { return node_ == rhs.node_; }
+                    bool operator!=(const Iterator& rhs) const { return node_ != rhs.node_; }
+
+                private:
+                    const IntrusiveTree* tree_;
+                    uint32_t node_;
+            };
+
+            IntrusiveTree(uint32_t* root, const Accessor& accessor)
+                :root_(root), accessor_(accessor) {
+                assert (root_);
+            }
+
+            bool empty() const { return *root_ == kNil; }
+            uint32_t First() const;
+            uint32_t Last() const;
+            uint32_t Next(uint32_t node) const;
+            uint32_t Prev(uint32_t node) const;
+            Iterator begin() const { return Iterator(this, First()); }
+            Iterator end() const { return Iterator(this, kNil); }
+            Iterator At(uint32_t node) const { return Iterator(this, node); }
+
+            void Insert(uint32_t node);
+            void Erase(uint32_t node);
+            //node的键已经在外面改过了, 和前后节点仍然有序时不需要动树
+            //返回true表示原地更新, false表示重新插入了一次
+            bool Reposition(uint32_t node);
+            //返回第一个pred(node)为false的节点, 要求pred在中序遍历中先true后false
+            template<typename Pred>
+            uint32_t PartitionPoint(Pred pred) const;
+            //用已经排好序的节点直接构造一棵平衡的树, 要求树当前为空
+            void BuildFromSorted(const uint32_t* nodes, size_t size);
+            //检查红黑树的性质, 返回黑高, 出错返回-1
+            int Verify() const;
+
+        private:
+            TreeLinks& L(uint32_t node) const { return accessor_.Links(node); }
+            bool Less(uint32_t lhs, uint32_t rhs) const { return accessor_.Less(lhs, rhs); }
+            uint32_t Minimum(uint32_t node) const;
+            uint32_t Maximum(uint32_t node) const;
+            void RotateLeft(uint32_t x);
+            void RotateRight(uint32_t x);
+            void InsertFixup(uint32_t z);
+            void EraseFixup(uint32_t x);
+            void Transplant(uint32_t u, uint32_t v);
+            uint32_t Build(const uint32_t* nodes, size_t first, size_t last,
+                    uint32_t parent, int depth, int red_depth);
+            int Verify(uint32_t node) const;
+
+            uint32_t* root_;
+            Accessor accessor_;
+    };
+
+    template<typename Accessor>
+    const uint32_t IntrusiveTree<Accessor>::kNil;
+
+    template<typename Accessor>
+    uint32_t IntrusiveTree<Accessor>::First() const {
+        return empty() ? kNil : Minimum(*root_);
+    }
+
+    template<typename Accessor>
+    uint32_t IntrusiveTree<Accessor>::Last() const {
+        return empty() ? kNil : Maximum(*root_);
+    }
+
+    template<typename Accessor>
+    uint32_t IntrusiveTree<Accessor>::Next(uint32_t node) const {
+        assert (node != kNil);
+        if (L(node).right != kNil) {
+            return Minimum(L(node).right);
+        }
+        uint32_t parent = L(node).parent;
+        while (parent != kNil && node == L(parent).right) {
+            node = parent;
+            parent = L(parent).parent;
+        }
+        return parent;
+    }
+
+    template<typename Accessor>
+    uint32_t IntrusiveTree<Accessor>::Prev(uint32_t node) const {
+        assert (node != kNil);
+        if (L(node).left != kNil) {
+            return Maximum(L(node).left);
+        }
+        uint32_t parent = L(node).parent;
+        while (parent != kNil && node == L(parent).left) {
+            node = parent;
+            parent = L(parent).parent;
+        }
+        return parent;
+    }
+
+    template<typename Accessor>
+    uint32_t IntrusiveTree<Accessor>::Minimum(uint32_t node) const {
+        while (L(node).left != kNil) {
+            node = L(node).left;
+        }
+        return node;
+    }
+
+    template<typename Accessor>
+    uint32_t IntrusiveTree<Accessor>::Maximum(uint32_t node) const {
+        while (L(node).right != kNil) {
+            node = L(node).right;
+        }
+        return node;
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::RotateLeft(uint32_t x) {
+        uint32_t y = L(x).right;
+        L(x).right = L(y).left;
+        if (L(y).left != kNil) {
+            L(L(y).left).parent = x;
+        }
+        L(y).parent = L(x).parent;
+        if (L(x).parent == kNil) {
+            *root_ = y;
+        } else if (x == L(L(x).parent).left) {
+            L(L(x).parent).left = y;
+        } else {
+            L(L(x).parent).right = y;
+        }
+        L(y).left = x;
+        L(x).parent = y;
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::RotateRight(uint32_t x) {
+        uint32_t y = L(x).left;
+        L(x).left = L(y).right;
+        if (L(y).right != kNil) {
+            L(L(y).right).parent = x;
+        }
+        L(y).parent = L(x).parent;
+        if (L(x).parent == kNil) {
+            *root_ = y;
+        } else if (x == L(L(x).parent).right) {
+            L(L(x).parent).right = y;
+        } else {
+            L(L(x).parent).left = y;
+        }
+        L(y).right = x;
+        L(x).parent = y;
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::Insert(uint32_t z) {
+        assert (z != kNil);
+        uint32_t y = kNil;
+        uint32_t x = *root_;
+        while (x != kNil) {
+            y = x;
+            x = Less(z, x) ? L(x).left : L(x).right;
+        }
+        L(z).parent = y;
+        if (y == kNil) {
+            *root_ = z;
+        } else if (Less(z, y)) {
+            L(y).left = z;
+        } else {
+            L(y).right = z;
+        }
+        L(z).left = kNil;
+        L(z).right = kNil;
+        L(z).red = 1;
+        InsertFixup(z);
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::InsertFixup(uint32_t z) {
+        while (L(L(z).parent).red) {
+            uint32_t p = L(z).parent;
+            uint32_t g = L(p).parent;
+            if (p == L(g).left) {
+                uint32_t y = L(g).right;
+                if (L(y).red) {
+                    L(p).red = 0;
+                    L(y).red = 0;
+                    L(g).red = 1;
+                    z = g;
+                } else {
+                    if (z == L(p).right) {
+                        z = p;
+                        RotateLeft(z);
+                        p = L(z).parent;
+                        g = L(p).parent;
+                    }
+                    L(p).red = 0;
+                    L(g).red = 1;
+                    RotateRight(g);
+                }
+            } else {
+                uint32_t y = L(g).left;
+                if (L(y).red) {
+                    L(p).red = 0;
+                    L(y).red = 0;
+                    L(g).red = 1;
+                    z = g;
+                } else {
+                    if (z == L(p).left) {
+                        z = p;
+                        RotateRight(z);
+                        p = L(z).parent;
+                        g = L(p).parent;
+                    }
+                    L(p).red = 0;
+                    L(g).red = 1;
+                    RotateLeft(g);
+                }
+            }
+        }
+        L(*root_).red = 0;
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::Transplant(uint32_t u, uint32_t v) {
+        if (L(u).parent == kNil) {
+            *root_ = v;
+        } else if (u == L(L(u).parent).left) {
+            L(L(u).parent).left = v;
+        } else {
+            L(L(u).parent).right = v;
+        }
+        //v可能是哨兵, 删除修正时需要用到哨兵的parent
+        L(v).parent = L(u).parent;
+    }
+
+    template<typename Accessor>
+    bool IntrusiveTree<Accessor>::Reposition(uint32_t node) {
+        assert (node != kNil);
+        uint32_t prev = Prev(node);
+        uint32_t next = Next(node);
+        if ((prev == kNil || Less(prev, node)) && (next == kNil || Less(node, next))) {
+            return true;
+        }
+        Erase(node);
+        Insert(node);
+        return false;
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::Erase(uint32_t z) {
+        assert (z != kNil);
+        uint32_t y = z;
+        uint32_t x;
+        bool y_original_red = L(y).red;
+        if (L(z).left == kNil) {
+            x = L(z).right;
+            Transplant(z, x);
+        } else if (L(z).right == kNil) {
+            x = L(z).left;
+            Transplant(z, x);
+        } else {
+            y = Minimum(L(z).right);
+            y_original_red = L(y).red;
+            x = L(y).right;
+            if (L(y).parent == z) {
+                L(x).parent = y;
+            } else {
+                Transplant(y, x);
+                L(y).right = L(z).right;
+                L(L(y).right).parent = y;
+            }
+            Transplant(z, y);
+            L(y).left = L(z).left;
+            L(L(y).left).parent = y;
+            L(y).red = L(z).red;
+        }
+        if (!y_original_red) {
+            EraseFixup(x);
+        }
+        L(z).parent = kNil;
+        L(z).left = kNil;
+        L(z).right = kNil;
+        L(z).red = 0;
+        L(kNil).parent = kNil;
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::EraseFixup(uint32_t x) {
+        while (x != *root_ && !L(x).red) {
+            uint32_t p = L(x).parent;
+            if (x == L(p).left) {
+                uint32_t w = L(p).right;
+                if (L(w).red) {
+                    L(w).red = 0;
+                    L(p).red = 1;
+                    RotateLeft(p);
+                    w = L(p).right;
+                }
+                if (!L(L(w).left).red && !L(L(w).right).red) {
+                    L(w).red = 1;
+                    x = p;
+                } else {
+                    if (!L(L(w).right).red) {
+                        L(L(w).left).red = 0;
+                        L(w).red = 1;
+                        RotateRight(w);
+                        w = L(p).right;
+                    }
+                    L(w).red = L(p).red;
+                    L(p).red = 0;
+                    L(L(w).right).red = 0;
+                    RotateLeft(p);
+                    x = *root_;
+                }
+            } else {
+                uint32_t w = L(p).left;
+                if (L(w).red) {
+                    L(w).red = 0;
+                    L(p).red = 1;
+                    RotateRight(p);
+                    w = L(p).left;
+                }
+                if (!L(L(w).right).red && !L(L(w).left).red) {
+                    L(w).red = 1;
+                    x = p;
+                } else {
+                    if (!L(L(w).left).red) {
+                        L(L(w).right).red = 0;
+                        L(w).red = 1;
+                        RotateLeft(w);
+                        w = L(p).left;
+                    }
+                    L(w).red = L(p).red;
+                    L(p).red = 0;
+                    L(L(w).left).red = 0;
+                    RotateRight(p);
+                    x = *root_;
+                }
+            }
+        }
+        L(x).red = 0;
+    }
+
+    template<typename Accessor>
+    template<typename Pred>
+    uint32_t IntrusiveTree<Accessor>::PartitionPoint(Pred pred) const {
+        uint32_t res = kNil;
+        uint32_t x = *root_;
+        while (x != kNil) {
+            if (pred(x)) {
+                x = L(x).right;
+            } else {
+                res = x;
+                x = L(x).left;
+            }
+        }
+        return res;
+    }
+
+    template<typename Accessor>
+    void IntrusiveTree<Accessor>::BuildFromSorted(const uint32_t* nodes, size_t size) {
+        assert (empty());
+        if (size == 0) {
+            return;
+        }
+        //按中点切分, 所有空指针的深度只会是floor(log2(n+1))或者再多一层
+        //多出来那一层的节点染成红色, 其余都是黑色
+        int red_depth = 0;
+        while ((static_cast<size_t>(2) << red_depth) <= size + 1) {
+            ++red_depth;
+        }
+        *root_ = Build(nodes, 0, size, kNil, 0, red_depth);
+    }
+
+    template<typename Accessor>
+    uint32_t IntrusiveTree<Accessor>::Build(const uint32_t* nodes, size_t first,
+            size_t last, uint32_t parent, int depth, int red_depth) {
+        if (first == last) {
+            return kNil;
+        }
+        size_t mid = first + (last - first) / 2;
+        uint32_t node = nodes[mid];
+        assert (mid == first || Less(nodes[mid - 1], node));
+        L(node).parent = parent;
+        L(node).red = depth == red_depth;
+        L(node).left = Build(nodes, first, mid, node, depth + 1, red_depth);
+        L(node).right = Build(nodes, mid + 1, last, node, depth + 1, red_depth);
+        return node;
+    }
+
+    template<typename Accessor>
+    int IntrusiveTree<Accessor>::Verify() const {
+        if (L(kNil).red || L(*root_).red || L(*root_).parent != kNil) {
+            return -1;
+        }
+        return Verify(*root_);
+    }
+
+    template<typename Accessor>
+    int IntrusiveTree<Accessor>::Verify(uint32_t node) const {
+        if (node == kNil) {
+            return 0;
+        }
+        const TreeLinks& links = L(node);
+        if (links.left != kNil && (L(links.left).parent != node
+                    || !Less(links.left, node))) {
+            return -1;
+        }
+        if (links.right != kNil && (L(links.right).parent != node
+                    || !Less(node, links.right))) {
+            return -1;
+        }
+        if (links.red && (L(links.left).red || L(links.right).red)) {
+            return -1;
+        }
+        int left = Verify(links.left);
+        int right = Verify(links.right);
+        if (left < 0 || left != right) {
+            return -1;
+        }
+        return left + (links.red ? 0 : 1);
+    }
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_INTRUSIVE_TREE_H__  ----- */
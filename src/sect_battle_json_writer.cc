@@ -0,0 +1,95 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_json_writer.cc
+ *        Created:  06/12/15 19:18:05
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_json_writer.h"
+#include <cmath>
+#include <cstdio>
+#include <cinttypes>
+
+namespace SectBattle {
+    void JsonWriter::Key(alpha::Slice key) {
+        Separator();
+        AppendString(key);
+        out_ += ':';
+        need_comma_ = false;
+    }
+
+    void JsonWriter::Value(alpha::Slice s) {
+        Separator();
+        AppendString(s);
+        need_comma_ = true;
+    }
+
+    void JsonWriter::Value(bool b) {
+        Separator();
+        out_ += b ? "true" : "false";
+        need_comma_ = true;
+    }
+
+    void JsonWriter::Value(double d) {
+        //JSON里没有nan和inf
+        if (!std::isfinite(d)) {
+            Null();
+            return;
+        }
+        Separator();
+        char buf[32];
+        int n = ::snprintf(buf, sizeof(buf), "%.10g", d);
+        out_.append(buf, n);
+        need_comma_ = true;
+    }
+
+    void JsonWriter::Null() {
+        Separator();
+        out_ += "null";
+        need_comma_ = true;
+    }
+
+    void JsonWriter::AppendInt(int64_t v) {
+        Separator();
+        char buf[24];
+        int n = ::snprintf(buf, sizeof(buf), "%" PRId64, v);
+        out_.append(buf, n);
+        need_comma_ = true;
+    }
+
+    void JsonWriter::AppendUint(uint64_t v) {
+        Separator();
+        char buf[24];
+        int n = ::snprintf(buf, sizeof(buf), "%" PRIu64, v);
+        out_.append(buf, n);
+        need_comma_ = true;
+    }
+
+    void JsonWriter::AppendString(alpha::Slice s) {
+        static const char kHex[] = "0123456789abcdef";
+        out_ += '"';
+        for (size_t i = 0; i < s.size(); ++i) {
+            const unsigned char c = s.data()[i];
+            if (c == '"' || c == '\\') {
+                out_ += '\\';
+                out_ += c;
+            } else if (c == '\n') {
+                out_ += "\\n";
+            } else if (c == '\t') {
+                out_ += "\\t";
+            } else if (c < 0x20) {
+                out_ += "\\u00";
+                out_ += kHex[c >> 4];
+                out_ += kHex[c & 0xf];
+            } else {
+                out_ += c;
+            }
+        }
+        out_ += '"';
+    }
+}
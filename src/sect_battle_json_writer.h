@@ -0,0 +1,72 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_json_writer.h
+ *        Created:  06/12/15 19:02:44
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  管理接口用的JSON输出, 边遍历边追加到字符串里, 不构造树
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_JSON_WRITER_H__
+#define  __SECT_BATTLE_JSON_WRITER_H__
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <alpha/slice.h>
+
+namespace SectBattle {
+    //只负责逗号和转义, 不检查Begin/End是否配对, 也不检查对象里是否先写了Key
+    class JsonWriter {
+        public:
+            void BeginObject() { Separator(); out_ += '{'; need_comma_ = false; }
+            void EndObject() { out_ += '}'; need_comma_ = true; }
+            void BeginArray() { Separator(); out_ += '['; need_comma_ = false; }
+            void EndArray() { out_ += ']'; need_comma_ = true; }
+            void Key(alpha::Slice key);
+
+            void Value(alpha::Slice s);
+            //避免字符串字面量被转换成bool
+            void Value(const char* s) { Value(alpha::Slice(s)); }
+            void Value(const std::string& s) { Value(alpha::Slice(s)); }
+            void Value(bool b);
+            void Value(double d);
+            template<typename T>
+            typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+            Value(T v) { AppendInt(v); }
+            template<typename T>
+            typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type
+            Value(T v) { AppendUint(v); }
+            void Null();
+
+            template<typename T>
+            void Member(alpha::Slice key, const T& v) { Key(key); Value(v); }
+
+            const std::string& str() const { return out_; }
+            //交给HTTPResponseBuilder之后可以接着复用
+            std::string Release() {
+                std::string out;
+                out.swap(out_);
+                need_comma_ = false;
+                return out;
+            }
+
+        private:
+            void Separator() {
+                if (need_comma_) {
+                    out_ += ',';
+                }
+            }
+            void AppendInt(int64_t v);
+            void AppendUint(uint64_t v);
+            void AppendString(alpha::Slice s);
+
+            std::string out_;
+            bool need_comma_ = false;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_JSON_WRITER_H__  ----- */
@@ -0,0 +1,111 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_loop_monitor.cc
+ *        Created:  06/08/15 14:40:03
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_loop_monitor.h"
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <alpha/logger.h>
+#include <alpha/compiler.h>
+
+namespace SectBattle {
+    const int LoopMonitor::kMaxRecentStalls;
+
+    LoopMonitor::LoopMonitor(alpha::EventLoop* loop, int interval_ms,
+            int stall_threshold_ms)
+        :loop_(loop), interval_(interval_ms), stall_threshold_(stall_threshold_ms) {
+    }
+
+    void LoopMonitor::Start() {
+        loop_->RunEvery(interval_, std::bind(&LoopMonitor::Tick, this));
+    }
+
+    alpha::EventLoop::Functor LoopMonitor::Wrap(const char* name,
+            alpha::EventLoop::Functor f) {
+        return [this, name, f] {
+            Scope scope(this, name);
+            f();
+        };
+    }
+
+    void LoopMonitor::Leave(const char* name, int64_t us) {
+        if (us > slowest_duration_) {
+            slowest_name_ = name;
+            slowest_duration_ = us;
+        }
+    }
+
+    void LoopMonitor::Tick() {
+        auto now = alpha::NowInMicroseconds();
+        if (unlikely(last_tick_ == 0)) {
+            last_tick_ = now;
+            return;
+        }
+        auto lag = now - last_tick_ - interval_ * 1000;
+        lag = lag > 0 ? lag : 0;
+        last_tick_ = now;
+        last_lag_.Set(lag);
+        max_lag_.SetMax(lag);
+        lag_sum_.Add(lag);
+        auto us = static_cast<int>(std::min<int64_t>(lag, std::numeric_limits<int>::max()));
+        lag_.Record(us);
+        period_lag_.Record(now / 1000, us);
+
+        if (lag >= stall_threshold_ * 1000) {
+            Stall stall;
+            stall.time = now / 1000;
+            stall.lag = lag;
+            stall.duration = slowest_duration_;
+            //没有被包装过的回调(比如TT客户端的IO回调)都算在unknown上
+            stall.callback = slowest_name_ ? slowest_name_ : "unknown";
+            LOG_WARNING << "Event loop stalled, lag = " << lag << "us"
+                << ", callback = " << stall.callback
+                << ", duration = " << stall.duration << "us";
+            stalls_by_callback_[stall.callback].Add();
+            recent_stalls_.push_back(std::move(stall));
+            if (recent_stalls_.size() > kMaxRecentStalls) {
+                recent_stalls_.pop_front();
+            }
+        }
+        slowest_name_ = nullptr;
+        slowest_duration_ = 0;
+    }
+
+    int64_t LoopMonitor::LastLag() const {
+        return last_lag_.Value();
+    }
+
+    int64_t LoopMonitor::MaxLag() const {
+        return max_lag_.Value();
+    }
+
+    const LatencyHistogram& LoopMonitor::LagHistogram() const {
+        return lag_;
+    }
+
+    uint64_t LoopMonitor::LagSum() const {
+        return lag_sum_.Value();
+    }
+
+    std::vector<LatencyHistogram> LoopMonitor::SampleLag(
+            const std::vector<int>& windows) const {
+        return period_lag_.Sample(alpha::Now(), windows);
+    }
+
+    const std::map<std::string, Counter>& LoopMonitor::StallsByCallback() const {
+        return stalls_by_callback_;
+    }
+
+    std::vector<LoopMonitor::Stall> LoopMonitor::RecentStalls() const {
+        return std::vector<Stall>(recent_stalls_.begin(), recent_stalls_.end());
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_loop_monitor.h
+ *        Created:  06/08/15 14:12:50
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  用一个高频定时器检测事件循环被阻塞了多久
+ *                  超过阈值时归因到上一次检测之后耗时最长的回调
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_LOOP_MONITOR_H__
+#define  __SECT_BATTLE_LOOP_MONITOR_H__
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <alpha/time_util.h>
+#include <alpha/event_loop.h>
+#include "sect_battle_inspector.h"
+#include "sect_battle_metrics.h"
+
+namespace SectBattle {
+    class LoopMonitor {
+        public:
+            struct Stall {
+                alpha::TimeStamp time;
+                int64_t lag; //us
+                int64_t duration; //归因的回调的耗时, us
+                std::string callback;
+            };
+            static const int kMaxRecentStalls = 64;
+
+            //作用域内的耗时算到name上, name必须是字符串常量
+            class Scope {
+                public:
+                    Scope(LoopMonitor* monitor, const char* name)
+                        :monitor_(monitor), name_(name),
+                        start_(monitor ? alpha::NowInMicroseconds() : 0) {
+                    }
+                    ~Scope() {
+                        if (monitor_) {
+                            monitor_->Leave(name_, alpha::NowInMicroseconds() - start_);
+                        }
+                    }
+                    Scope(const Scope&) = delete;
+                    Scope& operator=(const Scope&) = delete;
+
+                private:
+                    LoopMonitor* monitor_;
+                    const char* name_;
+                    int64_t start_;
+            };
+
+            LoopMonitor(alpha::EventLoop* loop, int interval_ms, int stall_threshold_ms);
+            void Start();
+            alpha::EventLoop::Functor Wrap(const char* name, alpha::EventLoop::Functor f);
+
+            int interval() const { return interval_; }
+            int stall_threshold() const { return stall_threshold_; }
+            int64_t LastLag() const;
+            int64_t MaxLag() const;
+            //启动以来全部的延迟分布, 单位us
+            const LatencyHistogram& LagHistogram() const;
+            uint64_t LagSum() const;
+            std::vector<LatencyHistogram> SampleLag(const std::vector<int>& windows) const;
+            const std::map<std::string, Counter>& StallsByCallback() const;
+            std::vector<Stall> RecentStalls() const;
+
+        private:
+            void Tick();
+            void Leave(const char* name, int64_t us);
+
+            alpha::EventLoop* loop_;
+            const int interval_; //ms
+            const int stall_threshold_; //ms
+            int64_t last_tick_ = 0; //us
+            //上一次Tick之后耗时最长的回调
+            const char* slowest_name_ = nullptr;
+            int64_t slowest_duration_ = 0;
+            Gauge last_lag_;
+            Gauge max_lag_;
+            Counter lag_sum_;
+            LatencyHistogram lag_;
+            PeriodLatencyHistogram period_lag_;
+            std::map<std::string, Counter> stalls_by_callback_;
+            std::deque<Stall> recent_stalls_;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_LOOP_MONITOR_H__  ----- */
@@ -0,0 +1,37 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_message_pool.cc
+ *        Created:  06/09/15 15:40:21
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_message_pool.h"
+#include <google/protobuf/descriptor.h>
+
+namespace SectBattle {
+    google::protobuf::Message* MessagePool::Get(const std::string& name) {
+        using namespace google::protobuf;
+        auto it = by_name_.find(name);
+        if (it != by_name_.end()) {
+            return it->second.get();
+        }
+        const Descriptor* descriptor =
+            DescriptorPool::generated_pool()->FindMessageTypeByName(name);
+        if (descriptor == nullptr) {
+            return nullptr;
+        }
+        const Message* prototype =
+            MessageFactory::generated_factory()->GetPrototype(descriptor);
+        if (prototype == nullptr) {
+            return nullptr;
+        }
+        //合法的消息名只有固定的几种, 只有第一次会分配
+        it = by_name_.emplace(name, std::unique_ptr<Message>(prototype->New())).first;
+        return it->second.get();
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_message_pool.h
+ *        Created:  06/09/15 15:18:44
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  每种消息只创建一个对象, 之后一直复用
+ *                  Clear之后子消息和repeated字段的内存都还在, 不需要再分配
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_MESSAGE_POOL_H__
+#define  __SECT_BATTLE_MESSAGE_POOL_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <google/protobuf/message.h>
+
+namespace SectBattle {
+    //只能在一个线程里用, 返回的对象在下一次取同一种消息之前有效
+    class MessagePool {
+        public:
+            //按消息名取, 名字不合法时返回nullptr
+            google::protobuf::Message* Get(const std::string& name);
+
+            //取一个清空过的T
+            template<typename T>
+            T* Get() {
+                static_assert(std::is_base_of<google::protobuf::Message, T>::value,
+                        "T must derive from google::protobuf::Message");
+                auto & slot = by_descriptor_[T::descriptor()];
+                if (slot == nullptr) {
+                    slot.reset(new T);
+                } else {
+                    slot->Clear();
+                }
+                return static_cast<T*>(slot.get());
+            }
+
+        private:
+            std::map<std::string, std::unique_ptr<google::protobuf::Message>> by_name_;
+            std::map<const google::protobuf::Descriptor*,
+                std::unique_ptr<google::protobuf::Message>> by_descriptor_;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_MESSAGE_POOL_H__  ----- */
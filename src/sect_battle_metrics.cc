@@ -0,0 +1,80 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_metrics.cc
+ *        Created:  06/07/15 10:31:12
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_metrics.h"
+#include <cstdio>
+#include <cinttypes>
+
+namespace SectBattle {
+    void MetricsWriter::Declare(alpha::Slice name, alpha::Slice type, alpha::Slice help) {
+        out_ += "# HELP ";
+        out_.append(name.data(), name.size());
+        out_ += ' ';
+        out_.append(help.data(), help.size());
+        out_ += "\n# TYPE ";
+        out_.append(name.data(), name.size());
+        out_ += ' ';
+        out_.append(type.data(), type.size());
+        out_ += '\n';
+    }
+
+    void MetricsWriter::Sample(alpha::Slice name, double value, Labels labels) {
+        AppendNameAndLabels(name, labels);
+        char buf[32];
+        int n = ::snprintf(buf, sizeof(buf), " %.6g\n", value);
+        out_.append(buf, n);
+    }
+
+    void MetricsWriter::Sample(alpha::Slice name, uint64_t value, Labels labels) {
+        AppendNameAndLabels(name, labels);
+        char buf[32];
+        int n = ::snprintf(buf, sizeof(buf), " %" PRIu64 "\n", value);
+        out_.append(buf, n);
+    }
+
+    void MetricsWriter::Sample(alpha::Slice name, int64_t value, Labels labels) {
+        AppendNameAndLabels(name, labels);
+        char buf[32];
+        int n = ::snprintf(buf, sizeof(buf), " %" PRId64 "\n", value);
+        out_.append(buf, n);
+    }
+
+    void MetricsWriter::AppendNameAndLabels(alpha::Slice name, Labels labels) {
+        out_.append(name.data(), name.size());
+        if (labels.size() == 0) {
+            return;
+        }
+        out_ += '{';
+        bool first = true;
+        for (const auto & label : labels) {
+            if (!first) {
+                out_ += ',';
+            }
+            first = false;
+            out_.append(label.first.data(), label.first.size());
+            out_ += "=\"";
+            //标签值只会是消息名和数字, 这里还是按规范转义一下
+            for (auto c : label.second) {
+                if (c == '\\' || c == '"') {
+                    out_ += '\\';
+                    out_ += c;
+                } else if (c == '\n') {
+                    out_ += "\\n";
+                } else {
+                    out_ += c;
+                }
+            }
+            out_ += '"';
+        }
+        out_ += '}';
+    }
+}
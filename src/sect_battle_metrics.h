@@ -0,0 +1,67 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_metrics.h
+ *        Created:  06/07/15 10:05:36
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  计数器和Prometheus文本格式的输出
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_METRICS_H__
+#define  __SECT_BATTLE_METRICS_H__
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <initializer_list>
+#include <alpha/slice.h>
+
+namespace SectBattle {
+    //只增不减, 用relaxed就够了
+    class Counter {
+        public:
+            void Add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+            uint64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+        private:
+            std::atomic<uint64_t> value_ {0};
+    };
+
+    class Gauge {
+        public:
+            void Set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+            void SetMax(int64_t v) {
+                auto current = Value();
+                while (v > current && !value_.compare_exchange_weak(current, v,
+                            std::memory_order_relaxed)) {
+                }
+            }
+            int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+        private:
+            std::atomic<int64_t> value_ {0};
+    };
+
+    //按Prometheus text exposition format(0.0.4)拼接输出
+    class MetricsWriter {
+        public:
+            using Label = std::pair<alpha::Slice, std::string>;
+            using Labels = std::initializer_list<Label>;
+
+            //每个指标在输出样本之前先调用一次
+            void Declare(alpha::Slice name, alpha::Slice type, alpha::Slice help);
+            void Sample(alpha::Slice name, double value, Labels labels = {});
+            void Sample(alpha::Slice name, uint64_t value, Labels labels = {});
+            void Sample(alpha::Slice name, int64_t value, Labels labels = {});
+            const std::string& str() const { return out_; }
+
+        private:
+            void AppendNameAndLabels(alpha::Slice name, Labels labels);
+            std::string out_;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_METRICS_H__  ----- */
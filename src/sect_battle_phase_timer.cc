@@ -0,0 +1,54 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_phase_timer.cc
+ *        Created:  06/06/15 15:48:09
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_phase_timer.h"
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include <alpha/logger.h>
+
+namespace SectBattle {
+    const char* PhaseName(Phase phase) {
+        switch (phase) {
+            case Phase::kParseWrapper:
+                return "ParseWrapper";
+            case Phase::kCreateMessage:
+                return "CreateMessage";
+            case Phase::kParsePayload:
+                return "ParsePayload";
+            case Phase::kHandler:
+                return "Handler";
+            case Phase::kSetBattleField:
+                return "SetBattleField";
+            case Phase::kSerialize:
+                return "Serialize";
+            default:
+                assert (false);
+                return "Unknown";
+        }
+    }
+
+    double PhaseTimer::CyclesPerNanosecond() {
+        static const double cycles_per_ns = [] {
+            using namespace std::chrono;
+            auto start_time = steady_clock::now();
+            auto start_cycles = Now();
+            std::this_thread::sleep_for(milliseconds(10));
+            auto cycles = Now() - start_cycles;
+            auto ns = duration_cast<nanoseconds>(steady_clock::now() - start_time).count();
+            double res = ns > 0 ? static_cast<double>(cycles) / ns : 1.0;
+            LOG_INFO << "PhaseTimer calibrated, cycles per ns = " << res;
+            return res > 0 ? res : 1.0;
+        }();
+        return cycles_per_ns;
+    }
+}
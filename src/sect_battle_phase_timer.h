@@ -0,0 +1,96 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_phase_timer.h
+ *        Created:  06/06/15 15:20:44
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  按阶段统计处理请求的耗时, 用TSC计时, 开销只有几十个周期
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_PHASE_TIMER_H__
+#define  __SECT_BATTLE_PHASE_TIMER_H__
+
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace SectBattle {
+    //处理一个请求的各个阶段
+    //kHandler包含了在handler里面调用的kSetBattleField和kSerialize
+    enum class Phase {
+        kParseWrapper = 0,
+        kCreateMessage = 1,
+        kParsePayload = 2,
+        kHandler = 3,
+        kSetBattleField = 4,
+        kSerialize = 5,
+        kMax = 6
+    };
+    const char* PhaseName(Phase phase);
+
+    class PhaseTimer {
+        public:
+            static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+                return __rdtsc();
+#else
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+            }
+            //第一次调用时校准, 大约耗时10ms
+            static double CyclesPerNanosecond();
+    };
+
+    class PhaseStatistics {
+        public:
+            struct Entry {
+                uint64_t count;
+                uint64_t total_cycles;
+                uint64_t max_cycles;
+            };
+
+            void Add(Phase phase, uint64_t cycles) {
+                Entry& entry = entries_[static_cast<int>(phase)];
+                ++entry.count;
+                entry.total_cycles += cycles;
+                entry.max_cycles = std::max(entry.max_cycles, cycles);
+            }
+            const Entry& Get(Phase phase) const {
+                return entries_[static_cast<int>(phase)];
+            }
+
+        private:
+            std::array<Entry, static_cast<int>(Phase::kMax)> entries_ {};
+    };
+
+    //作用域结束时把耗时记到stats中, stats为nullptr时什么都不做
+    class ScopedPhase {
+        public:
+            ScopedPhase(PhaseStatistics* stats, Phase phase)
+                :stats_(stats), phase_(phase), start_(stats ? PhaseTimer::Now() : 0) {
+            }
+            ~ScopedPhase() {
+                if (stats_) {
+                    stats_->Add(phase_, PhaseTimer::Now() - start_);
+                }
+            }
+            ScopedPhase(const ScopedPhase&) = delete;
+            ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+        private:
+            PhaseStatistics* stats_;
+            Phase phase_;
+            uint64_t start_;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_PHASE_TIMER_H__  ----- */
@@ -0,0 +1,86 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_random.h
+ *        Created:  06/12/15 09:41:27
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  可以指定种子的xoshiro256**
+ *                  比mt19937_64的状态小得多, 按请求重新派生时也很便宜
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_RANDOM_H__
+#define  __SECT_BATTLE_RANDOM_H__
+
+#include <cassert>
+#include <cstdint>
+#include <array>
+#include <limits>
+
+namespace SectBattle {
+    //满足UniformRandomBitGenerator, 也可以直接给<random>里的分布用
+    class Random {
+        public:
+            using result_type = uint64_t;
+            static constexpr result_type min() { return 0; }
+            static constexpr result_type max() {
+                return std::numeric_limits<result_type>::max();
+            }
+
+            explicit Random(uint64_t seed = 0) { Seed(seed); }
+
+            //用splitmix64把种子展开成256位的状态, 保证状态不全为0
+            void Seed(uint64_t seed) {
+                for (auto & s : s_) {
+                    s = SplitMix64(&seed);
+                }
+            }
+            //同一个种子和(a, b)总是得到同一个序列, 不同的(a, b)之间互不相关
+            static Random Derive(uint64_t seed, uint64_t a, uint64_t b) {
+                uint64_t state = seed;
+                uint64_t x = SplitMix64(&state) ^ a;
+                x = SplitMix64(&x) ^ b;
+                return Random(SplitMix64(&x));
+            }
+
+            result_type operator()() {
+                const uint64_t result = Rotl(s_[1] * 5, 7) * 9;
+                const uint64_t t = s_[1] << 17;
+                s_[2] ^= s_[0];
+                s_[3] ^= s_[1];
+                s_[1] ^= s_[2];
+                s_[0] ^= s_[3];
+                s_[2] ^= t;
+                s_[3] = Rotl(s_[3], 45);
+                return result;
+            }
+
+            //[0, n), 用乘法代替取模, 偏差在n远小于2^32时可以忽略
+            uint32_t Uniform(uint32_t n) {
+                assert (n != 0);
+                return static_cast<uint32_t>(((*this)() >> 32) * n >> 32);
+            }
+            //[low, high)
+            uint32_t Uniform(uint32_t low, uint32_t high) {
+                assert (low < high);
+                return low + Uniform(high - low);
+            }
+
+        private:
+            static uint64_t Rotl(uint64_t x, int k) {
+                return (x << k) | (x >> (64 - k));
+            }
+            static uint64_t SplitMix64(uint64_t* state) {
+                uint64_t z = (*state += 0x9e3779b97f4a7c15);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                return z ^ (z >> 31);
+            }
+
+            std::array<uint64_t, 4> s_;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_RANDOM_H__  ----- */
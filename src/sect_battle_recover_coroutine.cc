@@ -11,23 +11,25 @@
  */
 
 #include "sect_battle_recover_coroutine.h"
+#include <unistd.h>
+#include <cstdio>
+#include <set>
 #include <alpha/format.h>
+#include <alpha/time_util.h>
 #include "tt_client.h"
 #include "sect_battle_server_def.h"
 #include "sect_battle_backup_metadata.h"
+#include "sect_battle_backup_manifest.h"
+#include "sect_battle_crc32c.h"
 
 namespace SectBattle {
     RecoverCoroutine::RecoverCoroutine(tokyotyrant::Client* client,
                         const alpha::NetAddress& backup_server_address,
                         alpha::Slice backup_metadata_file_path,
-                        alpha::Slice owner_map_file_path,
-                        alpha::Slice combatant_map_file_path,
-                        alpha::Slice opponent_map_file_path)
+                        const FilePathMap& data_file_paths)
         :client_(client), backup_server_address_(backup_server_address),
         backup_metadata_file_path_(backup_metadata_file_path.ToString()),
-        owner_map_file_path_(owner_map_file_path.ToString()),
-        combatant_map_file_path_(combatant_map_file_path.ToString()),
-        opponent_map_file_path_(opponent_map_file_path.ToString()) {
+        data_file_paths_(data_file_paths) {
 
         assert (client_);
     }
@@ -40,6 +42,7 @@ namespace SectBattle {
         }
 
         LOG_INFO << "Recovery started";
+        auto start = alpha::Now();
         std::string saved_backup_metadata;
         auto md = RecoverBackupMetaData(&saved_backup_metadata);
         if (md == nullptr) {
@@ -52,27 +55,56 @@ namespace SectBattle {
             << ", prefix = " << md->LatestBackupPrefix();
 
         const std::string backup_prefix = md->LatestBackupPrefix();
-
-        if (!RecoverFile(backup_prefix, kOwnerMapDataKey, owner_map_file_path_)) {
-            LOG_ERROR << "Recover file failed, path = " << owner_map_file_path_.data();
+        std::string saved_manifest;
+        auto manifest = RecoverManifest(backup_prefix, *md, &saved_manifest);
+        if (manifest == nullptr) {
+            LOG_ERROR << "RecoverManifest failed, prefix = " << backup_prefix;
             return;
         }
 
-        if (!RecoverFile(backup_prefix, kCombatantMapDataKey, combatant_map_file_path_)) {
-            LOG_ERROR << "Recover file failed, path = " << combatant_map_file_path_.data();
-            return;
+        //先全部下载到临时文件并校验通过，再一起替换本地文件
+        //下载或校验失败的话本地的mmap文件不会被改动, 已经写好的临时文件也都删掉
+        for (const auto& p : data_file_paths_) {
+            const std::string tmp_path = TemporaryPath(p.second);
+            if (!RecoverFile(backup_prefix, *manifest, p.first, tmp_path)) {
+                LOG_ERROR << "Recover file failed, key = " << p.first
+                    << ", path = " << tmp_path;
+                RemoveTemporaryFiles();
+                return;
+            }
         }
 
-        if (!RecoverFile(backup_prefix, kOpponentMapDataKey, opponent_map_file_path_)) {
-            LOG_ERROR << "Recover file failed, path = " << opponent_map_file_path_.data();
+        const std::string tmp_metadata_path = TemporaryPath(backup_metadata_file_path_);
+        if (!WriteFile(tmp_metadata_path, saved_backup_metadata)) {
+            LOG_ERROR << "Save backup metadata failed, path = " << tmp_metadata_path;
+            RemoveTemporaryFiles();
             return;
         }
 
-        if (!SaveBackupMetaData(saved_backup_metadata)) {
-            LOG_ERROR << "SaveBackupMetaData failed";
-            return;
+        //每个rename是原子的, 但几个文件之间不是
+        //第一个就失败时本地还是完整的旧数据, 之后再失败就是新旧混在一起, 不能再启动
+        size_t renamed = 0;
+        for (const auto& p : data_file_paths_) {
+            if (!RenameFile(TemporaryPath(p.second), p.second)) {
+                CHECK (renamed == 0) << "Local mmap files partially replaced, renamed = "
+                    << renamed << "/" << data_file_paths_.size()
+                    << ", rerun recovery before starting the server";
+                RemoveTemporaryFiles();
+                return;
+            }
+            ++renamed;
         }
-        LOG_INFO << "Recover from db done";
+        //metadata最后替换
+        const bool metadata_renamed = RenameFile(tmp_metadata_path,
+                backup_metadata_file_path_);
+        CHECK (metadata_renamed) << "Local mmap files replaced but backup metadata not"
+            << ", rerun recovery before starting the server";
+        //恢复的时候没有起管理端口, 吞吐量只能记在日志里
+        auto elapsed = alpha::Now() - start;
+        LOG_INFO << "Recover from db done, bytes = " << bytes_received_
+            << ", elapsed = " << elapsed << "ms"
+            << ", throughput = " << (elapsed > 0 ? bytes_received_ / elapsed : 0)
+            << "KB/s";
     }
 
     BackupMetadata* RecoverCoroutine::RecoverBackupMetaData(std::string* buffer) {
@@ -91,11 +123,54 @@ namespace SectBattle {
         return res;
     }
 
-    bool RecoverCoroutine::RecoverFile(alpha::Slice backup_prefix, alpha::Slice key,
-            alpha::Slice path) {
+    const BackupManifest* RecoverCoroutine::RecoverManifest(alpha::Slice backup_prefix,
+            const BackupMetadata& md, std::string* buffer) {
+        assert (buffer);
+        const std::string key = BackupManifest::ManifestKey(backup_prefix);
+        int err = client_->Get(key, buffer);
+        if (err) {
+            LOG_ERROR << "Get failed, key = " << key << ", err = " << err;
+            return nullptr;
+        }
+
+        auto manifest = BackupManifest::Restore(buffer->data(), buffer->size());
+        if (manifest == nullptr) {
+            LOG_ERROR << "Restore BackupManifest failed"
+                << ", buffer->size() = " << buffer->size();
+            return nullptr;
+        }
+        //同一个前缀下的manifest必须和metadata属于同一次备份
+        if (manifest->BackupStartTime() != md.StartTime()) {
+            LOG_ERROR << "Manifest mismatch backup metadata"
+                << ", manifest->BackupStartTime() = " << manifest->BackupStartTime()
+                << ", md.StartTime() = " << md.StartTime();
+            return nullptr;
+        }
+        for (int i = 0; i < manifest->FileCount(); ++i) {
+            const auto& file = manifest->File(i);
+            LOG_INFO << "Manifest file, key = " << file.Key()
+                << ", size = " << file.size
+                << ", parts = " << file.parts;
+        }
+        return manifest;
+    }
+
+    bool RecoverCoroutine::RecoverFile(alpha::Slice backup_prefix,
+            const BackupManifest& manifest, alpha::Slice key, alpha::Slice path) {
+        auto file = manifest.FindFile(key);
+        if (file == nullptr) {
+            LOG_ERROR << "File not found in manifest, key = " << key.ToString();
+            return false;
+        }
+
+        std::set<std::string> expected_keys;
+        for (uint32_t part = 0; part < file->parts; ++part) {
+            expected_keys.insert(BackupManifest::PartKey(backup_prefix, key,
+                        part, file->parts));
+        }
+
         std::string prefix_key = backup_prefix.ToString() + "_" + key.ToString();
         std::vector<std::string> keys;
-        LOG_INFO << "prefix_key = " << prefix_key << '\n';
         int err = client_->GetForwardMatchKeys(prefix_key,
                 std::numeric_limits<int32_t>::max(),
                 std::back_inserter(keys));
@@ -104,28 +179,43 @@ namespace SectBattle {
                 << ", err = " << err;
             return false;
         }
+        if (std::set<std::string>(keys.begin(), keys.end()) != expected_keys) {
+            LOG_ERROR << "Mismatch keys in backup, prefix_key = " << prefix_key
+                << ", keys.size() = " << keys.size()
+                << ", file->parts = " << file->parts;
+            return false;
+        }
+
         auto deleter = [](FILE* fp) { if (fp) ::fclose(fp); };
         std::unique_ptr<FILE, decltype(deleter)> fp(fopen(path.data(), "wb"), deleter);
         if (fp == nullptr) {
             LOG_ERROR << "fopen failed, path = " << path.data();
             return false;
         }
-        LOG_INFO << "prefix_key = " << prefix_key.data() 
-            << ", keys.size() = " << keys.size();
-        const int keys_size = keys.size();
-        for (int i = 0; i < keys_size; ++i) {
-            std::string real_key;
-            if (keys_size == 1) {
-                real_key = GetRealKey(backup_prefix, key);
-            } else {
-                real_key = GetRealKey(backup_prefix, key, i + 1);
-            }
+
+        uint64_t total = 0;
+        for (uint32_t part = 0; part < file->parts; ++part) {
+            auto real_key = BackupManifest::PartKey(backup_prefix, key,
+                    part, file->parts);
             std::string val;
             err = client_->Get(real_key, &val);
             if (err) {
                 LOG_ERROR << "Get failed, key = " << real_key;
                 return false;
             }
+            if (val.size() != file->PartSize(part)) {
+                LOG_ERROR << "Mismatch part size, key = " << real_key
+                    << ", size = " << val.size()
+                    << ", expected = " << file->PartSize(part);
+                return false;
+            }
+            auto crc = Crc32c(val);
+            if (crc != file->crc[part]) {
+                LOG_ERROR << "Mismatch crc32c, key = " << real_key
+                    << ", crc = " << crc
+                    << ", expected = " << file->crc[part];
+                return false;
+            }
             auto nbytes = ::fwrite(val.data(), 1, val.size(), fp.get());
             if (nbytes != val.size()) {
                 LOG_ERROR << "fwrite failed, key = " << real_key
@@ -133,33 +223,62 @@ namespace SectBattle {
                     << ", nbytes = " << nbytes;
                 return false;
             }
-            LOG_INFO << "write " << nbytes << " to " << path.data();
+            total += nbytes;
+            bytes_received_ += nbytes;
+        }
+        if (total != file->size) {
+            LOG_ERROR << "Mismatch file size, key = " << key.ToString()
+                << ", total = " << total
+                << ", expected = " << file->size;
+            return false;
+        }
+        if (::fflush(fp.get()) != 0 || ::fsync(::fileno(fp.get())) != 0) {
+            PLOG_ERROR << "fflush or fsync failed, path = " << path.data();
+            return false;
         }
+        LOG_INFO << "write " << total << " to " << path.data();
         return true;
     }
 
-    bool RecoverCoroutine::SaveBackupMetaData(alpha::Slice backup_metadata) {
-        const alpha::Slice path = backup_metadata_file_path_;
+    bool RecoverCoroutine::WriteFile(alpha::Slice path, alpha::Slice data) {
         auto deleter = [](FILE* fp) { if (fp) ::fclose(fp); };
         std::unique_ptr<FILE, decltype(deleter)> fp(fopen(path.data(), "wb"), deleter);
         if (fp == nullptr) {
             LOG_ERROR << "fopen failed, path = " << path.data();
             return false;
         }
-        auto nbytes = ::fwrite(backup_metadata.data(), 1, backup_metadata.size(), fp.get());
-        LOG_ERROR_IF(nbytes != backup_metadata.size()) << "fwrite failed"
-            << ", size = " << backup_metadata.size()
-            << ", nbytes = " << nbytes;
-        return nbytes == backup_metadata.size();
+        auto nbytes = ::fwrite(data.data(), 1, data.size(), fp.get());
+        if (nbytes != data.size()) {
+            LOG_ERROR << "fwrite failed"
+                << ", size = " << data.size()
+                << ", nbytes = " << nbytes;
+            return false;
+        }
+        if (::fflush(fp.get()) != 0 || ::fsync(::fileno(fp.get())) != 0) {
+            PLOG_ERROR << "fflush or fsync failed, path = " << path.data();
+            return false;
+        }
+        return true;
+    }
+
+    bool RecoverCoroutine::RenameFile(alpha::Slice from, alpha::Slice to) {
+        if (::rename(from.data(), to.data()) != 0) {
+            PLOG_ERROR << "rename failed, from = " << from.data()
+                << ", to = " << to.data();
+            return false;
+        }
+        LOG_INFO << "rename " << from.data() << " to " << to.data();
+        return true;
     }
 
-    std::string RecoverCoroutine::GetRealKey(alpha::Slice prefix, alpha::Slice key,
-            int part) {
-        std::string res = prefix.ToString() + "_" + key.ToString();
-        if (part == 0) {
-            return res;
-        } else {
-            return res + "_" + std::to_string(part);
+    void RecoverCoroutine::RemoveTemporaryFiles() {
+        for (const auto& p : data_file_paths_) {
+            ::unlink(TemporaryPath(p.second).data());
         }
+        ::unlink(TemporaryPath(backup_metadata_file_path_).data());
+    }
+
+    std::string RecoverCoroutine::TemporaryPath(alpha::Slice path) const {
+        return path.ToString() + ".recovering";
     }
 }
@@ -13,6 +13,8 @@
 #ifndef  __SECT_BATTLE_RECOVER_COROUTINE_H__
 #define  __SECT_BATTLE_RECOVER_COROUTINE_H__
 
+#include <map>
+#include <string>
 #include <alpha/coroutine.h>
 #include <alpha/net_address.h>
 namespace tokyotyrant {
@@ -21,29 +23,35 @@ namespace tokyotyrant {
 
 namespace SectBattle {
     class BackupMetadata;
+    class BackupManifest;
     class RecoverCoroutine final : public alpha::Coroutine {
         public:
+            //key -> 本地mmap文件路径
+            using FilePathMap = std::map<std::string, std::string>;
             RecoverCoroutine(tokyotyrant::Client* client,
                     const alpha::NetAddress& backup_server_address,
                     alpha::Slice backup_metadata_file_path,
-                    alpha::Slice owner_map_file_path,
-                    alpha::Slice combatant_map_file_path,
-                    alpha::Slice opponent_map_file_path);
+                    const FilePathMap& data_file_paths);
 
             virtual void Routine() override;
 
         private:
             BackupMetadata* RecoverBackupMetaData(std::string* buffer);
-            bool RecoverFile(alpha::Slice backup_prefix, alpha::Slice key,
-                    alpha::Slice path);
-            bool SaveBackupMetaData(alpha::Slice backup_metadata);
-            std::string GetRealKey(alpha::Slice prefix, alpha::Slice key, int part = 0);
+            const BackupManifest* RecoverManifest(alpha::Slice backup_prefix,
+                    const BackupMetadata& md, std::string* buffer);
+            //下载并校验, 写到临时文件中
+            bool RecoverFile(alpha::Slice backup_prefix, const BackupManifest& manifest,
+                    alpha::Slice key, alpha::Slice path);
+            bool WriteFile(alpha::Slice path, alpha::Slice data);
+            bool RenameFile(alpha::Slice from, alpha::Slice to);
+            //失败时删掉所有的临时文件, 不存在的忽略
+            void RemoveTemporaryFiles();
+            std::string TemporaryPath(alpha::Slice path) const;
             tokyotyrant::Client* client_;
             alpha::NetAddress backup_server_address_;
             std::string backup_metadata_file_path_;
-            std::string owner_map_file_path_;
-            std::string combatant_map_file_path_;
-            std::string opponent_map_file_path_;
+            FilePathMap data_file_paths_;
+            uint64_t bytes_received_ = 0;
     };
 }
 
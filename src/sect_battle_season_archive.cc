@@ -0,0 +1,209 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_season_archive.cc
+ *        Created:  06/12/15 14:40:51
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_season_archive.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <algorithm>
+#include <zlib.h>
+#include <alpha/logger.h>
+#include <alpha/time_util.h>
+
+namespace SectBattle {
+    namespace {
+        //gzwrite和gzread的长度是unsigned, 分块处理
+        const size_t kChunkSize = 1 << 20;
+    }
+
+    SeasonArchive::SeasonArchive() {
+        thread_ = std::thread(&SeasonArchive::WriteRoutine, this);
+    }
+
+    SeasonArchive::~SeasonArchive() {
+        Push(Task{Task::Type::kStop, std::string(), std::string()});
+        thread_.join();
+    }
+
+    void SeasonArchive::Begin(const std::string& path, std::string header) {
+        if (begun_) {
+            LOG_WARNING << "Previous season archive not finished, abandon it";
+        } else if (unfinished_ > 0) {
+            LOG_WARNING << "Previous season archive still writing, queue after it";
+        }
+        begun_ = true;
+        ++unfinished_;
+        Push(Task{Task::Type::kBegin, path, std::move(header)});
+    }
+
+    void SeasonArchive::Append(std::string data) {
+        assert (begun_);
+        if (!data.empty()) {
+            Push(Task{Task::Type::kAppend, std::string(), std::move(data)});
+        }
+    }
+
+    void SeasonArchive::Finish() {
+        assert (begun_);
+        begun_ = false;
+        Push(Task{Task::Type::kFinish, std::string(), std::string()});
+    }
+
+    void SeasonArchive::Push(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        cond_.notify_one();
+    }
+
+    void SeasonArchive::WriteRoutine() {
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return !tasks_.empty(); });
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            switch (task.type) {
+                case Task::Type::kBegin:
+                    Open(task.path);
+                    Write(task.data);
+                    break;
+                case Task::Type::kAppend:
+                    Write(task.data);
+                    break;
+                case Task::Type::kFinish:
+                    Close();
+                    break;
+                case Task::Type::kStop:
+                    Abandon();
+                    return;
+            }
+        }
+    }
+
+    void SeasonArchive::Open(const std::string& path) {
+        Abandon();
+        active_ = true;
+        failed_ = false;
+        path_ = path;
+        written_bytes_ = 0;
+        start_time_ = alpha::Now();
+        file_ = ::gzopen((path_ + ".tmp").data(), "wb");
+        if (file_ == nullptr) {
+            LOG_ERROR << "gzopen failed, path = " << path_ << ".tmp";
+            failed_ = true;
+        }
+    }
+
+    void SeasonArchive::Write(const std::string& data) {
+        if (!active_ || failed_) {
+            return;
+        }
+        for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+            const unsigned n = std::min(kChunkSize, data.size() - offset);
+            if (::gzwrite(file_, data.data() + offset, n) != static_cast<int>(n)) {
+                LOG_ERROR << "gzwrite failed, path = " << path_
+                    << ".tmp, offset = " << written_bytes_ + offset;
+                failed_ = true;
+                return;
+            }
+        }
+        written_bytes_ += data.size();
+    }
+
+    void SeasonArchive::Close() {
+        if (!active_ || failed_) {
+            Abandon();
+            return;
+        }
+        const std::string tmp_path = path_ + ".tmp";
+        const bool closed = ::gzclose(file_) == Z_OK;
+        file_ = nullptr;
+        active_ = false;
+        --unfinished_;
+        if (!closed) {
+            LOG_ERROR << "gzclose failed, path = " << tmp_path;
+        } else if (::chmod(tmp_path.data(), S_IRUSR | S_IRGRP | S_IROTH) != 0
+                || ::rename(tmp_path.data(), path_.data()) != 0) {
+            LOG_ERROR << "Finish archive failed, path = " << path_;
+        } else {
+            LOG_INFO << "Season archived, path = " << path_
+                << ", size = " << written_bytes_
+                << ", cost = " << alpha::Now() - start_time_ << "ms";
+        }
+    }
+
+    void SeasonArchive::Abandon() {
+        //没有Finish或者写失败的存档不留下半个文件
+        if (!active_) {
+            return;
+        }
+        if (file_) {
+            ::gzclose(file_);
+            file_ = nullptr;
+        }
+        ::unlink((path_ + ".tmp").data());
+        LOG_WARNING << "Season archive abandoned, path = " << path_;
+        active_ = false;
+        --unfinished_;
+    }
+
+    std::unique_ptr<SeasonArchiveReader> SeasonArchiveReader::Open(
+            const std::string& path, BattleStore::SnapshotView* view) {
+        assert (view);
+        gzFile file = ::gzopen(path.data(), "rb");
+        if (file == nullptr) {
+            LOG_ERROR << "gzopen failed, path = " << path;
+            return nullptr;
+        }
+        std::unique_ptr<SeasonArchiveReader> reader(new SeasonArchiveReader(file, path));
+        //下标0不用, 和开头一起读掉
+        std::string& header = reader->header_;
+        header.resize(BattleStore::ArchiveHeaderSize() + sizeof(Combatant));
+        if (::gzread(file, &header[0], header.size()) != static_cast<int>(header.size())
+                || !BattleStore::ParseArchiveHeader(header.data(), header.size(), view)) {
+            LOG_ERROR << "Invalid season archive, path = " << path;
+            return nullptr;
+        }
+        reader->remain_ = view->high_water;
+        return reader;
+    }
+
+    SeasonArchiveReader::SeasonArchiveReader(gzFile_s* file, const std::string& path)
+        :file_(file), path_(path) {
+    }
+
+    SeasonArchiveReader::~SeasonArchiveReader() {
+        ::gzclose(file_);
+    }
+
+    int SeasonArchiveReader::Next(Combatant* combatants, int max) {
+        assert (combatants && max > 0);
+        const unsigned n = std::min<uint32_t>(remain_,
+                std::min<size_t>(max, kChunkSize / sizeof(Combatant)));
+        if (n == 0) {
+            return 0;
+        }
+        const int bytes = n * sizeof(Combatant);
+        if (::gzread(file_, combatants, bytes) != bytes) {
+            LOG_ERROR << "Truncated season archive, path = " << path_
+                << ", remain = " << remain_;
+            return -1;
+        }
+        remain_ -= n;
+        return n;
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_season_archive.h
+ *        Created:  06/12/15 14:26:09
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  重置赛季前把上个赛季的BattleStore存成gzip压缩的只读文件
+ *                  事件循环中按批从BattleStore取数据, 压缩和写文件在后台线程中做
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_SEASON_ARCHIVE_H__
+#define  __SECT_BATTLE_SEASON_ARCHIVE_H__
+
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "sect_battle_store.h"
+
+struct gzFile_s;
+
+namespace SectBattle {
+    //存档格式和mmap文件一样: 对齐到64字节的Header | Combatant[0, high_water]
+    //事件循环只把数据交给后台线程, 压缩和写文件都在后台线程中按顺序做
+    class SeasonArchive {
+        public:
+            SeasonArchive();
+            //等后台线程写完已经Finish的存档, 没有Finish的放弃
+            ~SeasonArchive();
+
+            //开始新的存档, header为BattleStore::Clear填入的开头
+            //上一个存档还没Finish时放弃它
+            void Begin(const std::string& path, std::string header);
+            //追加BattleStore::ArchiveSlice取出的数据
+            void Append(std::string data);
+            //数据都齐了, 先写到path.tmp, 完成后改名并设为只读
+            void Finish();
+
+        private:
+            struct Task {
+                enum class Type {
+                    kBegin,
+                    kAppend,
+                    kFinish,
+                    kStop,
+                };
+                Type type;
+                std::string path; //只有kBegin有
+                std::string data;
+            };
+
+            void Push(Task task);
+            //以下在后台线程中调用
+            void WriteRoutine();
+            void Open(const std::string& path);
+            void Write(const std::string& data);
+            void Close();
+            void Abandon();
+
+            //只在事件循环中用
+            bool begun_ = false;
+            //Begin了但后台线程还没写完或放弃的存档个数
+            std::atomic<int> unfinished_ {0};
+            std::mutex mutex_;
+            std::condition_variable cond_;
+            std::deque<Task> tasks_;
+            //以下只在后台线程中用
+            bool active_ = false;
+            bool failed_ = false;
+            gzFile_s* file_ = nullptr;
+            std::string path_;
+            size_t written_bytes_ = 0;
+            int64_t start_time_ = 0;
+            std::thread thread_;
+    };
+
+    //先读开头, 再按下标顺序分批读Combatant, 不把整个存档读进内存
+    class SeasonArchiveReader {
+        public:
+            //格式不对时返回nullptr, view的combatants为nullptr
+            //view中的指针在reader销毁之前有效
+            static std::unique_ptr<SeasonArchiveReader> Open(const std::string& path,
+                    BattleStore::SnapshotView* view);
+            ~SeasonArchiveReader();
+
+            //从下标1开始读最多max个, 返回读到的个数
+            //读完返回0, 出错或者文件不完整返回-1
+            int Next(Combatant* combatants, int max);
+
+        private:
+            SeasonArchiveReader(gzFile_s* file, const std::string& path);
+
+            gzFile_s* file_;
+            std::string path_;
+            std::string header_;
+            uint32_t remain_ = 0;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_SEASON_ARCHIVE_H__  ----- */
@@ -13,8 +13,14 @@
 #include "sect_battle_server.h"
 
 #include <limits.h>
+#include <unistd.h>
+#include <cstdio>
+#include <array>
+#include <map>
 #include <sstream>
 #include <functional>
+#include <random>
+#include <thread>
 #include <google/protobuf/descriptor.h>
 #include <gflags/gflags.h>
 #include <alpha/compiler.h>
@@ -23,7 +29,6 @@
 #include <alpha/udp_server.h>
 #include <alpha/net_address.h>
 #include <alpha/mmap_file.h>
-#include <alpha/random.h>
 #include <alpha/simple_http_server.h>
 #include "tt_client.h"
 
@@ -34,6 +39,14 @@
 #include "sect_battle_recover_coroutine.h"
 #include "sect_battle_server_conf.h"
 #include "sect_battle_inspector.h"
+#include "sect_battle_store.h"
+#include "sect_battle_phase_timer.h"
+#include "sect_battle_loop_monitor.h"
+#include "sect_battle_message_pool.h"
+#include "sect_battle_field_encoder.h"
+#include "sect_battle_alloc_counter.h"
+#include "sect_battle_traffic_capture.h"
+#include "sect_battle_season_archive.h"
 
 DEFINE_string(conf_path, "sect_battle_svrd.conf", "战场信息配置文件路径");
 DEFINE_string(data_path, "/tmp", "mmap文件存放路径");
@@ -47,21 +60,77 @@ DEFINE_int32(battle_field_cache_ttl, 0, "返回给CGI的全局战场信息缓存
 DEFINE_bool(recovery_mode, false, "以恢复模式启动，从备份TT恢复mmap文件\n"
         "注意，使用本选项会覆盖本地所有mmap文件！");
 DEFINE_bool(auto_backup, true, "是否定期将mmap文件备份到TT");
+DEFINE_int32(startup_build_threads, 4, "启动时重建格子驻军索引的线程数");
+DEFINE_int32(loop_monitor_interval, 5, "检测事件循环延迟的定时器间隔(毫秒)");
+DEFINE_int32(loop_stall_threshold, 50, "事件循环延迟超过多少毫秒时记为一次阻塞");
+DEFINE_bool(season_archive, true, "重置赛季前把上个赛季的数据压缩存档到data_path");
+DEFINE_int32(scrub_slots_per_slice, 16384, "重置赛季后每次存档或清零多少个旧的参战人员位置");
+DEFINE_string(capture_path, "", "把收到的请求记录到这个文件, 为空时不记录");
+DEFINE_int32(capture_buffer_mb, 64, "记录请求的环形缓冲区大小(MiB), 满了会丢包");
+DEFINE_string(replay_capture_path, "", "重放模式, 时钟和战场版本从这个记录文件的开头开始,\n"
+        "之后以请求中的replay_time为时钟, 数据要用记录开始时的");
+DEFINE_uint64(random_seed, 0, "随机数种子, 为0时随机选一个, 重放时用来复现结果");
+DEFINE_string(sect_assignment, "least_populated", "新加入的人分到哪个门派:\n"
+        "random: 随机\n"
+        "least_populated: 人数最少的门派, 人数相同时随机\n"
+        "inverse_population: 按人数的倒数加权随机");
+DEFINE_bool(random_per_request, false, "每个请求按(种子, uin, 请求序号)重新派生随机数\n"
+        "这样一个请求的结果不受之前请求消耗了多少随机数的影响");
 
 namespace detail {
-    std::unique_ptr<google::protobuf::Message> CreateMessage(const std::string& name) {
+    bool ParseSectAssignment(const std::string& name,
+            SectBattle::Server::SectAssignment* policy) {
+        using SectAssignment = SectBattle::Server::SectAssignment;
+        if (name == "random") {
+            *policy = SectAssignment::kRandom;
+        } else if (name == "least_populated") {
+            *policy = SectAssignment::kLeastPopulated;
+        } else if (name == "inverse_population") {
+            *policy = SectAssignment::kInversePopulation;
+        } else {
+            LOG_ERROR << "Invalid sect_assignment: " << name;
+            return false;
+        }
+        return true;
+    }
+
+    //回包中需要通过反射取的字段
+    struct ResponseFields {
+        //所有回包的code都是第2个字段, 但ReportFightResponse的是uint32
+        const google::protobuf::FieldDescriptor* code;
+        int battle_field_number;
+    };
+
+    const ResponseFields& GetResponseFields(const google::protobuf::Message& resp) {
         using namespace google::protobuf;
-        const Descriptor* descriptor =
-            DescriptorPool::generated_pool()->FindMessageTypeByName(name);
-        if (descriptor) {
-            const Message* prototype =
-                MessageFactory::generated_factory()->GetPrototype(descriptor);
-            if (prototype) {
-                return std::unique_ptr<Message>(prototype->New());
-            }
+        static std::map<const Descriptor*, ResponseFields> fields;
+        const Descriptor* descriptor = resp.GetDescriptor();
+        auto it = fields.find(descriptor);
+        if (it == fields.end()) {
+            ResponseFields res;
+            res.code = descriptor->FindFieldByName("code");
+            auto battle_field = descriptor->FindFieldByName("battle_field");
+            res.battle_field_number = battle_field ? battle_field->number() : 0;
+            it = fields.emplace(descriptor, res).first;
         }
+        return it->second;
+    }
 
-        return nullptr;
+    int32_t ResponseCode(const google::protobuf::Message& resp,
+            const google::protobuf::FieldDescriptor* field) {
+        using namespace google::protobuf;
+        if (field == nullptr) {
+            return 0;
+        }
+        const Reflection* reflection = resp.GetReflection();
+        switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_INT32:
+                return reflection->GetInt32(resp, field);
+            case FieldDescriptor::CPPTYPE_UINT32:
+                return static_cast<int32_t>(reflection->GetUInt32(resp, field));
+            default:
+                return 0;
+        }
     }
 }
 
@@ -74,7 +143,9 @@ namespace SectBattle {
 
     bool Server::Run() {
         conf_ = ServerConf::ReadFromFile(FLAGS_conf_path);
-        if (conf_ == nullptr) {
+        if (conf_ == nullptr
+                || !detail::ParseSectAssignment(FLAGS_sect_assignment,
+                    &sect_assignment_)) {
             return false;
         }
 
@@ -85,33 +156,46 @@ namespace SectBattle {
         }
 
         alpha::NetAddress addr(FLAGS_bind_ip, FLAGS_bind_port);
-        dispatcher_.reset (new MessageDispatcher());
-        dispatcher_->Register<QueryBattleFieldRequest>(
-                std::bind(&Server::HandleQueryBattleField, this, _1, _2));
-        dispatcher_->Register<JoinBattleRequest>(
-                std::bind(&Server::HandleJoinBattle, this, _1, _2));
-        dispatcher_->Register<MoveRequest>(
-                std::bind(&Server::HandleMove, this, _1, _2));
-        dispatcher_->Register<ChangeSectRequest>(
-                std::bind(&Server::HandleChangeSect, this, _1, _2));
-        dispatcher_->Register<ChangeOpponentRequest>(
-                std::bind(&Server::HandleChangeOpponent, this, _1, _2));
-        dispatcher_->Register<CheckFightRequest>(
-                std::bind(&Server::HandleCheckFight, this, _1, _2));
-        dispatcher_->Register<ReportFightRequest>(
-                std::bind(&Server::HandleReportFight, this, _1, _2));
+        InitHandlers();
         server_.reset (new alpha::UdpServer(loop_));
+        loop_monitor_.reset (new LoopMonitor(loop_, FLAGS_loop_monitor_interval,
+                    FLAGS_loop_stall_threshold));
+        loop_monitor_->Start();
         if (FLAGS_auto_backup) {
-            loop_->RunEvery(1000, std::bind(&Server::BackupRoutine, this, false));
+            loop_->RunEvery(1000, loop_monitor_->Wrap("BackupRoutine",
+                        std::bind(&Server::BackupRoutine, this, false)));
+        }
+        //重放时在每个请求之前检查, 不依赖定时器的时机
+        if (FLAGS_replay_capture_path.empty()) {
+            loop_->RunEvery(200, loop_monitor_->Wrap("CheckResetBattleField",
+                        std::bind(&Server::CheckResetBattleField, this)));
         }
-        loop_->RunEvery(200, std::bind(&Server::CheckResetBattleField, this));
+        loop_->RunEvery(10, loop_monitor_->Wrap("ScrubRoutine",
+                    std::bind(&Server::ScrubRoutine, this)));
+        //存档要靠ScrubRoutine分批取数据, 启动了这个定时器才能存档
+        archive_seasons_ = FLAGS_season_archive;
+        inspector_.reset (new Inspector());
+        inspector_->RecordProcessStartTime(alpha::Now());
+        PhaseTimer::CyclesPerNanosecond();
+        auto build_start = alpha::Now();
         bool ok =  BuildMMapedData();
         if (!ok) {
             return false;
         }
         LOG_INFO << "BuildMMapedData done";
-        BuildRunData();
-        LOG_INFO << "BuildRunData done";
+        ok = BuildRunData();
+        if (!ok) {
+            return false;
+        }
+        InitRandom();
+        if (!FLAGS_replay_capture_path.empty() && !StartReplay()) {
+            return false;
+        }
+        const auto now = LogicNow();
+        store_->SetProtection(conf_->DefeatedProtectionDuration(), now);
+        inspector_->RecordStartupTime(alpha::Now() - build_start);
+        LOG_INFO << "BuildRunData done, startup time = "
+            << inspector_->StartupTime() << "ms";
 
         auto it = std::find(std::begin(kBackupPrefix),
                 std::end(kBackupPrefix), backup_metadata_->LatestBackupPrefix());
@@ -121,14 +205,16 @@ namespace SectBattle {
             current_backup_prefix_index_ = std::distance(it, std::end(kBackupPrefix)) - 1;
             assert (current_backup_prefix_index_ == 0 || current_backup_prefix_index_ == 1);
         }
-        LOG_INFO << "owner_map_->max_size() = " << owner_map_->max_size();
-        LOG_INFO << "combatant_map_->max_size() = " << combatant_map_->max_size();
-        LOG_INFO << "opponent_map_->max_size() = " << opponent_map_->max_size();
-        //只对加入战场做了限制，所以记录对手的map的上限要大于等于战场人数上限
-        assert (opponent_map_->max_size() >= combatant_map_->max_size());
+        LOG_INFO << "store_->max_size() = " << store_->max_size();
+        if (!FLAGS_capture_path.empty()) {
+            capture_ = TrafficCapture::Create(FLAGS_capture_path,
+                    static_cast<size_t>(FLAGS_capture_buffer_mb) << 20,
+                    now * alpha::kMicroSecondsPerMilliSecond, store_->FieldVersion());
+            if (capture_ == nullptr) {
+                return false;
+            }
+        }
 
-        inspector_.reset (new Inspector());
-        inspector_->RecordProcessStartTime(alpha::Now());
         admin_server_.reset (new alpha::SimpleHTTPServer(loop_, alpha::NetAddress(
                         FLAGS_admin_server_bind_ip, FLAGS_admin_server_bind_port)));
         admin_server_->SetCallback(std::bind(&Server::AdminServerCallback, this, _1, _2));
@@ -136,16 +222,103 @@ namespace SectBattle {
             && admin_server_->Run();
     }
     
+    bool Server::RunInMemory(char* data, size_t size) {
+        conf_ = ServerConf::ReadFromFile(FLAGS_conf_path);
+        if (conf_ == nullptr
+                || !detail::ParseSectAssignment(FLAGS_sect_assignment,
+                    &sect_assignment_)) {
+            return false;
+        }
+        InitHandlers();
+        inspector_.reset (new Inspector());
+        inspector_->RecordProcessStartTime(alpha::Now());
+        PhaseTimer::CyclesPerNanosecond();
+        //不启动定时器, 只是让管理接口可以调用
+        loop_monitor_.reset (new LoopMonitor(loop_, FLAGS_loop_monitor_interval,
+                    FLAGS_loop_stall_threshold));
+        memory_backup_metadata_.reset (new BackupMetadata(BackupMetadata::Default()));
+        backup_metadata_ = memory_backup_metadata_.get();
+        //当作这个赛季刚开始, 否则第一个JoinBattle就会重置战场
+        backup_metadata_->SetLatestBattleFieldResetTime(
+                LogicNow() / alpha::kMilliSecondsPerSecond);
+        store_ = BattleStore::Create(data, size);
+        if (store_ == nullptr) {
+            return false;
+        }
+        ReadBattleFieldFromConf();
+        ReadSectFromConf();
+        InitRandom();
+        store_->SetProtection(conf_->DefeatedProtectionDuration(), LogicNow());
+        return true;
+    }
+
+    BattleStore* Server::store() const {
+        return store_.get();
+    }
+
+    void Server::InitRandom() {
+        uint64_t seed = FLAGS_random_seed;
+        if (seed == 0) {
+            seed = (static_cast<uint64_t>(std::random_device()()) << 32)
+                | std::random_device()();
+        }
+        LOG_INFO << "Random seed = " << seed;
+        random_seed_ = seed;
+        random_.Seed(seed);
+        store_->SetRandom(&random_);
+    }
+
+    bool Server::StartReplay() {
+        auto reader = TrafficCaptureReader::Open(FLAGS_replay_capture_path);
+        if (reader == nullptr) {
+            return false;
+        }
+        replaying_ = true;
+        replay_time_ = reader->start_time();
+        store_->SetFieldVersion(reader->field_version());
+        LOG_INFO << "Replay mode, start_time = " << replay_time_
+            << ", field_version = " << reader->field_version();
+        return true;
+    }
+
+    alpha::TimeStamp Server::LogicNow() const {
+        return replaying_ ? replay_time_ / alpha::kMicroSecondsPerMilliSecond
+            : alpha::Now();
+    }
+
+    void Server::InitHandlers() {
+        using namespace std::placeholders;
+        dispatcher_.reset (new MessageDispatcher());
+        message_pool_.reset (new MessagePool());
+        request_wrapper_.reset (new ProtocolMessage());
+        battle_field_encoder_.reset (new BattleFieldEncoder());
+        dispatcher_->Register<QueryBattleFieldRequest>(
+                std::bind(&Server::HandleQueryBattleField, this, _1, _2));
+        dispatcher_->Register<JoinBattleRequest>(
+                std::bind(&Server::HandleJoinBattle, this, _1, _2));
+        dispatcher_->Register<MoveRequest>(
+                std::bind(&Server::HandleMove, this, _1, _2));
+        dispatcher_->Register<ChangeSectRequest>(
+                std::bind(&Server::HandleChangeSect, this, _1, _2));
+        dispatcher_->Register<ChangeOpponentRequest>(
+                std::bind(&Server::HandleChangeOpponent, this, _1, _2));
+        dispatcher_->Register<CheckFightRequest>(
+                std::bind(&Server::HandleCheckFight, this, _1, _2));
+        dispatcher_->Register<ReportFightRequest>(
+                std::bind(&Server::HandleReportFight, this, _1, _2));
+    }
+
     bool Server::RunRecovery() {
         if (recover_coroutine_ == nullptr) {
             alpha::NetAddress backup_tt_address(FLAGS_backup_tt_ip, FLAGS_backup_tt_port);
+            RecoverCoroutine::FilePathMap data_file_paths;
+            data_file_paths.emplace(kBattleStoreDataKey,
+                    GetMMapedFilePath(kBattleStoreDataKey));
             recover_coroutine_.reset (new RecoverCoroutine(
                 tt_client_.get(), 
                 backup_tt_address,
                 GetMMapedFilePath(kBackupMetaDataKey),
-                GetMMapedFilePath(kOwnerMapDataKey),
-                GetMMapedFilePath(kCombatantMapDataKey),
-                GetMMapedFilePath(kOpponentMapDataKey)
+                data_file_paths
                 )
             );
         }
@@ -166,27 +339,12 @@ namespace SectBattle {
     }
 
     bool Server::BuildMMapedData() {
-        const int kOwnerMapFileSize = 20480; //10KiB
         const int kBackupMetaDataFileSize = 20480; //10KiB
-        const int kCombatantMapFileSize = 120 * (1 << 20); //120MiB
-        const int kOpponentMapFileSize = 200 * (1 << 20); //220MiB
-        //这个SkipList还是太耗费内存了，迫切需要改进
+        const int kBattleStoreFileSize = 256 * (1 << 20); //256MiB
 
-        owner_map_ = BuildMMapedMapFromFile<OwnerMap>(kOwnerMapDataKey,
-                kOwnerMapFileSize);
-        if (owner_map_ == nullptr) {
-            return false;
-        }
-
-        combatant_map_ = BuildMMapedMapFromFile<CombatantMap>(kCombatantMapDataKey,
-                kCombatantMapFileSize);
-        if (combatant_map_ == nullptr) {
-            return false;
-        }
-
-        opponent_map_ = BuildMMapedMapFromFile<OpponentMap>(kOpponentMapDataKey,
-                kOpponentMapFileSize);
-        if (opponent_map_ == nullptr) {
+        store_ = BuildMMapedMapFromFile<BattleStore>(kBattleStoreDataKey,
+                kBattleStoreFileSize);
+        if (store_ == nullptr) {
             return false;
         }
 
@@ -233,107 +391,174 @@ namespace SectBattle {
         return FLAGS_data_path + "/" + std::string(key) + ".mmap";
     }
 
-    void Server::BuildRunData() {
-        //从通过mmap落地的三个SkipList中构造出跑在内存里的各种数据
-        //本来只有一份数据是最好维护的，但是由于结构比较复杂，map里面嵌套各种东西
-        //所以就维护了两份数据，不过运行时只会写SkipList，不会读
-        //所以也不存在不一致的情况
-        //先确定是初始状态
-        assert (battle_field_.empty());
-        assert (sects_.empty());
-        assert (combatants_.empty());
+    bool Server::BuildRunData() {
+        //运行时直接读写mmap文件中的BattleStore, 不再需要构造一份内存里的数据
+        auto it = mmaped_files_.find(kBattleStoreDataKey);
+        assert (it != mmaped_files_.end());
+        if (it->second->newly_created() || !store_->Initialized()) {
+            if (!it->second->newly_created()) {
+                //上次导入中途失败或者退出, 里面只有一部分数据, 从头再来
+                LOG_WARNING << "BattleStore was not initialized completely, create again";
+                store_ = BattleStore::Create(static_cast<char*>(it->second->start()),
+                        it->second->size());
+                if (store_ == nullptr) {
+                    return false;
+                }
+            }
+            ReadBattleFieldFromConf();
+            ReadSectFromConf();
+            if (!ImportLegacyData()) {
+                return false;
+            }
+            //先标记完成再改名, 中间退出时旧数据还在, 但不会再导入一次
+            store_->SetInitialized();
+            RenameLegacyData();
+            return true;
+        }
 
-        ReadBattleFieldFromConf();
-        ReadSectFromConf();
+        //格子类型和出生点要和配置一致
+        int born_field_num = 0;
+        for (int x = 0; x <= Pos::kMaxPos; ++x) {
+            for (int y = 0; y <= Pos::kMaxPos; ++y) {
+                auto pos = Pos::Create(x, y);
+                auto type = CheckGetField(pos).Type();
+                if (type == FieldType::kBornField) {
+                    ++born_field_num;
+                    continue;
+                }
+                auto expected = conf_->IsOffLimitsArea(pos)
+                    ? FieldType::kForbiddenField : FieldType::kDefault;
+                if (type != expected) {
+                    LOG_ERROR << "Mismatch field type, pos = " << pos
+                        << ", type = " << type << ", expected = " << expected;
+                    return false;
+                }
+            }
+        }
+        for (int sect = static_cast<int>(SectType::kNone) + 1;
+                sect != static_cast<int>(SectType::kMax);
+                ++sect ) {
+            auto sect_type = static_cast<SectType>(sect);
+            auto pos = conf_->GetBornPos(sect_type);
+            if (CheckGetSect(sect_type).BornPos() != pos
+                    || CheckGetField(pos).Type() != FieldType::kBornField) {
+                LOG_ERROR << "Mismatch born pos, sect = " << sect_type
+                    << ", pos = " << CheckGetSect(sect_type).BornPos()
+                    << ", expected = " << pos;
+                return false;
+            }
+        }
+        if (born_field_num != BattleStore::kSectCount) {
+            LOG_ERROR << "Mismatch born field num = " << born_field_num;
+            return false;
+        }
 
-        //恢复格子信息
-        for (auto it = owner_map_->begin(); it != owner_map_->end(); ++it) {
-            Field& field = CheckGetField(it->first);
-            field.ChangeOwner(it->second);
+        if (store_->NeedsRebuild()) {
+            LOG_WARNING << "BattleStore was not cleanly updated, rebuild indexes";
+            store_->RebuildIndexes(FLAGS_startup_build_threads);
         }
+        LOG_INFO << "Recover run data done, store_->size() = " << store_->size();
+        return true;
+    }
 
-        //恢复玩家信息
-        for (auto it = combatant_map_->begin(); it != combatant_map_->end(); ++it) {
-            UinType uin = it->first;
-            const CombatantLite& lite = it->second;
-            Field& field = CheckGetField(lite.pos);
-            auto combatant_iter = field.AddGarrison(uin, lite.level,
-                    lite.last_defeated_time);
-            Sect& sect = CheckGetSect(field.Owner());
-            auto res = combatants_.emplace(std::piecewise_construct,
-                    std::forward_as_tuple(uin),
-                    std::forward_as_tuple(&sect, lite.pos, combatant_iter));
-            sect.AddMember(uin);
-            assert (res.second);
-            (void)res;
-            LOG_INFO << "Recover combatant, uin = " << uin;
+    bool Server::ImportLegacyData() {
+        //旧版本把数据落地在三个SkipList中, 第一次启动时导入
+        std::vector<std::string> paths;
+        for (auto key : {kOwnerMapDataKey, kCombatantMapDataKey, kOpponentMapDataKey}) {
+            paths.push_back(GetMMapedFilePath(key));
+        }
+        if (std::any_of(paths.begin(), paths.end(), [](const std::string& path) {
+                    return ::access(path.data(), F_OK) != 0;
+                    })) {
+            return true;
+        }
+
+        std::vector<std::unique_ptr<alpha::MMapFile>> files;
+        for (const auto & path : paths) {
+            auto file = alpha::MMapFile::Open(path.data());
+            if (file == nullptr) {
+                LOG_ERROR << "Open legacy MMapFile failed, path = " << path;
+                return false;
+            }
+            files.push_back(std::move(file));
+        }
+        auto owner_map = OwnerMap::Restore(static_cast<char*>(files[0]->start()),
+                files[0]->size());
+        auto combatant_map = CombatantMap::Restore(
+                static_cast<char*>(files[1]->start()), files[1]->size());
+        auto opponent_map = OpponentMap::Restore(
+                static_cast<char*>(files[2]->start()), files[2]->size());
+        if (owner_map == nullptr || combatant_map == nullptr || opponent_map == nullptr) {
+            LOG_ERROR << "Restore legacy data failed";
+            return false;
         }
 
-        //恢复玩家的对手信息
-        for (auto it = opponent_map_->begin(); it != opponent_map_->end(); ++it) {
-            UinType uin = it->first;
-            LOG_INFO << "CheckGetCombatant, uin = " << uin;
-            Combatant& combatant = CheckGetCombatant(uin);
+        for (auto it = owner_map->begin(); it != owner_map->end(); ++it) {
+            store_->ChangeOwner(it->first, it->second);
+        }
+        for (auto it = combatant_map->begin(); it != combatant_map->end(); ++it) {
+            const CombatantLite& lite = it->second;
+            //旧数据中门派就是所在格子的主人
+            auto sect = CheckGetField(lite.pos).Owner();
+            Combatant* combatant = store_->AddCombatant(it->first, sect, lite.pos,
+                    lite.level, lite.last_defeated_time);
+            if (combatant == nullptr) {
+                LOG_ERROR << "BattleStore full when importing, uin = " << it->first;
+                return false;
+            }
+        }
+        for (auto it = opponent_map->begin(); it != opponent_map->end(); ++it) {
+            Combatant* combatant = store_->FindCombatant(it->first);
+            if (combatant == nullptr) {
+                continue;
+            }
             for (int i = static_cast<int>(Direction::kUp);
-                    i <= static_cast<int>(Direction::kDown);
+                    i <= static_cast<int>(Direction::kRight);
                     ++i) {
-                assert (IsValidDirection(i));
                 Direction d = static_cast<Direction>(i);
                 auto opponents = it->second.GetOpponents(d);
                 if (!opponents.empty()) {
-                    combatant.ChangeOpponents(d, opponents);
+                    combatant->ChangeOpponents(d, opponents);
                 }
             }
         }
+        LOG_INFO << "Import legacy data done, store_->size() = " << store_->size();
+        return true;
     }
 
-    void Server::ReadBattleFieldFromConf() {
-        //读取战场的初始化状态
-        //先生成出生点
-        for (int sect = static_cast<int>(SectType::kNone) + 1;
-                sect != static_cast<int>(SectType::kMax);
-                ++sect ) {
-            auto sect_type = static_cast<SectType>(sect);
-            auto pos = conf_->GetBornPos(sect_type);
-            assert (pos.Valid());
-            auto res = battle_field_.emplace(std::piecewise_construct,
-                            std::forward_as_tuple(pos),
-                            std::forward_as_tuple(sect_type, FieldType::kBornField));
-            assert (res.second);
-            (void)res;
-        }
-
-        //然后生成禁入点
-        for (int x = 0; x <= Pos::kMaxPos; ++x) {
-            for (int y = 0; y <= Pos::kMaxPos; ++y) {
-                auto pos = Pos::Create(x, y);
-                if (conf_->IsOffLimitsArea(pos)) {
-                    auto res = battle_field_.emplace(std::piecewise_construct,
-                                    std::forward_as_tuple(pos),
-                                    std::forward_as_tuple(SectType::kNone,
-                                        FieldType::kForbiddenField));
-                    assert (res.second);
-                    (void)res;
-                }
+    void Server::RenameLegacyData() {
+        for (auto key : {kOwnerMapDataKey, kCombatantMapDataKey, kOpponentMapDataKey}) {
+            const std::string path = GetMMapedFilePath(key);
+            const std::string imported_path = path + ".imported";
+            if (::access(path.data(), F_OK) == 0
+                    && ::rename(path.data(), imported_path.data()) != 0) {
+                PLOG_WARNING << "rename failed, path = " << path;
             }
         }
+    }
 
-        //然后剩下的都是普通点（资源点对服务器来说并没有用）
+    void Server::ReadBattleFieldFromConf() {
+        //读取战场的初始化状态
+        //资源点对服务器来说并没有用, 只区分出生点, 禁入点和普通点
         for (int x = 0; x <= Pos::kMaxPos; ++x) {
             for (int y = 0; y <= Pos::kMaxPos; ++y) {
                 auto pos = Pos::Create(x, y);
                 assert (pos.Valid());
-                auto it = battle_field_.find(pos);
-                if (it != battle_field_.end()) {
-                    continue;
-                }
-                auto res = battle_field_.emplace(std::piecewise_construct,
-                        std::forward_as_tuple(pos),
-                        std::forward_as_tuple(SectType::kNone, FieldType::kDefault));
-                assert (res.second);
-                (void)res;
+                auto type = conf_->IsOffLimitsArea(pos)
+                    ? FieldType::kForbiddenField : FieldType::kDefault;
+                store_->InitField(pos, SectType::kNone, type);
             }
         }
+
+        for (int sect = static_cast<int>(SectType::kNone) + 1;
+                sect != static_cast<int>(SectType::kMax);
+                ++sect ) {
+            auto sect_type = static_cast<SectType>(sect);
+            auto pos = conf_->GetBornPos(sect_type);
+            assert (pos.Valid());
+            assert (CheckGetField(pos).Type() == FieldType::kDefault);
+            store_->InitField(pos, sect_type, FieldType::kBornField);
+        }
     }
 
     void Server::ReadSectFromConf() {
@@ -344,43 +569,86 @@ namespace SectBattle {
             auto sect_type = static_cast<SectType>(sect);
             auto pos = conf_->GetBornPos(sect_type);
             assert (pos.Valid());
-            auto res = sects_.emplace(std::piecewise_construct,
-                    std::forward_as_tuple(sect_type),
-                    std::forward_as_tuple(sect_type, pos));
-            assert (res.second);
-            (void)res;
+            store_->InitSect(sect_type, pos);
         }
     }
 
     ssize_t Server::HandleMessage(alpha::Slice packet, char* out) {
+        LoopMonitor::Scope scope(loop_monitor_.get(), "HandleMessage");
+        const auto allocations = ThreadHeapAllocations();
         auto start = alpha::NowInMicroseconds();
+        if (capture_) {
+            capture_->Append(start, packet);
+        }
         inspector_->AddRequestNum(start / 1000);
-        SectBattle::ProtocolMessage wrapper;
+        auto parse_start = PhaseTimer::Now();
+        //wrapper和请求都是复用的, 解析时不用再分配内存
+        ProtocolMessage& wrapper = *request_wrapper_;
         if (!wrapper.ParseFromArray(packet.data(), packet.size())) {
             LOG_WARNING << "Invalid packet, packet.size() = " << packet.size();
+            inspector_->AddInvalidPacket();
             return -1;
         }
-        auto m = detail::CreateMessage(wrapper.name());
+        auto create_start = PhaseTimer::Now();
+        auto m = message_pool_->Get(wrapper.name());
         if (m == nullptr) {
             LOG_WARNING << "Cannot create message, name = " << wrapper.name();
+            inspector_->AddInvalidPacket();
             return -2;
         }
+        //消息名合法之后才开始统计, 避免非法的名字占用内存
+        PhaseStatistics* phases = inspector_->GetPhaseStatistics(wrapper.name());
+        phases->Add(Phase::kParseWrapper, create_start - parse_start);
+        phases->Add(Phase::kCreateMessage, PhaseTimer::Now() - create_start);
+        RequestCounters* counters = inspector_->GetRequestCounters(wrapper.name());
+        counters->requests.Add();
+
+        {
+            ScopedPhase probe(phases, Phase::kParsePayload);
+            if (!m->ParseFromString(wrapper.payload())) {
+                LOG_WARNING << "Cannot parse message, name = " << wrapper.name()
+                    << "wrapper.payload().size() = " << wrapper.payload().size();
+                counters->errors.Add();
+                return -2;
+            }
+        }
 
-        if (!m->ParseFromString(wrapper.payload())) {
-            LOG_WARNING << "Cannot parse message, name = " << wrapper.name()
-                << "wrapper.payload().size() = " << wrapper.payload().size();
-            return -2;
+        if (replaying_) {
+            //时钟不往回走, 没有replay_time的请求沿用上一个请求的时间
+            replay_time_ = std::max<int64_t>(replay_time_, wrapper.replay_time());
+            CheckResetBattleField();
+        }
+        ++request_seq_;
+        if (FLAGS_random_per_request) {
+            //所有请求的第1个字段都是uin
+            auto uin_field = m->GetDescriptor()->FindFieldByNumber(1);
+            UinType uin = uin_field ? m->GetReflection()->GetUInt32(*m, uin_field) : 0;
+            random_ = Random::Derive(random_seed_, uin, request_seq_);
         }
 
-        auto ret = dispatcher_->Dispatch(m.get(), out);
+        //找对手之前先把保护期结束的人放回可挑战树
+        store_->AdvanceProtection(LogicNow());
+        ssize_t ret;
+        {
+            ScopedPhase probe(phases, Phase::kHandler);
+            current_phases_ = phases;
+            current_counters_ = counters;
+            ret = dispatcher_->Dispatch(m, out);
+            current_phases_ = nullptr;
+            current_counters_ = nullptr;
+        }
         auto end = alpha::NowInMicroseconds();
         if (ret >= 0) {
             inspector_->AddSucceedRequestNum(end / 1000);
+            counters->response_bytes.Add(ret);
         } else {
             LOG_INFO << "Process failed, message_name = " << wrapper.name()
                 << ", ret = " << ret;
+            counters->errors.Add();
         }
         inspector_->RecordProcessRequestTime(end - start);
+        inspector_->RecordRequestLatency(wrapper.name(), end / 1000, end - start);
+        counters->allocations.Add(ThreadHeapAllocations() - allocations);
         return ret;
     }
 
@@ -390,28 +658,21 @@ namespace SectBattle {
         }
 
         UinType uin = req->uin();
-        QueryBattleFieldResponse resp;
+        auto & resp = *message_pool_->Get<QueryBattleFieldResponse>();
         resp.set_uin(uin);
 
-        auto combatant_iter = combatants_.find(uin);
+        Combatant* combatant = store_->FindCombatant(uin);
         Pos pos = Pos::CreateInvalid();
-        if (combatant_iter == combatants_.end()) {
+        if (combatant == nullptr) {
             resp.set_code(static_cast<int>(Code::kNotInBattle));
         } else {
-            pos = combatant_iter->second.CurrentPos();
+            pos = combatant->CurrentPos();
             resp.set_code(static_cast<int>(Code::kOk));
             //处理等级变了的情况
-            auto & combatant = combatant_iter->second;
-            auto old_level = std::get<kCombatantLevel>(*combatant.Iterator());
-            if (req->level() != old_level) {
-                Field& field = CheckGetField(combatant.CurrentPos());
-                combatant.SetIterator(field.UpdateGarrisonLevel(
-                            uin, req->level(), combatant.Iterator()));
-            }
+            store_->UpdateLevel(combatant, req->level());
         }
 
-        SetBattleField(pos, resp.mutable_battle_field());
-        return WriteResponse(resp, out);
+        return WriteResponse(resp, out, pos);
     }
 
     ssize_t Server::HandleJoinBattle(const JoinBattleRequest* req, char* out) {
@@ -425,54 +686,41 @@ namespace SectBattle {
         const UinType uin = req->uin();
         const LevelType level = req->level();
 
-        JoinBattleResponse resp;
+        auto & resp = *message_pool_->Get<JoinBattleResponse>();
         resp.set_uin(uin);
 
-        auto combatant_iter = combatants_.find(uin);
+        Combatant* combatant = store_->FindCombatant(uin);
         //由于用户数据和服务器数据可能不一致
         //当用户数据保存失败时可能会重复发送加入请求
         //这种情况用户只可能在对应帮派的出生点，直接返回现在的状态
         //不在出生点视为非法请求
-        if (unlikely(combatant_iter != combatants_.end())) {
-            auto & combatant = combatant_iter->second;
-            auto sect = combatant.CurrentSect();
-            if (combatant.CurrentPos() == sect->BornPos()) {
-                resp.set_sect(static_cast<uint32_t>(sect->Type()));
+        if (unlikely(combatant != nullptr)) {
+            auto sect_type = combatant->CurrentSect();
+            if (combatant->CurrentPos() == CheckGetSect(sect_type).BornPos()) {
+                resp.set_sect(static_cast<uint32_t>(sect_type));
                 resp.set_code(static_cast<int>(Code::kOk));
             } else {
                 resp.set_code(static_cast<int>(Code::kJoinedBattle));
             }
-        } else if (unlikely(combatant_map_->size() == combatant_map_->max_size())) {
+        } else if (unlikely(store_->size() == store_->max_size())) {
             //落地用的mmaped文件已经满了, 没法再增加人了
             resp.set_code(static_cast<int>(Code::kBattleFieldFull));
             return WriteResponse(resp, out);
         } else {
-            const auto sect_type = RandomSect();
+            const auto sect_type = AssignSect();
             LOG_INFO << "Combatant " << uin << " join battle"
                 << ", sect = " << sect_type
                 << ", level = " << level;
 
             Sect& sect = CheckGetSect(sect_type);
-            Field& field = CheckGetField(sect.BornPos());
-
-            //加入到对应门派中
-            sect.AddMember(uin);
-            //加入到对应门派出生点
-            GarrisonIterator it = field.AddGarrison(uin, level);
-            assert (std::get<kCombatantUin>(*it) == uin);
-            //加入到参战人员中
-            auto res = combatants_.emplace(std::piecewise_construct,
-                    std::forward_as_tuple(uin),
-                    std::forward_as_tuple(&sect, sect.BornPos(), it));
-            assert (res.second);
-            combatant_iter = res.first;
+            //加入到对应门派和门派出生点
+            combatant = store_->AddCombatant(uin, sect_type, sect.BornPos(), level);
+            assert (combatant);
             resp.set_sect(static_cast<uint32_t>(sect_type));
             resp.set_code(static_cast<int>(Code::kOk));
-            RecordCombatant(uin, sect.BornPos(), level);
         }
-        assert (combatant_iter != combatants_.end());
-        SetBattleField(combatant_iter->second.CurrentPos(), resp.mutable_battle_field());
-        return WriteResponse(resp, out);
+        assert (combatant);
+        return WriteResponse(resp, out, combatant->CurrentPos());
     }
 
     ssize_t Server::HandleMove(const MoveRequest* req, char* out) {
@@ -500,19 +748,18 @@ namespace SectBattle {
             return -4;
         }
 
-        MoveResponse resp;
+        auto & resp = *message_pool_->Get<MoveResponse>();
         const UinType uin = req->uin();
         bool can_move = req->can_move(); //是否有足够的行动力进行移动
         resp.set_uin(uin);
-        auto combatant_iter = combatants_.find(uin);
-        if (combatant_iter == combatants_.end()) {
+        Combatant* combatant = store_->FindCombatant(uin);
+        if (combatant == nullptr) {
             //没有参加的时候也没有当前位置，就不返回战场信息了
             resp.set_code(static_cast<int>(Code::kNotInBattle));
             return WriteResponse(resp, out);
         }
 
-        auto & combatant = combatant_iter->second;
-        auto current_pos = combatant.CurrentPos();
+        auto current_pos = combatant->CurrentPos();
         auto direction = static_cast<Direction>(req->direction());
         auto res = current_pos.Apply(direction);
         Pos final_pos = current_pos;
@@ -531,16 +778,16 @@ namespace SectBattle {
             Field& new_field = CheckGetField(new_pos);
 
             auto owner = new_field.Owner();
-            OpponentList opponents = combatant.GetOpponents(direction);
+            OpponentList opponents = combatant->GetOpponents(direction);
             if (owner != SectType::kNone
-                    && owner != combatant.CurrentSect()->Type()
+                    && owner != combatant->CurrentSect()
                     && opponents.empty()) {
                 //移动到其它门派占领的格子, 而这个方向又没有刷新过对手，生成一下对手
-                opponents = new_field.GetOpponents(req->level(), LastTimeNotInProtection());
+                opponents = store_->GetOpponents(new_pos, req->level());
             }
             bool perform_move_action = false;
             if (owner == SectType::kNone
-                    || owner == combatant.CurrentSect()->Type()
+                    || owner == combatant->CurrentSect()
                     || (new_field.GarrisonNum() == 0
                         && conf_->GetBornPos(owner) != new_pos)) {
                 //移动到没人占领，或者是属于本门派的格子，或者没人的非出生点格子
@@ -568,31 +815,28 @@ namespace SectBattle {
                 //移动到其它门派占领的格子上, 而且能够刷新到对手
                 assert (!opponents.empty());
                 LOG_INFO << "Combatant " << uin << " opponents changed";
-                combatant.ChangeOpponents(direction, opponents);
+                combatant->ChangeOpponents(direction, opponents);
                 resp.set_code(static_cast<int>(Code::kOccupied));
                 std::copy(opponents.begin(), opponents.end(), 
                     google::protobuf::RepeatedFieldBackInserter(resp.mutable_opponents()));
-                RecordOpponent(uin, direction, opponents);
             }
 
             if (perform_move_action) {
                 LOG_INFO << "Combatant " << uin << " pos changed, old pos = "
                     << current_pos << ", new pos = " << new_pos;
-                if (owner != combatant.CurrentSect()->Type()) {
+                if (owner != combatant->CurrentSect()) {
                     //这个格子换主人了
                     LOG_INFO << "Field owner changed, old = " << owner
-                        << ", new = " << combatant.CurrentSect()->Type();
-                    new_field.ChangeOwner(combatant.CurrentSect()->Type());
+                        << ", new = " << combatant->CurrentSect();
+                    store_->ChangeOwner(new_pos, combatant->CurrentSect());
                 }
                 //更新玩家的位置
-                MoveCombatant(uin, req->level(), &combatant, new_pos);
+                MoveCombatant(req->level(), combatant, new_pos);
                 resp.set_code(static_cast<int>(Code::kOk));
                 final_pos = new_pos;
-                RecordSect(new_pos, combatant.CurrentSect()->Type());
             }
         }
-        SetBattleField(final_pos, resp.mutable_battle_field());
-        return WriteResponse(resp, out);
+        return WriteResponse(resp, out, final_pos);
     }
 
     ssize_t Server::HandleChangeSect(const ChangeSectRequest* req, char* out) {
@@ -607,41 +851,31 @@ namespace SectBattle {
         UinType uin = req->uin();
         LevelType level = req->level();
         SectType sect_type = static_cast<SectType>(req->sect());
-        ChangeSectResponse resp;
+        auto & resp = *message_pool_->Get<ChangeSectResponse>();
         resp.set_uin(uin);
 
-        auto combatant_iter = combatants_.find(uin);
-        if (unlikely(combatant_iter == combatants_.end())) {
+        Combatant* combatant = store_->FindCombatant(uin);
+        if (unlikely(combatant == nullptr)) {
             //没有参与，不返回战场信息
             resp.set_code(static_cast<int>(Code::kNotInBattle));
             return WriteResponse(resp, out);
         }
-        auto & combatant = combatant_iter->second;
-        if (unlikely(combatant.CurrentSect()->Type() == sect_type)) {
+        if (unlikely(combatant->CurrentSect() == sect_type)) {
             resp.set_code(static_cast<int>(Code::kInSameSect));
-            SetBattleField(combatant.CurrentPos(), resp.mutable_battle_field());
-            return WriteResponse(resp, out);
+            return WriteResponse(resp, out, combatant->CurrentPos());
         }
 
         LOG_INFO << "Combatant " << uin << " sect changed"
-            << ", old sect = " << combatant.CurrentSect()->Type()
+            << ", old sect = " << combatant->CurrentSect()
             << ", new sect = " << sect_type;
 
-        Sect& current_sect = CheckGetSect(combatant.CurrentSect()->Type());
-        Sect& new_sect = CheckGetSect(sect_type);
-        auto new_sect_born_pos = new_sect.BornPos();
-
-        //从旧的门派里面干掉他
-        current_sect.RemoveMember(uin);
-        //然后加到新的门派
-        new_sect.AddMember(uin);
+        auto new_sect_born_pos = CheckGetSect(sect_type).BornPos();
         //更新玩家所属门派
-        combatant.ChangeSect(&new_sect);
+        store_->ChangeSect(combatant, sect_type);
         //更新玩家的位置
-        MoveCombatant(uin, level, &combatant, new_sect_born_pos);
+        MoveCombatant(level, combatant, new_sect_born_pos);
         resp.set_code(static_cast<int>(Code::kOk));
-        SetBattleField(new_sect_born_pos, resp.mutable_battle_field());
-        return WriteResponse(resp, out);
+        return WriteResponse(resp, out, new_sect_born_pos);
     }
 
     ssize_t Server::HandleChangeOpponent(const ChangeOpponentRequest* req, char* out) {
@@ -656,46 +890,41 @@ namespace SectBattle {
         LevelType level = req->level();
         Direction direction = static_cast<Direction>(req->direction());
 
-        ChangeOpponentResponse resp;
+        auto & resp = *message_pool_->Get<ChangeOpponentResponse>();
         resp.set_uin(uin);
-        auto it = combatants_.find(uin);
-        if (it == combatants_.end()) {
+        Combatant* combatant = store_->FindCombatant(uin);
+        if (combatant == nullptr) {
             resp.set_code(static_cast<int>(Code::kNotInBattle));
             return WriteResponse(resp, out);
         }
 
-        auto & combatant = it->second;
-        auto old_opponents = combatant.GetOpponents(direction);
+        auto old_opponents = combatant->GetOpponents(direction);
         if (old_opponents.empty()) {
             resp.set_code(static_cast<int>(Code::kNoOpponent));
             return WriteResponse(resp, out);
         }
-        auto current_pos = combatant.CurrentPos();
+        auto current_pos = combatant->CurrentPos();
         auto res = current_pos.Apply(direction);
         if (!res.second) {
             resp.set_code(static_cast<int>(Code::kInvalidDirection));
         } else {
             Field& field = CheckGetField(res.first);
-            auto new_opponents = field.GetOpponents(level, LastTimeNotInProtection());
+            auto new_opponents = store_->GetOpponents(res.first, level);
             if (field.GarrisonNum() == 0) {
                 CHECK (new_opponents.empty());
-                OpponentList empty;
-                combatant.ChangeOpponents(direction, empty);
-                RecordOpponent(uin, direction, empty);
+                combatant->ClearOpponents(direction);
                 resp.set_code(static_cast<int>(Code::kNoGarrisonInField));
             } else if (new_opponents.empty()) {
                 resp.set_code(static_cast<int>(Code::kAllGarrisonInProtection));
             } else {
                 LOG_INFO << "Combatant " << uin << " opponents changed";
-                combatant.ChangeOpponents(direction, new_opponents);
+                combatant->ChangeOpponents(direction, new_opponents);
                 std::copy(new_opponents.begin(), new_opponents.end(), 
                     google::protobuf::RepeatedFieldBackInserter(resp.mutable_opponents()));
-                RecordOpponent(uin, direction, new_opponents);
                 resp.set_code(static_cast<int>(Code::kOk));
             }
         }
-        SetBattleField(combatant.CurrentPos(), resp.mutable_battle_field());
-        return WriteResponse(resp, out);
+        return WriteResponse(resp, out, combatant->CurrentPos());
     }
 
     ssize_t Server::HandleCheckFight(const CheckFightRequest* req, char* out) {
@@ -711,57 +940,48 @@ namespace SectBattle {
         UinType opponent_uin = req->opponent();
         Direction direction = static_cast<Direction>(req->direction());
 
-        CheckFightResponse resp;
+        auto & resp = *message_pool_->Get<CheckFightResponse>();
         resp.set_uin(uin);
-        auto opponent_iter = combatants_.find(opponent_uin);
-        if (opponent_iter == combatants_.end()) {
+        Combatant* opponent = store_->FindCombatant(opponent_uin);
+        if (opponent == nullptr) {
             resp.set_code(static_cast<int>(Code::kInvalidOpponent));
             return WriteResponse(resp, out);
         }
 
-        auto & opponent = opponent_iter->second;
-
-        auto combatant_iter = combatants_.find(uin);
-        if (unlikely(combatant_iter == combatants_.end())) {
+        Combatant* combatant = store_->FindCombatant(uin);
+        if (unlikely(combatant == nullptr)) {
             resp.set_code(static_cast<int>(Code::kNotInBattle));
             return WriteResponse(resp, out);
         }
 
-        auto & combatant = combatant_iter->second;
-        auto opponents = combatant.GetOpponents(direction);
+        auto opponents = combatant->GetOpponents(direction);
 
-        auto res = combatant.CurrentPos().Apply(direction);
+        auto res = combatant->CurrentPos().Apply(direction);
         if (res.second == false) {
             resp.set_code(static_cast<int>(Code::kInvalidDirection));
-            SetBattleField(combatant.CurrentPos(), resp.mutable_battle_field());
-            return WriteResponse(resp, out);
+            return WriteResponse(resp, out, combatant->CurrentPos());
         }
 
         auto it = std::find(opponents.begin(), opponents.end(), opponent_uin);
         if (it == opponents.end()) {
             resp.set_code(static_cast<int>(Code::kInvalidOpponent));
-            SetBattleField(combatant.CurrentPos(), resp.mutable_battle_field());
-            return WriteResponse(resp, out);
+            return WriteResponse(resp, out, combatant->CurrentPos());
         }
 
         //判断对手是否仍然在那个位置
-        if (opponent.CurrentPos() != res.first) {
+        if (opponent->CurrentPos() != res.first) {
             resp.set_code(static_cast<int>(Code::kOpponentMoved));
         } else {
-            auto garrison_iterator = opponent.Iterator();
-            auto last_defeated_time = std::get<kCombatantDefeatedTimeStamp>(
-                    *garrison_iterator);
             DLOG_INFO << "Combatant " << opponent_uin
-                << " last defeated time: " << last_defeated_time;
-            if (last_defeated_time > LastTimeNotInProtection()) {
+                << " last defeated time: " << opponent->LastDefeatedTime();
+            if (store_->InProtection(opponent)) {
                 resp.set_code(static_cast<int>(Code::kOpponentInProtection));
             } else {
                 resp.set_code(static_cast<int>(Code::kOk));
             }
         }
-        resp.set_sect(static_cast<uint32_t>(combatant.CurrentSect()->Type()));
-        SetBattleField(combatant.CurrentPos(), resp.mutable_battle_field());
-        return WriteResponse(resp, out);
+        resp.set_sect(static_cast<uint32_t>(combatant->CurrentSect()));
+        return WriteResponse(resp, out, combatant->CurrentPos());
     }
 
     ssize_t Server::HandleReportFight(const ReportFightRequest* req, char* out) {
@@ -787,13 +1007,13 @@ namespace SectBattle {
         auto should_reset_self = req->reset_self();
         auto should_reset_opponent = req->reset_opponent();
 
-        ReportFightResponse resp;
+        auto & resp = *message_pool_->Get<ReportFightResponse>();
         resp.set_uin(uin);
-        auto combatant_iter = combatants_.find(uin);
-        auto opponent_iter = combatants_.find(opponent_uin);
-        if (combatant_iter == combatants_.end()) {
+        Combatant* self = store_->FindCombatant(uin);
+        Combatant* opponent = store_->FindCombatant(opponent_uin);
+        if (self == nullptr) {
             resp.set_code(static_cast<int>(Code::kNotInBattle));
-        } else if (opponent_iter == combatants_.end()) {
+        } else if (opponent == nullptr) {
             resp.set_code(static_cast<int>(Code::kInvalidOpponent));
         } else {
             LOG_INFO << "Combatant " << uin << " report fight"
@@ -802,134 +1022,100 @@ namespace SectBattle {
                 << ", direction = " << direction
                 << ", should_reset_self = " << static_cast<int>(should_reset_self)
                 << ", should_reset_opponent = " << static_cast<int>(should_reset_opponent);
-            auto& self = combatant_iter->second;
-            auto& opponent = opponent_iter->second;
-            self.ClearOpponents(direction);
-            auto res = self.CurrentPos().Apply(direction);
+            self->ClearOpponents(direction);
+            auto res = self->CurrentPos().Apply(direction);
             assert (res.second);
-            assert (opponent.CurrentPos() == res.first);
+            assert (opponent->CurrentPos() == res.first);
             (void)res;
 
             if (should_reset_self) {
-                MoveCombatant(uin, req->level(), &self, self.CurrentSect()->BornPos());
+                MoveCombatant(req->level(), self,
+                        CheckGetSect(self->CurrentSect()).BornPos());
             }
             if (should_reset_opponent) {
-                MoveCombatant(opponent_uin, req->opponent_level(), &opponent,
-                        opponent.CurrentSect()->BornPos());
+                MoveCombatant(req->opponent_level(), opponent,
+                        CheckGetSect(opponent->CurrentSect()).BornPos());
             }
             if (loser == opponent_uin) {
                 //对手被击败才会进入保护期
                 //如果被动战败一定会被重置的话
                 //可以把更新last defeated time的操作放到MoveCombatant中
                 //减少一次删除和插入操作
-                auto now = alpha::Now();
-                auto & opponent_current_field = CheckGetField(opponent.CurrentPos());
-                auto new_iter = opponent_current_field.UpdateGarrisonLastDefeatedTime(
-                        opponent_uin, now, opponent.Iterator());
-                opponent.SetIterator(new_iter);
-                RecordCombatantDefeatedTime(loser, now);
+                store_->UpdateLastDefeatedTime(opponent, LogicNow());
             }
-            SetBattleField(self.CurrentPos(), resp.mutable_battle_field());
+            return WriteResponse(resp, out, self->CurrentPos());
         }
         return WriteResponse(resp, out);
     }
 
-    void Server::MoveCombatant(UinType uin, LevelType level,
-            Combatant* combatant, Pos new_pos) {
+    void Server::MoveCombatant(LevelType level, Combatant* combatant, Pos new_pos) {
         assert (combatant);
-        auto it = combatants_.find(uin);
-        assert (it != combatants_.end());
-        assert (&it->second == combatant);
-        (void)it;
-        if (combatant->CurrentPos() == new_pos) {
-            return;
-        }
-        Field& current_field = CheckGetField(combatant->CurrentPos());
-        Field& new_field = CheckGetField(new_pos);
-
-        auto last_defeated_time = std::get<kCombatantDefeatedTimeStamp>(
-                *combatant->Iterator());
-
-        //从旧的格子里干掉
-        current_field.ReduceGarrison(uin, combatant->Iterator());
-        //放到新的格子中
-        auto new_iter = new_field.AddGarrison(uin, level, last_defeated_time);
-        //然后更新玩家的当前位置
-        combatant->MoveTo(new_pos);
-        //更新玩家在格子中的索引
-        combatant->SetIterator(new_iter);
-        //落地改动
-        RecordCombatant(uin, new_pos, level);
-    }
-
-    void Server::RecordCombatant(UinType uin, Pos current_pos, LevelType level) {
-        (*combatant_map_)[uin] = CombatantLite::Create(current_pos, level);
+        assert (store_->FindCombatant(combatant->Uin()) == combatant);
+        store_->MoveCombatant(combatant, new_pos, level);
     }
 
-    void Server::RecordCombatantDefeatedTime(UinType uin, alpha::TimeStamp now) {
-        auto it = combatant_map_->find(uin);
-        assert (it != combatant_map_->end());
-        it->second.last_defeated_time = now;
-    }
-
-    void Server::RecordSect(Pos pos, SectType sect_type) {
-        (*owner_map_)[pos] = sect_type;
-    }
-
-    void Server::RecordOpponent(UinType uin, Direction d, const OpponentList& opponents) {
-        assert (uin != 0);
-        auto it = opponent_map_->find(uin);
-        if (it == opponent_map_->end()) {
-            auto p = opponent_map_->insert(std::make_pair(uin, OpponentLite::Default()));
-            it = p.first;
+    ssize_t Server::WriteResponse(const google::protobuf::Message& resp, char* out) {
+        ScopedPhase probe(current_phases_, Phase::kSerialize);
+        if (current_counters_) {
+            const auto & fields = detail::GetResponseFields(resp);
+            current_counters_->RecordCode(detail::ResponseCode(resp, fields.code));
         }
-        assert (it != opponent_map_->end());
-        it->second.ChangeOpponents(d, opponents);
+        //只算一次大小, 序列化时用缓存的大小
+        const int size = resp.ByteSize();
+        auto end = resp.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(out));
+        assert (end - reinterpret_cast<uint8_t*>(out) == size);
+        (void)end;
+        DLOG_INFO << "resp.ByteSize() = " << size;
+        return size;
     }
 
-    void Server::SetBattleField(Pos current_pos, BattleField* battle_field) {
-        assert (battle_field);
-        battle_field->Clear();
-        battle_field->mutable_self_position()->set_x(current_pos.X());
-        battle_field->mutable_self_position()->set_y(current_pos.Y());
-
-        for (const auto & p : battle_field_) {
-            const Field& field = p.second;
-            auto cell = battle_field->add_field();
-            cell->set_owner(static_cast<unsigned>(field.Owner()));
-            cell->set_garrison_num(field.GarrisonNum());
+    ssize_t Server::WriteResponse(const google::protobuf::Message& resp, char* out,
+            Pos battle_field_pos) {
+        const uint64_t client_version = request_wrapper_->grid_version();
+        //客户端已经是最新的版本了, 不用编码格子
+        const bool not_modified = client_version != 0
+            && client_version == store_->FieldVersion();
+        if (!not_modified) {
+            ScopedPhase probe(current_phases_, Phase::kSetBattleField);
+            battle_field_encoder_->Update(store_.get());
         }
-        assert (battle_field->field_size() == kBattleFieldCount);
-    }
-
-    ssize_t Server::WriteResponse(const google::protobuf::Message& resp, char* out) {
-        bool ok = resp.SerializeToArray(out, resp.ByteSize());
-        assert (ok);
-        (void)ok;
-        DLOG_INFO << "resp.ByteSize() = " << resp.ByteSize();
-        return resp.ByteSize();
-    }
-
-    Combatant& Server::CheckGetCombatant(UinType uin) {
-        auto it = combatants_.find(uin);
-        assert (it != combatants_.end());
-        return it->second;
+        const int battle_field_number = detail::GetResponseFields(resp).battle_field_number;
+        assert (battle_field_number != 0);
+        assert (!resp.GetReflection()->HasField(resp,
+                    resp.GetDescriptor()->FindFieldByNumber(battle_field_number)));
+        //battle_field直接接在其它字段后面, 解析时不要求字段按编号排列
+        auto size = WriteResponse(resp, out);
+        auto start = reinterpret_cast<uint8_t*>(out);
+        uint8_t* end;
+        if (not_modified) {
+            if (current_counters_) {
+                current_counters_->battle_field_not_modified.Add();
+            }
+            end = BattleFieldEncoder::WriteNotModifiedToArray(battle_field_number,
+                    battle_field_pos, client_version, start + size);
+        } else if (request_wrapper_->battle_field_format()
+                == static_cast<uint32_t>(BattleFieldFormat::kCompact)) {
+            end = battle_field_encoder_->WriteCompactToArray(battle_field_number,
+                    battle_field_pos, client_version, start + size);
+        } else {
+            end = battle_field_encoder_->WriteToArray(battle_field_number,
+                    battle_field_pos, start + size);
+        }
+        return end - start;
     }
 
     Field& Server::CheckGetField(Pos pos) {
-        auto it = battle_field_.find(pos);
-        assert (it != battle_field_.end());
-        return it->second;
+        assert (pos.Valid());
+        return store_->GetField(pos);
     }
 
     Sect& Server::CheckGetSect(SectType sect_type) {
-        auto it = sects_.find(sect_type);
-        assert (it != sects_.end());
-        return it->second;
+        assert (IsValidSectType(static_cast<int>(sect_type)));
+        return store_->GetSect(sect_type);
     }
 
     void Server::CheckResetBattleField() {
-        auto now = alpha::NowInSeconds();
+        auto now = static_cast<time_t>(LogicNow() / alpha::kMilliSecondsPerSecond);
         if (unlikely(!conf_->InSameSeason(now,
                         backup_metadata_->LatestBattleFieldResetTime()))) {
             LOG_INFO << "now = " << now << ", LatestBattleFieldResetTime = "
@@ -940,15 +1126,49 @@ namespace SectBattle {
     }
 
     void Server::ResetBattleField() {
-        battle_field_.clear();
-        sects_.clear();
-        combatants_.clear();
-        owner_map_->clear();
-        opponent_map_->clear();
-        combatant_map_->clear();
+        auto start = alpha::NowInMicroseconds();
+        if (archive_seasons_) {
+            //这时还没有更新, 是上个赛季开始的时间
+            auto path = FLAGS_data_path + "/sect_battle_season_"
+                + std::to_string(backup_metadata_->LatestBattleFieldResetTime()) + ".gz";
+            if (season_archive_ == nullptr) {
+                season_archive_.reset (new SeasonArchive());
+            }
+            //Combatant留在原地, 之后在ScrubRoutine中分批交给后台线程
+            std::string header;
+            store_->Clear(&header);
+            season_archive_->Begin(path, std::move(header));
+            archiving_ = true;
+        } else {
+            store_->Clear();
+        }
         ReadBattleFieldFromConf();
         ReadSectFromConf();
-        LOG_INFO << "ResetBattleField done";
+        scrubbing_ = true;
+        LOG_INFO << "ResetBattleField done, cost = "
+            << alpha::NowInMicroseconds() - start << "us";
+    }
+
+    void Server::ScrubRoutine() {
+        //存档取完之前Scrub不会清零, 先存档
+        if (archiving_) {
+            std::string slice;
+            if (store_->ArchiveSlice(FLAGS_scrub_slots_per_slice, &slice) == 0) {
+                archiving_ = false;
+            }
+            season_archive_->Append(std::move(slice));
+            if (!archiving_) {
+                season_archive_->Finish();
+            }
+            return;
+        }
+        if (!scrubbing_) {
+            return;
+        }
+        if (store_->Scrub(FLAGS_scrub_slots_per_slice) == 0) {
+            scrubbing_ = false;
+            LOG_INFO << "Scrub done";
+        }
     }
 
     void Server::BackupRoutine(bool force) {
@@ -981,6 +1201,9 @@ namespace SectBattle {
         }
 
         if (backup_coroutine_ && backup_coroutine_->IsDead()) {
+            inspector_->RecordBackup(backup_coroutine_->succeed(),
+                    backup_coroutine_->bytes_written(),
+                    alpha::Now() - backup_start_time_);
             if (!backup_coroutine_->succeed()) {
                 LOG_WARNING << "Backup failed";
             } else {
@@ -990,13 +1213,47 @@ namespace SectBattle {
         }
     }
 
-    alpha::TimeStamp Server::LastTimeNotInProtection() const {
-        auto now = alpha::Now();
-        return now - conf_->DefeatedProtectionDuration();
-    }
-
     SectType Server::RandomSect() {
         auto max = static_cast<int>(SectType::kMax);
-        return static_cast<SectType>(alpha::Random::Rand32(1, max));
+        return static_cast<SectType>(random_.Uniform(1, max));
+    }
+
+    SectType Server::AssignSect() {
+        //门派人数由BattleStore维护, 只有8个门派, 每次直接看一遍
+        std::array<uint32_t, BattleStore::kSectCount> counts;
+        for (int i = 0; i < BattleStore::kSectCount; ++i) {
+            counts[i] = store_->GetSect(static_cast<SectType>(i + 1)).MemberCount();
+        }
+        int chosen = 0;
+        if (sect_assignment_ == SectAssignment::kLeastPopulated) {
+            //人数相同的门派中等概率选一个
+            uint32_t ties = 0;
+            for (int i = 0; i < BattleStore::kSectCount; ++i) {
+                if (counts[i] < counts[chosen]) {
+                    chosen = i;
+                    ties = 1;
+                } else if (counts[i] == counts[chosen] && random_.Uniform(++ties) == 0) {
+                    chosen = i;
+                }
+            }
+        } else if (sect_assignment_ == SectAssignment::kInversePopulation) {
+            //权重为1 / (人数 + 1)
+            std::array<double, BattleStore::kSectCount> weights;
+            double total = 0;
+            for (int i = 0; i < BattleStore::kSectCount; ++i) {
+                weights[i] = 1.0 / (counts[i] + 1.0);
+                total += weights[i];
+            }
+            double x = (random_() >> 11) * (1.0 / (UINT64_C(1) << 53)) * total;
+            for (chosen = 0; chosen < BattleStore::kSectCount - 1; ++chosen) {
+                x -= weights[chosen];
+                if (x < 0) {
+                    break;
+                }
+            }
+        } else {
+            return RandomSect();
+        }
+        return static_cast<SectType>(chosen + 1);
     }
 };
@@ -13,6 +13,7 @@
 #ifndef  __SECT_BATTLE_SERVER_H__
 #define  __SECT_BATTLE_SERVER_H__
 
+#include <map>
 #include <memory>
 #include <string>
 #include <alpha/slice.h>
@@ -22,6 +23,7 @@
 #include <alpha/tcp_connection.h>
 
 #include "sect_battle_server_def.h"
+#include "sect_battle_random.h"
 
 namespace google {
     namespace protobuf {
@@ -43,9 +45,7 @@ namespace tokyotyrant {
 
 namespace SectBattle {
     //PB协议类
-    class PBPos;
-    class PBCell;
-    class BattleField;
+    class ProtocolMessage;
     class QueryBattleFieldRequest;
     class QueryBattleFieldResponse;
     class JoinBattleRequest;
@@ -63,32 +63,72 @@ namespace SectBattle {
 
     //抽象类
     class MessageDispatcher;
+    class MessagePool;
+    class BattleFieldEncoder;
     class BackupCoroutine;
     class RecoverCoroutine;
     class BackupMetadata;
+    class BattleStore;
     class ServerConf;
     class Inspector;
+    class PhaseStatistics;
+    class LoopMonitor;
+    class TrafficCapture;
+    class SeasonArchive;
+    struct RequestCounters;
     class Server {
         public:
+            //新加入的人分配门派的方式
+            enum class SectAssignment {
+                kRandom,
+                kLeastPopulated,
+                kInversePopulation,
+            };
+
             Server(alpha::EventLoop* loop);
             ~Server();
 
             bool Run();
+            //不监听端口, 不备份也不存档赛季, 在data上新建一个空的战场
+            //只给进程内的基准测试用, 之后直接调用HandleMessage或HandleAdminRequest
+            bool RunInMemory(char* data, size_t size);
+            BattleStore* store() const;
+            ssize_t HandleMessage(alpha::Slice data, char* out);
+
+            //管理接口的结果, 和HTTP连接无关, 基准测试直接调用HandleAdminRequest
+            using AdminParams = std::map<std::string, std::string>;
+            struct AdminResponse {
+                int status;
+                const char* status_string;
+                const char* content_type;
+                std::string body;
+            };
+            AdminResponse HandleAdminRequest(const std::string& path,
+                    const AdminParams& params);
 
         private:
             //初始化运行时需要的各种数据结构
+            void InitHandlers();
+            //按--random_seed初始化自己和BattleStore的随机数
+            void InitRandom();
+            //从--replay_capture_path读开始时的时钟和战场版本
+            bool StartReplay();
+            //保护期和赛季重置用的时间(ms), 重放时是请求里记录的时间
+            alpha::TimeStamp LogicNow() const;
             bool RunRecovery();
             bool BuildMMapedData();
             template<typename T>
             std::unique_ptr<T> BuildMMapedMapFromFile(alpha::Slice key, size_t size);
             BackupMetadata* BuildBackupMetaDataFromFile(size_t size);
             std::string GetMMapedFilePath(const char* key) const;
-            void BuildRunData();
+            bool BuildRunData();
+            bool ImportLegacyData();
+            //导入完成后改名, 避免重复导入
+            void RenameLegacyData();
             void ReadBattleFieldFromConf();
             void ReadSectFromConf();
 
             //主逻辑
-            ssize_t HandleMessage(alpha::Slice data, char* out);
             ssize_t HandleQueryBattleField(const QueryBattleFieldRequest* req, char* out);
             ssize_t HandleJoinBattle(const JoinBattleRequest* req, char* out);
             ssize_t HandleMove(const MoveRequest* req, char* out);
@@ -96,22 +136,20 @@ namespace SectBattle {
             ssize_t HandleChangeOpponent(const ChangeOpponentRequest* req, char* out);
             ssize_t HandleCheckFight(const CheckFightRequest* req, char* out);
             ssize_t HandleReportFight(const ReportFightRequest* req, char* out);
-            void MoveCombatant(UinType uin, LevelType level, Combatant* combatant, Pos pos);
+            void MoveCombatant(LevelType level, Combatant* combatant, Pos pos);
             SectType RandomSect();
-            alpha::TimeStamp LastTimeNotInProtection() const;
-            void SetBattleField(Pos current_pos, BattleField*);
+            //按sect_assignment_选门派, 让各门派人数(以及出生点的驻军)尽量平均
+            SectType AssignSect();
             ssize_t WriteResponse(const google::protobuf::Message& resp, char* out);
-            Combatant& CheckGetCombatant(UinType uin);
+            //同时写入以battle_field_pos为当前位置的战场信息
+            ssize_t WriteResponse(const google::protobuf::Message& resp, char* out,
+                    Pos battle_field_pos);
             Field& CheckGetField(Pos pos);
             Sect& CheckGetSect(SectType sect_type);
             void CheckResetBattleField();
             void ResetBattleField();
-
-            //落地各种操作（备份恢复用）
-            void RecordCombatant(UinType uin, Pos current_pos, LevelType level);
-            void RecordCombatantDefeatedTime(UinType uin, alpha::TimeStamp now);
-            void RecordSect(Pos pos, SectType sect_type);
-            void RecordOpponent(UinType uin, Direction d, const OpponentList& opponents);
+            //分批清零上个赛季留在BattleStore中的数据
+            void ScrubRoutine();
 
             //备份和恢复
             void BackupRoutine(bool force);
@@ -126,39 +164,62 @@ namespace SectBattle {
             std::string AdminServerHandleSect(const alpha::HTTPMessage& message);
 #endif
             std::string ServerStatus();
-            std::string FieldStatus(Pos pos);
-            std::string SectStatus(SectType sect);
+            //max_members不为0时按(等级, uin)分页列出驻军, 从after之后开始
+            std::string FieldStatus(Pos pos, unsigned max_members,
+                    const CombatantIdentity& after);
+            //max_members不为0时分页列出成员, after为0时从头开始
+            //after已经不在这个门派时抛std::invalid_argument
+            std::string SectStatus(SectType sect, unsigned max_members, UinType after);
             std::string PlayerStatus(UinType uin);
+            std::string PhaseStatus();
+            std::string MetricsText();
+            std::string StallStatus();
             std::string AdminServerUsage() const;
             void ForceBackup();
             void RemoveCombatant(UinType uin);
-            void WriteHTTPResponse(alpha::TcpConnectionPtr& conn,
-                    int status,
-                    alpha::Slice status_string,
-                    alpha::Slice body = "");
 
             static const int kBackupInterval = 30 * 60 * 1000; //30mins in milliseconds
             //static const int kBackupInterval = 10 * 1000;
+            //管理接口一页最多列出的人数, 一次回调不会占用事件循环太久
+            static const unsigned kMaxAdminPageSize = 1000;
             alpha::EventLoop* loop_;
             std::unique_ptr<ServerConf> conf_;
             std::unique_ptr<alpha::UdpServer> server_;
             std::unique_ptr<MessageDispatcher> dispatcher_;
             MMapedFileMap mmaped_files_;
-            std::unique_ptr<OwnerMap> owner_map_;
-            std::unique_ptr<CombatantMap> combatant_map_;
-            std::unique_ptr<OpponentMap> opponent_map_;
+            std::unique_ptr<BattleStore> store_;
             std::unique_ptr<tokyotyrant::Client> tt_client_;
             std::unique_ptr<BackupCoroutine> backup_coroutine_;
             std::unique_ptr<RecoverCoroutine> recover_coroutine_;
-            std::unique_ptr<BattleField> cached_battle_field_;
+            std::unique_ptr<MessagePool> message_pool_;
+            std::unique_ptr<ProtocolMessage> request_wrapper_;
+            std::unique_ptr<BattleFieldEncoder> battle_field_encoder_;
             std::unique_ptr<Inspector> inspector_;
+            std::unique_ptr<LoopMonitor> loop_monitor_;
             std::unique_ptr<alpha::SimpleHTTPServer> admin_server_;
+            std::unique_ptr<TrafficCapture> capture_;
+            std::unique_ptr<SeasonArchive> season_archive_;
+            //BattleStore抽样对手也用这个
+            Random random_;
+            uint64_t random_seed_ = 0;
+            //解析成功的请求的序号, 用来派生每个请求的随机数
+            uint64_t request_seq_ = 0;
+            SectAssignment sect_assignment_ = SectAssignment::kLeastPopulated;
+            bool scrubbing_ = false;
+            //重置赛季时是否存档, RunInMemory时没有定时器, 不存档
+            bool archive_seasons_ = false;
+            //上个赛季的数据还没全部交给season_archive_
+            bool archiving_ = false;
+            bool replaying_ = false;
+            int64_t replay_time_ = 0; //us
             BackupMetadata* backup_metadata_ = nullptr;
+            //RunInMemory时没有mmap文件, backup_metadata_指向这里
+            std::unique_ptr<BackupMetadata> memory_backup_metadata_;
+            //当前正在处理的消息的分阶段统计, 只在HandleMessage中有效
+            PhaseStatistics* current_phases_ = nullptr;
+            RequestCounters* current_counters_ = nullptr;
             int current_backup_prefix_index_ = 0;
             alpha::TimeStamp backup_start_time_ = 0;
-            std::map<Pos, Field> battle_field_;
-            std::map<SectType, Sect> sects_;
-            std::map<UinType, Combatant> combatants_;
     };
 
     template<typename T>
@@ -13,6 +13,7 @@
 #ifndef  __SECT_BATTLE_SERVER_CONF_H__
 #define  __SECT_BATTLE_SERVER_CONF_H__
 
+#include <set>
 #include <map>
 #include <alpha/slice.h>
 #include "sect_battle_server_def.h"
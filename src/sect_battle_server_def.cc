@@ -11,8 +11,8 @@
  */
 
 #include "sect_battle_server_def.h"
+#include <cstring>
 #include <algorithm>
-#include <alpha/random.h>
 #include <alpha/logger.h>
 
 namespace {
@@ -26,6 +26,7 @@ namespace {
 
 namespace SectBattle {
     const char* kBackupMetaDataKey = "backup_metadata";
+    const char* kBattleStoreDataKey = "battle_store";
     const char* kCombatantMapDataKey = "combatant_map";
     const char* kOpponentMapDataKey = "opponent_map";
     const char* kOwnerMapDataKey = "owner_map";
@@ -41,21 +42,14 @@ namespace SectBattle {
     }
 
     bool CompareCombatantIdentity::operator() (const CombatantIdentity& lhs,
-            const CombatantIdentity& rhs) {
+            const CombatantIdentity& rhs) const {
         //1.Level小的在前
-        //2.TimeStamp大的在前
-        //3.Uin小的在前
+        //2.Uin小的在前
         int res = Compare(std::get<kCombatantLevel>(lhs), std::get<kCombatantLevel>(rhs));
         if (res != 0) {
             return res < 0;
         }
 
-        res = Compare(std::get<kCombatantDefeatedTimeStamp>(lhs),
-                std::get<kCombatantDefeatedTimeStamp>(rhs));
-        if (res != 0) {
-            return res > 0;
-        }
-
         res = Compare(std::get<kCombatantUin>(lhs), std::get<kCombatantUin>(rhs));
         if (res != 0) {
             return res < 0;
@@ -141,111 +135,10 @@ namespace SectBattle {
         return os;
     }
 
-    Field::Field(SectType owner, FieldType type)
-        :owner_(owner), type_(type) {
-    }
-
-    GarrisonIterator Field::AddGarrison(UinType uin, LevelType level,
-            alpha::TimeStamp last_defeated_time) {
-        auto res = garrison_.insert(CombatantIdentity(level, last_defeated_time, uin));
-        assert (res.second);
-        return res.first;
-    }
-
     void Field::ChangeOwner(SectType new_owner) {
         owner_ = new_owner;
     }
 
-    void Field::ReduceGarrison(UinType uin, GarrisonIterator it) {
-        assert (it != garrison_.end());
-        assert (std::get<kCombatantUin>(*it) == uin);
-        assert (garrison_.find(*it) == it);
-        (void)uin;
-        garrison_.erase(it);
-    }
-
-    GarrisonIterator Field::UpdateGarrisonLevel(UinType uin, LevelType newlevel,
-            GarrisonIterator it) {
-        assert (it != garrison_.end());
-        assert (garrison_.find(*it) == it);
-        auto oldlevel = std::get<kCombatantLevel>(*it);
-        if (newlevel == oldlevel) {
-            return it;
-        }
-        auto last_defeated_time = std::get<kCombatantDefeatedTimeStamp>(*it);
-        garrison_.erase(it);
-        auto res = garrison_.insert(CombatantIdentity(newlevel, last_defeated_time, uin));
-        assert (res.second);
-        return res.first;
-    }
-
-    GarrisonIterator Field::UpdateGarrisonLastDefeatedTime(UinType uin,
-            alpha::TimeStamp last_defeated_time, GarrisonIterator it) {
-        assert (it != garrison_.end());
-        assert (garrison_.find(*it) == it);
-        auto level = std::get<kCombatantLevel>(*it);
-        garrison_.erase(it);
-        auto res = garrison_.insert(CombatantIdentity(level, last_defeated_time, uin));
-        CHECK (res.second);
-        return res.first;
-    }
-
-    OpponentList Field::GetOpponents(LevelType level, alpha::TimeStamp defeated_before) {
-        OpponentList opponents;
-        const auto kMaxOpponents = 5u;
-        auto last = garrison_.end();
-        if (last == garrison_.begin()) {
-            //没有驻军
-            return opponents;
-        }
-
-        //先找同一等级段的
-        if (FindOpponentsInLevel(level, kMaxOpponents, defeated_before, &opponents)) {
-            return opponents;
-        }
-
-        --last;
-        const auto min_searching_level = std::get<kCombatantLevel>(*garrison_.begin());
-        const auto max_searching_level = std::get<kCombatantLevel>(*last);
-
-        //同一等级段不足，则在上下等级段查找
-        int current_searching_level_offset = 1;
-        while (opponents.size() < kMaxOpponents) {
-            auto current_search_level = static_cast<int>(level)
-                - current_searching_level_offset;
-
-            bool searching_down_done = false;
-            if (current_search_level >= min_searching_level) {
-                auto needs = kMaxOpponents - opponents.size();
-                if (FindOpponentsInLevel(current_search_level, needs, defeated_before,
-                            &opponents)) {
-                    break;
-                }
-            } else {
-                searching_down_done = true;
-            }
-
-            bool searching_up_done = false;
-            current_search_level = static_cast<int>(level) + current_searching_level_offset;
-            if (current_search_level <= max_searching_level) {
-                auto needs = kMaxOpponents - opponents.size();
-                if (FindOpponentsInLevel(current_search_level, needs, defeated_before,
-                            &opponents)) {
-                    break;
-                }
-            } else {
-                searching_up_done = true;
-            }
-
-            if (searching_down_done && searching_up_done) {
-                break;
-            }
-
-            ++current_searching_level_offset;
-        }
-        return opponents;
-    }
-
     SectType Field::Owner() const {
         return owner_;
     }
@@ -255,49 +148,11 @@ namespace SectBattle {
     }
 
     uint32_t Field::GarrisonNum() const {
-        return garrison_.size();
-    }
-
-    bool Field::FindOpponentsInLevel(LevelType level, unsigned needs,
-            alpha::TimeStamp defeated_before, OpponentList* opponents) {
-        assert (opponents);
-        CombatantIdentity lower(level, defeated_before,
-                std::numeric_limits<UinType>::min());
-        CombatantIdentity upper(level, std::numeric_limits<alpha::TimeStamp>::min(),
-                std::numeric_limits<UinType>::max());
-        auto it = garrison_.lower_bound(lower);
-        auto last = garrison_.upper_bound(upper);
-
-        //这个等级段没人满足条件
-        if (it == last) {
-            return false;
-        }
-        auto first = it;
-        auto iterators = alpha::Random::Sample(first, last, needs);
-        std::for_each(iterators.begin(), iterators.end(), 
-                [opponents](decltype(it) it) {
-            opponents->push_back(std::get<kCombatantUin>(*it));
-        });
-
-        return iterators.size() == needs;
-    }
-
-    Sect::Sect(SectType type, Pos born_pos)
-        :type_(type), born_pos_(born_pos) {
-        assert (type != SectType::kNone);
-    }
-
-    void Sect::AddMember(UinType uin) {
-        members_.insert(uin);
-    }
-
-    void Sect::RemoveMember(UinType uin) {
-        assert (members_.find(uin) != members_.end());
-        members_.erase(uin);
+        return garrison_num_;
     }
 
     uint32_t Sect::MemberCount() const {
-        return members_.size();
+        return member_count_;
     }
 
     SectType Sect::Type() const {
@@ -308,36 +163,40 @@ namespace SectBattle {
         return born_pos_;
     }
 
-    Combatant::Combatant(const Sect* sect, Pos pos, GarrisonIterator iter)
-        :sect_(sect), pos_(pos), iter_(iter) {
-        assert (sect);
-        assert (sect->Type() != SectType::kNone);
+    void Combatant::ChangeOpponents(Direction direction, const OpponentList& opponents) {
+        auto d = static_cast<int>(direction);
+        CHECK(IsValidDirection(d)) << "Invalid direction = " << direction;
+        CHECK(opponents.size() <= kMaxOpponentOneDirection)
+            << "OpponentList exceed kMaxOpponentOneDirection"
+            << ", opponents.size() = " << opponents.size();
+        auto last = std::copy(opponents.begin(), opponents.end(),
+                std::begin(opponents_[d - 1]));
+        std::fill(last, std::end(opponents_[d - 1]), 0);
     }
 
-    void Combatant::MoveTo(Pos pos) {
-        pos_ = pos;
-        opponents_.clear();
+    void Combatant::ClearOpponents(Direction direction) {
+        auto d = static_cast<int>(direction);
+        CHECK(IsValidDirection(d)) << "Invalid direction = " << direction;
+        std::fill(std::begin(opponents_[d - 1]), std::end(opponents_[d - 1]), 0);
     }
 
-    void Combatant::SetIterator(GarrisonIterator iter) {
-        iter_ = iter;
+    void Combatant::ClearAllOpponents() {
+        ::memset(opponents_, 0x0, sizeof(opponents_));
     }
 
-    void Combatant::ChangeSect(const Sect* new_sect) {
-        assert (new_sect);
-        assert (new_sect->Type() != SectType::kNone);
-        sect_ = new_sect;
+    UinType Combatant::Uin() const {
+        return uin_;
     }
 
-    void Combatant::ChangeOpponents(Direction d, const OpponentList& opponents) {
-        opponents_[d] = opponents;
+    LevelType Combatant::Level() const {
+        return level_;
     }
 
-    void Combatant::ClearOpponents(Direction d) {
-        opponents_.erase(d);
+    alpha::TimeStamp Combatant::LastDefeatedTime() const {
+        return last_defeated_time_;
     }
 
-    const Sect* Combatant::CurrentSect() const {
+    SectType Combatant::CurrentSect() const {
         return sect_;
     }
 
@@ -345,17 +204,19 @@ namespace SectBattle {
         return pos_;
     }
 
-    GarrisonIterator Combatant::Iterator() const {
-        return iter_;
+    CombatantIdentity Combatant::Identity() const {
+        return CombatantIdentity(level_, uin_);
     }
 
-    OpponentList Combatant::GetOpponents(Direction d) const {
-        auto it = opponents_.find(d);
-        if (it == opponents_.end()) {
-            return OpponentList();
-        } else {
-            return it->second;
-        }
+    OpponentList Combatant::GetOpponents(Direction direction) const {
+        auto d = static_cast<int>(direction);
+        CHECK(IsValidDirection(d)) << "Invalid direction = " << direction;
+        OpponentList res;
+        std::copy_if(std::begin(opponents_[d - 1]), std::end(opponents_[d - 1]),
+                std::back_inserter(res), [](UinType opponent_uin) {
+            return opponent_uin != 0;
+        });
+        return res;
     }
 
     CombatantLite CombatantLite::Create(Pos p, LevelType l) {
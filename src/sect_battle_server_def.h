@@ -14,14 +14,17 @@
 #define  __SECT_BATTLE_SERVER_DEF_H__
 
 #include <cstddef>
-#include <set>
+#include <cassert>
+#include <array>
 #include <map>
 #include <vector>
 #include <memory>
 #include <tuple>
+#include <type_traits>
 #include <alpha/mmap_file.h>
 #include <alpha/skip_list.h>
 #include <alpha/time_util.h>
+#include "sect_battle_intrusive_tree.h"
 
 namespace SectBattle {
     //错误码
@@ -74,20 +77,39 @@ namespace SectBattle {
     //for std::get<*>(combatant_identity);
     enum {
         kCombatantLevel = 0,
-        kCombatantDefeatedTimeStamp = 1,
-        kCombatantUin = 2
+        kCombatantUin = 1
     };
     
     static const int kBattleFieldCount = 81;
     using UinType = uint32_t;
     using LevelType = uint16_t;
-    using OpponentList = std::vector<UinType>;
-    using CombatantIdentity = std::tuple<LevelType, alpha::TimeStamp, UinType>;
+    //一个方向最多只有5个对手, 放在栈上, 刷新对手时不用分配内存
+    class OpponentList {
+        public:
+            static const int kCapacity = 5;
+            using value_type = UinType;
+            using const_iterator = const UinType*;
+
+            void push_back(const UinType& uin) {
+                assert (size_ < kCapacity);
+                uins_[size_++] = uin;
+            }
+            void clear() { size_ = 0; }
+            size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+            UinType operator[](size_t i) const { assert (i < size_); return uins_[i]; }
+            const_iterator begin() const { return uins_.data(); }
+            const_iterator end() const { return uins_.data() + size_; }
+
+        private:
+            std::array<UinType, kCapacity> uins_;
+            uint32_t size_ = 0;
+    };
+    //保护期由BattleStore的时间轮维护, 排序不再需要被打败的时间
+    using CombatantIdentity = std::tuple<LevelType, UinType>;
     struct CompareCombatantIdentity {
-        bool operator ()(const CombatantIdentity& lhs, const CombatantIdentity& rhs);
+        bool operator ()(const CombatantIdentity& lhs, const CombatantIdentity& rhs) const;
     };
-    using GarrisonSet = std::set<CombatantIdentity, CompareCombatantIdentity>;
-    using GarrisonIterator = GarrisonSet::iterator;
 
     bool IsValidSectType(int type);
     bool IsValidDirection(int d);
@@ -107,6 +129,7 @@ namespace SectBattle {
             Pos() = default;
             friend class Sect;
             friend class Combatant;
+            friend class BattleStore;
             friend struct CombatantLite;
             int16_t x_;
             int16_t y_;
@@ -117,73 +140,78 @@ namespace SectBattle {
     std::ostream& operator<<(std::ostream& os, const Pos& pos);
     static_assert (std::is_pod<Pos>::value, "Pos must be POD type");
 
+    //下面三个都是直接放在mmap文件(BattleStore)里的, 所以必须是POD
+    //之间的关联只能用下标, 不能用指针
     //战场位置对应的格子
     class Field {
         public:
-            Field(SectType owner, FieldType type);
-            DISABLE_COPY_ASSIGNMENT(Field);
-            GarrisonIterator AddGarrison(UinType uin, LevelType level,
-                    alpha::TimeStamp last_defeated_time = 0);
             void ChangeOwner(SectType new_owner);
-            void ReduceGarrison(UinType uin, GarrisonIterator it);
-            GarrisonIterator UpdateGarrisonLevel(UinType uin, LevelType newlevel,
-                    GarrisonIterator it);
-            GarrisonIterator UpdateGarrisonLastDefeatedTime(UinType uin,
-                    alpha::TimeStamp last_defeated_time, GarrisonIterator it);
-            OpponentList GetOpponents(LevelType level, alpha::TimeStamp defeated_before);
             SectType Owner() const;
             FieldType Type() const;
             uint32_t GarrisonNum() const;
 
         private:
-            //从level这个等级最多取出needs个人
-            //如果取出的人数恰好为needs, 返回true, 否则为false
-            bool FindOpponentsInLevel(LevelType level, unsigned needs,
-                    alpha::TimeStamp defeated_before, OpponentList*);
+            friend class BattleStore;
             SectType owner_;
             FieldType type_;
-            GarrisonSet garrison_;
+            uint32_t garrison_num_;
+            //驻军按CompareCombatantIdentity排序的红黑树的根
+            uint32_t garrison_root_;
     };
+    static_assert (std::is_pod<Field>::value, "Field must be POD type");
+
     //门派
     class Sect {
         public:
-            Sect(SectType type, Pos born_pos);
-            DISABLE_COPY_ASSIGNMENT(Sect);
-            void AddMember(UinType uin);
-            void RemoveMember(UinType uin);
             uint32_t MemberCount() const;
             SectType Type() const;
             Pos BornPos() const;
 
         private:
+            friend class BattleStore;
             SectType type_;
             Pos born_pos_;
-            std::set<UinType> members_;
+            uint32_t member_count_;
+            //门派成员的侵入式双向链表
+            uint32_t member_head_;
     };
+    static_assert (std::is_pod<Sect>::value, "Sect must be POD type");
 
     //参战人员
     class Combatant {
         public:
-            Combatant(const Sect* sect, Pos pos, GarrisonIterator iter);
-            DISABLE_COPY_ASSIGNMENT(Combatant);
-            void MoveTo(Pos pos);
-            void SetIterator(GarrisonIterator iter);
-            void ChangeSect(const Sect* new_sect);
+            static const int kMaxDirection = 4;
+            static const int kMaxOpponentOneDirection = 5;
+            static_assert (kMaxOpponentOneDirection <= OpponentList::kCapacity,
+                    "OpponentList too small");
             void ChangeOpponents(Direction d, const OpponentList& opponents);
             void ClearOpponents(Direction d);
-            const Sect* CurrentSect() const;
+            UinType Uin() const;
+            LevelType Level() const;
+            alpha::TimeStamp LastDefeatedTime() const;
+            SectType CurrentSect() const;
             Pos CurrentPos() const;
-            GarrisonIterator Iterator() const;
+            CombatantIdentity Identity() const;
             OpponentList GetOpponents(Direction d) const;
 
         private:
-            using OpponentMap = std::map<Direction, OpponentList>;
-            const Sect* sect_;
+            friend class BattleStore;
+            void ClearAllOpponents();
+            alpha::TimeStamp last_defeated_time_;
+            UinType uin_; //0表示这个位置没有被使用
             Pos pos_;
-            GarrisonIterator iter_;
-            OpponentMap opponents_;
+            SectType sect_;
+            LevelType level_;
+            UinType opponents_[kMaxDirection][kMaxOpponentOneDirection];
+            //uin索引的哈希链表, 未使用时作为空闲链表
+            uint32_t hash_next_;
+            uint32_t sect_prev_;
+            uint32_t sect_next_;
+            TreeLinks garrison_links_;
     };
+    static_assert (std::is_pod<Combatant>::value, "Combatant must be POD type");
 
+    //以下为旧版本按SkipList落地的格式, 只用来导入旧的数据
     struct CombatantLite {
         static CombatantLite Create(Pos p, LevelType l);
         Pos pos;
@@ -208,6 +236,7 @@ namespace SectBattle {
     using OpponentMap = alpha::SkipList<UinType, OpponentLite>;
     using MMapedFileMap = std::map<std::string, std::unique_ptr<alpha::MMapFile>>;
     extern const char* kBackupMetaDataKey;
+    extern const char* kBattleStoreDataKey;
     extern const char* kCombatantMapDataKey;
     extern const char* kOpponentMapDataKey;
     extern const char* kOwnerMapDataKey;
@@ -0,0 +1,817 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_store.cc
+ *        Created:  06/04/15 17:25:31
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_store.h"
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <alpha/logger.h>
+#include <alpha/time_util.h>
+
+namespace {
+    size_t AlignUp(size_t n, size_t alignment) {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    uint32_t HashUin(SectBattle::UinType uin) {
+        return (uin * 0x9e3779b97f4a7c15ull) >> 32;
+    }
+}
+
+namespace SectBattle {
+    const uint32_t BattleStore::kVersion;
+    const int BattleStore::kSectCount;
+    const int BattleStore::kProtectionTick;
+
+    BattleStore::MutationGuard::MutationGuard(Header* header)
+        :header_(header) {
+        assert (header_->mutating == 0);
+        header_->mutating = 1;
+    }
+
+    BattleStore::MutationGuard::~MutationGuard() {
+        header_->mutating = 0;
+    }
+
+    bool BattleStore::Layout(size_t size, uint32_t* capacity, uint32_t* bucket_count,
+            size_t* bucket_offset, size_t* combatant_offset) {
+        const size_t kAlignment = 64;
+        *bucket_offset = AlignUp(sizeof(Header), kAlignment);
+        if (size < *bucket_offset + 2 * sizeof(Combatant) + kAlignment) {
+            return false;
+        }
+        //每个Combatant最多对应两个桶
+        size_t remain = size - *bucket_offset - sizeof(Combatant) - kAlignment;
+        size_t n = std::min<size_t>(remain / (sizeof(Combatant) + 2 * sizeof(Bucket)),
+                std::numeric_limits<int32_t>::max());
+        size_t buckets = 1;
+        while (buckets < n) {
+            buckets <<= 1;
+        }
+        *capacity = n;
+        *bucket_count = buckets;
+        *combatant_offset = AlignUp(*bucket_offset + buckets * sizeof(Bucket), kAlignment);
+        assert (*combatant_offset + (n + 1) * sizeof(Combatant) <= size);
+        return n != 0;
+    }
+
+    size_t BattleStore::ArchiveHeaderSize() {
+        //Combatant按和文件中一样的方式对齐
+        return AlignUp(sizeof(Header), 64);
+    }
+
+    bool BattleStore::ParseArchiveHeader(const char* data, size_t size,
+            SnapshotView* view) {
+        assert (view);
+        if (size < ArchiveHeaderSize()) {
+            return false;
+        }
+        const Header* header = reinterpret_cast<const Header*>(data);
+        if (header->magic != kMagic
+                || header->version != kVersion
+                || header->combatant_size != sizeof(Combatant)
+                || header->high_water > header->capacity) {
+            return false;
+        }
+        FillView(header, nullptr, view);
+        return true;
+    }
+
+    bool BattleStore::ParseFile(const char* data, size_t size, SnapshotView* view) {
+        assert (view);
+        uint32_t capacity, bucket_count;
+        size_t bucket_offset, combatant_offset;
+        if (!Layout(size, &capacity, &bucket_count, &bucket_offset, &combatant_offset)) {
+            LOG_WARNING << "Size too small, size = " << size;
+            return false;
+        }
+        const Header* header = reinterpret_cast<const Header*>(data);
+        if (header->magic != kMagic
+                || header->version != kVersion
+                || header->combatant_size != sizeof(Combatant)) {
+            LOG_WARNING << "Mismatch magic or version, header->version = "
+                << header->version
+                << ", header->combatant_size = " << header->combatant_size;
+            return false;
+        }
+        if (header->capacity != capacity || header->bucket_count != bucket_count
+                || header->high_water > capacity || header->size > header->high_water
+                || header->free_head > header->high_water) {
+            LOG_WARNING << "Mismatch layout, header->capacity = " << header->capacity
+                << ", header->bucket_count = " << header->bucket_count
+                << ", header->high_water = " << header->high_water
+                << ", header->size = " << header->size;
+            return false;
+        }
+        FillView(header, data + combatant_offset, view);
+        return true;
+    }
+
+    void BattleStore::FillView(const Header* header, const char* combatants,
+            SnapshotView* view) {
+        view->version = header->version;
+        view->size = header->size;
+        view->capacity = header->capacity;
+        view->epoch = header->epoch;
+        view->mutating = header->mutating;
+        view->allocations = header->allocations;
+        view->frees = header->frees;
+        view->fields = header->fields;
+        view->sects = header->sects;
+        view->combatants = reinterpret_cast<const Combatant*>(combatants);
+        view->high_water = header->high_water;
+    }
+
+    std::unique_ptr<BattleStore> BattleStore::Create(char* data, size_t size) {
+        uint32_t capacity, bucket_count;
+        size_t bucket_offset, combatant_offset;
+        if (!Layout(size, &capacity, &bucket_count, &bucket_offset, &combatant_offset)) {
+            LOG_WARNING << "Size too small, size = " << size;
+            return nullptr;
+        }
+
+        std::unique_ptr<BattleStore> store(
+                new BattleStore(data, capacity, bucket_offset, combatant_offset));
+        Header* header = store->header_;
+        ::memset(header, 0x0, sizeof(Header));
+        header->magic = kMagic;
+        header->version = kVersion;
+        header->combatant_size = sizeof(Combatant);
+        header->capacity = capacity;
+        header->bucket_count = bucket_count;
+        ::memset(store->buckets_, 0x0, bucket_count * sizeof(Bucket));
+        store->Clear();
+        LOG_INFO << "BattleStore created, capacity = " << capacity
+            << ", bucket_count = " << bucket_count;
+        return std::move(store);
+    }
+
+    std::unique_ptr<BattleStore> BattleStore::Restore(char* data, size_t size) {
+        uint32_t capacity, bucket_count;
+        size_t bucket_offset, combatant_offset;
+        if (!Layout(size, &capacity, &bucket_count, &bucket_offset, &combatant_offset)) {
+            LOG_WARNING << "Size too small, size = " << size;
+            return nullptr;
+        }
+
+        Header* header = reinterpret_cast<Header*>(data);
+        if (header->magic != kMagic) {
+            LOG_WARNING << "Mismatch magic, header->magic = " << header->magic;
+            return nullptr;
+        }
+        if (header->version != kVersion || header->combatant_size != sizeof(Combatant)) {
+            LOG_WARNING << "Mismatch version, header->version = " << header->version
+                << ", header->combatant_size = " << header->combatant_size
+                << ", sizeof(Combatant) = " << sizeof(Combatant);
+            return nullptr;
+        }
+        if (header->capacity != capacity || header->bucket_count != bucket_count
+                || header->high_water > capacity || header->size > header->high_water
+                || header->free_head > header->high_water) {
+            LOG_WARNING << "Mismatch layout, header->capacity = " << header->capacity
+                << ", header->bucket_count = " << header->bucket_count
+                << ", header->high_water = " << header->high_water
+                << ", header->size = " << header->size
+                << ", capacity = " << capacity
+                << ", bucket_count = " << bucket_count;
+            return nullptr;
+        }
+        std::unique_ptr<BattleStore> store(
+                new BattleStore(data, capacity, bucket_offset, combatant_offset));
+        //保护期的索引只在内存中, 启动时由SetProtection扫一遍构造
+        return std::move(store);
+    }
+
+    BattleStore::BattleStore(char* data, uint32_t capacity, size_t bucket_offset,
+            size_t combatant_offset)
+        :header_(reinterpret_cast<Header*>(data)),
+        buckets_(reinterpret_cast<Bucket*>(data + bucket_offset)),
+        combatants_(reinterpret_cast<Combatant*>(data + combatant_offset)),
+        //用启动时间做初始值, 重启前后客户端拿到的版本号不会重复
+        field_version_(alpha::NowInMicroseconds()),
+        protection_duration_(0),
+        eligible_links_(capacity + 1),
+        protection_links_(capacity + 1),
+        protection_wheel_(ProtectionAccessor(this), kProtectionTick) {
+        eligible_roots_.fill(EligibleTree::kNil);
+        eligible_nums_.fill(0);
+        protection_wheel_.Reset(alpha::Now());
+    }
+
+    int BattleStore::FieldIndex(Pos pos) {
+        assert (pos.Valid());
+        return pos.Y() * (Pos::kMaxPos + 1) + pos.X();
+    }
+
+    bool BattleStore::NeedsRebuild() const {
+        return header_->mutating != 0;
+    }
+
+    bool BattleStore::Initialized() const {
+        return header_->initialized != 0;
+    }
+
+    void BattleStore::SetInitialized() {
+        header_->initialized = 1;
+    }
+
+    void BattleStore::RebuildIndexes(int threads) {
+        header_->mutating = 1;
+        NextEpoch();
+        ::memset(&combatants_[GarrisonTree::kNil], 0x0, sizeof(Combatant));
+        header_->size = 0;
+        header_->free_head = 0;
+        for (auto & field : header_->fields) {
+            field.garrison_num_ = 0;
+            field.garrison_root_ = GarrisonTree::kNil;
+        }
+        for (auto & sect : header_->sects) {
+            sect.member_count_ = 0;
+            sect.member_head_ = 0;
+        }
+
+        std::vector<std::vector<uint32_t>> garrisons(kBattleFieldCount);
+        std::vector<uint32_t> free_slots;
+        for (uint32_t index = 1; index <= header_->high_water; ++index) {
+            Combatant& combatant = combatants_[index];
+            if (combatant.uin_ == 0) {
+                free_slots.push_back(index);
+                continue;
+            }
+            if (!combatant.pos_.Valid()
+                    || !IsValidSectType(static_cast<int>(combatant.sect_))
+                    || FindIndex(combatant.uin_) != 0) {
+                LOG_WARNING << "Drop invalid combatant, uin = " << combatant.uin_
+                    << ", index = " << index;
+                combatant.uin_ = 0;
+                free_slots.push_back(index);
+                continue;
+            }
+            LinkHash(index);
+            LinkSect(index);
+            ++header_->size;
+            garrisons[FieldIndex(combatant.pos_)].push_back(index);
+        }
+        for (auto it = free_slots.rbegin(); it != free_slots.rend(); ++it) {
+            FreeSlot(*it);
+        }
+
+        //格子之间互不影响, 排好序后直接构造平衡的树
+        auto build = [this, &garrisons](int first, int step) {
+            GarrisonAccessor accessor(combatants_);
+            for (int index = first; index < kBattleFieldCount; index += step) {
+                auto & garrison = garrisons[index];
+                std::sort(garrison.begin(), garrison.end(),
+                        [&accessor](uint32_t lhs, uint32_t rhs) {
+                    return accessor.Less(lhs, rhs);
+                });
+                Field& field = header_->fields[index];
+                Garrison(field).BuildFromSorted(garrison.data(), garrison.size());
+                field.garrison_num_ = garrison.size();
+            }
+        };
+        threads = std::max(1, std::min(threads, kBattleFieldCount));
+        std::vector<std::thread> workers;
+        for (int i = 1; i < threads; ++i) {
+            workers.emplace_back(build, i, threads);
+        }
+        build(0, threads);
+        for (auto & worker : workers) {
+            worker.join();
+        }
+        header_->mutating = 0;
+        ++field_version_;
+        //启动时还没SetProtection, 留给它构造, 不用扫两遍
+        if (protection_built_) {
+            RebuildProtection(protection_wheel_.Now());
+        }
+        LOG_INFO << "RebuildIndexes done, size = " << header_->size
+            << ", high_water = " << header_->high_water
+            << ", threads = " << threads;
+    }
+
+    void BattleStore::Clear(std::string* archive_header) {
+        //上一个存档没取完的部分放弃
+        archive_next_ = 1;
+        archive_end_ = 0;
+        archive_pending_.clear();
+        if (archive_header) {
+            const size_t combatant_offset = ArchiveHeaderSize();
+            archive_header->assign(combatant_offset + sizeof(Combatant), '\0');
+            ::memcpy(&(*archive_header)[0], header_, sizeof(Header));
+            ::memcpy(&(*archive_header)[combatant_offset], combatants_, sizeof(Combatant));
+            archive_end_ = header_->high_water;
+        }
+        MutationGuard guard(header_);
+        ::memset(header_->fields, 0x0, sizeof(header_->fields));
+        ::memset(header_->sects, 0x0, sizeof(header_->sects));
+        ::memset(&combatants_[GarrisonTree::kNil], 0x0, sizeof(Combatant));
+        //整个slab一起释放, 之前的哈希桶因为epoch不同自动失效
+        //high_water之上的旧数据不会再被访问, 由Scrub分批清零
+        scrub_end_ = std::max(scrub_end_, header_->high_water);
+        header_->frees += header_->size;
+        header_->size = 0;
+        header_->high_water = 0;
+        header_->free_head = 0;
+        NextEpoch();
+        ++field_version_;
+        //节点的links在AddCombatant时重新初始化, 这里只需要清空树根和时间轮
+        eligible_roots_.fill(EligibleTree::kNil);
+        eligible_nums_.fill(0);
+        protection_wheel_.Reset(protection_wheel_.Now());
+    }
+
+    uint32_t BattleStore::ArchiveSlice(uint32_t max_slots, std::string* out) {
+        assert (out);
+        //archive_pending_中的下标都比archive_next_小, 先放进去
+        out->append(archive_pending_);
+        archive_pending_.clear();
+        if (archive_next_ > archive_end_) {
+            return 0;
+        }
+        const uint32_t n = std::min(max_slots, archive_end_ - archive_next_ + 1);
+        out->append(reinterpret_cast<const char*>(&combatants_[archive_next_]),
+                n * sizeof(Combatant));
+        archive_next_ += n;
+        return archive_end_ + 1 - archive_next_;
+    }
+
+    uint32_t BattleStore::Scrub(uint32_t max_slots) {
+        const uint32_t high_water = header_->high_water;
+        if (archive_next_ <= archive_end_) {
+            return scrub_end_ > high_water ? scrub_end_ - high_water : 0;
+        }
+        if (scrub_end_ <= high_water) {
+            //新赛季的人已经覆盖了剩下的部分
+            scrub_end_ = 0;
+            return 0;
+        }
+        const uint32_t begin = scrub_end_ - high_water > max_slots
+            ? scrub_end_ - max_slots : high_water;
+        ::memset(&combatants_[begin + 1], 0x0,
+                (scrub_end_ - begin) * sizeof(Combatant));
+        scrub_end_ = begin;
+        return scrub_end_ - high_water;
+    }
+
+    void BattleStore::InitField(Pos pos, SectType owner, FieldType type) {
+        Field& field = GetField(pos);
+        assert (field.garrison_num_ == 0);
+        field.owner_ = owner;
+        field.type_ = type;
+        field.garrison_num_ = 0;
+        field.garrison_root_ = GarrisonTree::kNil;
+        ++field_version_;
+    }
+
+    void BattleStore::InitSect(SectType type, Pos born_pos) {
+        Sect& sect = GetSect(type);
+        assert (sect.member_count_ == 0);
+        sect.type_ = type;
+        sect.born_pos_ = born_pos;
+        sect.member_count_ = 0;
+        sect.member_head_ = 0;
+    }
+
+    Field& BattleStore::GetField(Pos pos) {
+        return header_->fields[FieldIndex(pos)];
+    }
+
+    Sect& BattleStore::GetSect(SectType type) {
+        assert (IsValidSectType(static_cast<int>(type)));
+        return header_->sects[static_cast<int>(type) - 1];
+    }
+
+    Combatant* BattleStore::FindCombatant(UinType uin) {
+        uint32_t index = FindIndex(uin);
+        return index == 0 ? nullptr : &combatants_[index];
+    }
+
+    Combatant* BattleStore::AddCombatant(UinType uin, SectType sect, Pos pos,
+            LevelType level, alpha::TimeStamp last_defeated_time) {
+        assert (uin != 0);
+        assert (FindIndex(uin) == 0);
+        MutationGuard guard(header_);
+        uint32_t index = AllocateSlot();
+        if (index == 0) {
+            return nullptr;
+        }
+        Combatant& combatant = combatants_[index];
+        ::memset(&combatant, 0x0, sizeof(Combatant));
+        //Clear之后不会重置所有节点, 可能还留着上个赛季的links
+        eligible_links_[index] = TreeLinks();
+        protection_links_[index] = TimerLinks();
+        combatant.pos_ = pos;
+        combatant.sect_ = sect;
+        combatant.level_ = level;
+        combatant.last_defeated_time_ = last_defeated_time;
+        //最后才写uin, uin不为0的位置重建时会被认为是有效的
+        combatant.uin_ = uin;
+        //先决定是否在保护期, AddGarrison才知道要不要放进可挑战树
+        protection_wheel_.Schedule(index);
+        LinkHash(index);
+        LinkSect(index);
+        AddGarrison(index);
+        ++header_->size;
+        return &combatant;
+    }
+
+    void BattleStore::RemoveCombatant(Combatant* combatant) {
+        MutationGuard guard(header_);
+        uint32_t index = Index(combatant);
+        ReduceGarrison(index);
+        if (protection_wheel_.Scheduled(index)) {
+            protection_wheel_.Cancel(index);
+        }
+        UnlinkHash(index);
+        UnlinkSect(index);
+        --header_->size;
+        combatant->uin_ = 0;
+        FreeSlot(index);
+        ++header_->frees;
+    }
+
+    void BattleStore::MoveCombatant(Combatant* combatant, Pos new_pos, LevelType level) {
+        if (combatant->pos_ == new_pos) {
+            return;
+        }
+        MutationGuard guard(header_);
+        uint32_t index = Index(combatant);
+        //从旧的格子里干掉
+        ReduceGarrison(index);
+        combatant->pos_ = new_pos;
+        combatant->level_ = level;
+        combatant->ClearAllOpponents();
+        //放到新的格子中
+        AddGarrison(index);
+    }
+
+    void BattleStore::UpdateLevel(Combatant* combatant, LevelType level) {
+        if (combatant->level_ == level) {
+            return;
+        }
+        MutationGuard guard(header_);
+        uint32_t index = Index(combatant);
+        combatant->level_ = level;
+        RepositionGarrison(index);
+        if (!protection_wheel_.Scheduled(index)) {
+            Eligible(combatant->pos_).Reposition(index);
+        }
+    }
+
+    void BattleStore::UpdateLastDefeatedTime(Combatant* combatant,
+            alpha::TimeStamp last_defeated_time) {
+        MutationGuard guard(header_);
+        uint32_t index = Index(combatant);
+        if (protection_wheel_.Scheduled(index)) {
+            protection_wheel_.Cancel(index);
+        } else {
+            RemoveEligible(index);
+        }
+        //驻军的顺序和被打败的时间无关, 只需要更新保护期
+        combatant->last_defeated_time_ = last_defeated_time;
+        if (!protection_wheel_.Schedule(index)) {
+            AddEligible(index);
+        }
+    }
+
+    void BattleStore::ChangeSect(Combatant* combatant, SectType new_sect) {
+        assert (combatant->sect_ != new_sect);
+        MutationGuard guard(header_);
+        uint32_t index = Index(combatant);
+        UnlinkSect(index);
+        combatant->sect_ = new_sect;
+        LinkSect(index);
+    }
+
+    void BattleStore::ChangeOwner(Pos pos, SectType new_owner) {
+        GetField(pos).ChangeOwner(new_owner);
+        ++field_version_;
+    }
+
+    uint64_t BattleStore::FieldVersion() const {
+        return field_version_;
+    }
+
+    void BattleStore::SetFieldVersion(uint64_t version) {
+        field_version_ = version;
+    }
+
+    void BattleStore::SetProtection(int duration, alpha::TimeStamp now) {
+        assert (duration >= 0);
+        protection_duration_ = duration;
+        RebuildProtection(now);
+    }
+
+    void BattleStore::AdvanceProtection(alpha::TimeStamp now) {
+        protection_wheel_.Advance(now, [this](uint32_t index) {
+            AddEligible(index);
+        });
+    }
+
+    uint32_t BattleStore::EligibleNum(Pos pos) const {
+        return eligible_nums_[FieldIndex(pos)];
+    }
+
+    size_t BattleStore::ProtectedNum() const {
+        return protection_wheel_.size();
+    }
+
+    bool BattleStore::InProtection(const Combatant* combatant) const {
+        return protection_wheel_.Scheduled(Index(combatant));
+    }
+
+    OpponentList BattleStore::GetOpponents(Pos pos, LevelType level) {
+        OpponentList opponents;
+        const unsigned kMaxOpponents = Combatant::kMaxOpponentOneDirection;
+        if (eligible_nums_[FieldIndex(pos)] == 0) {
+            //没有驻军或者都在保护期
+            return opponents;
+        }
+
+        //先找同一等级段的
+        auto eligible = Eligible(pos);
+        auto level_of = [this](uint32_t index) { return combatants_[index].level_; };
+        auto first = eligible.PartitionPoint([&level_of, level](uint32_t index) {
+            return level_of(index) < level;
+        });
+        auto last = eligible.PartitionPoint([&level_of, level](uint32_t index) {
+            return level_of(index) <= level;
+        });
+        if (SampleOpponents(eligible, first, last, kMaxOpponents, &opponents)) {
+            return opponents;
+        }
+
+        //同一等级段不足, 则在上下有人的等级段中找, 等级差相同时先找低的
+        //down为下面最近的等级段的最后一个, up为上面最近的等级段的第一个
+        uint32_t down = first == EligibleTree::kNil ? eligible.Last() : eligible.Prev(first);
+        uint32_t up = last;
+        while (down != EligibleTree::kNil || up != EligibleTree::kNil) {
+            auto needs = kMaxOpponents - opponents.size();
+            bool searching_down = down != EligibleTree::kNil
+                && (up == EligibleTree::kNil
+                        || level - level_of(down) <= level_of(up) - level);
+            bool done;
+            if (searching_down) {
+                auto down_level = level_of(down);
+                auto begin = eligible.PartitionPoint([&level_of, down_level](uint32_t index) {
+                    return level_of(index) < down_level;
+                });
+                done = SampleOpponents(eligible, begin, eligible.Next(down), needs,
+                        &opponents);
+                down = eligible.Prev(begin);
+            } else {
+                auto up_level = level_of(up);
+                auto end = eligible.PartitionPoint([&level_of, up_level](uint32_t index) {
+                    return level_of(index) <= up_level;
+                });
+                done = SampleOpponents(eligible, up, end, needs, &opponents);
+                up = end;
+            }
+            if (done) {
+                break;
+            }
+        }
+        return opponents;
+    }
+
+    void BattleStore::SetRandom(Random* random) {
+        random_ = random ? random : &default_random_;
+    }
+
+    size_t BattleStore::size() const {
+        return header_->size;
+    }
+
+    size_t BattleStore::max_size() const {
+        return header_->capacity;
+    }
+
+    BattleStore::GarrisonTree BattleStore::Garrison(Field& field) {
+        return GarrisonTree(&field.garrison_root_, GarrisonAccessor(combatants_));
+    }
+
+    BattleStore::EligibleTree BattleStore::Eligible(Pos pos) {
+        return EligibleTree(&eligible_roots_[FieldIndex(pos)], EligibleAccessor(this));
+    }
+
+    uint32_t BattleStore::Index(const Combatant* combatant) const {
+        assert (combatant > combatants_);
+        assert (combatant <= combatants_ + header_->high_water);
+        assert (combatant->uin_ != 0);
+        return combatant - combatants_;
+    }
+
+    BattleStore::SlabStats BattleStore::GetSlabStats() const {
+        SlabStats stats;
+        stats.allocations = header_->allocations;
+        stats.frees = header_->frees;
+        stats.live = header_->size;
+        stats.high_water = header_->high_water;
+        stats.capacity = header_->capacity;
+        stats.epoch = header_->epoch;
+        return stats;
+    }
+
+    uint32_t& BattleStore::BucketHead(UinType uin) {
+        Bucket& bucket = buckets_[HashUin(uin) & (header_->bucket_count - 1)];
+        if (bucket.epoch != header_->epoch) {
+            //上个epoch留下来的, 视为空桶
+            bucket.epoch = header_->epoch;
+            bucket.head = 0;
+        }
+        return bucket.head;
+    }
+
+    void BattleStore::NextEpoch() {
+        if (++header_->epoch == 0) {
+            //回绕之后旧的epoch可能再次出现, 只能真的清空一次
+            ::memset(buckets_, 0x0, header_->bucket_count * sizeof(Bucket));
+            header_->epoch = 1;
+        }
+    }
+
+    uint32_t BattleStore::FindIndex(UinType uin) {
+        uint32_t index = BucketHead(uin);
+        while (index != 0 && combatants_[index].uin_ != uin) {
+            index = combatants_[index].hash_next_;
+        }
+        return index;
+    }
+
+    void BattleStore::LinkHash(uint32_t index) {
+        uint32_t& head = BucketHead(combatants_[index].uin_);
+        combatants_[index].hash_next_ = head;
+        head = index;
+    }
+
+    void BattleStore::UnlinkHash(uint32_t index) {
+        uint32_t* link = &BucketHead(combatants_[index].uin_);
+        while (*link != index) {
+            assert (*link != 0);
+            link = &combatants_[*link].hash_next_;
+        }
+        *link = combatants_[index].hash_next_;
+        combatants_[index].hash_next_ = 0;
+    }
+
+    uint32_t BattleStore::AllocateSlot() {
+        if (header_->free_head != 0) {
+            uint32_t index = header_->free_head;
+            header_->free_head = combatants_[index].hash_next_;
+            ++header_->allocations;
+            return index;
+        }
+        if (header_->high_water == header_->capacity) {
+            return 0;
+        }
+        ++header_->allocations;
+        const uint32_t index = ++header_->high_water;
+        if (index == archive_next_ && index <= archive_end_) {
+            //上个赛季在这个位置的数据还没存档, 先拷走再给新赛季用
+            archive_pending_.append(reinterpret_cast<const char*>(&combatants_[index]),
+                    sizeof(Combatant));
+            ++archive_next_;
+        }
+        return index;
+    }
+
+    void BattleStore::FreeSlot(uint32_t index) {
+        assert (combatants_[index].uin_ == 0);
+        combatants_[index].hash_next_ = header_->free_head;
+        header_->free_head = index;
+    }
+
+    void BattleStore::AddGarrison(uint32_t index) {
+        Field& field = GetField(combatants_[index].pos_);
+        Garrison(field).Insert(index);
+        ++field.garrison_num_;
+        ++field_version_;
+        if (!protection_wheel_.Scheduled(index)) {
+            AddEligible(index);
+        }
+    }
+
+    void BattleStore::ReduceGarrison(uint32_t index) {
+        Field& field = GetField(combatants_[index].pos_);
+        assert (field.garrison_num_ != 0);
+        Garrison(field).Erase(index);
+        --field.garrison_num_;
+        ++field_version_;
+        if (!protection_wheel_.Scheduled(index)) {
+            RemoveEligible(index);
+        }
+    }
+
+    void BattleStore::RepositionGarrison(uint32_t index) {
+        //同一个格子里只是键变了, 不需要改驻军数量, 顺序没变时树也不用动
+        Garrison(GetField(combatants_[index].pos_)).Reposition(index);
+    }
+
+    void BattleStore::AddEligible(uint32_t index) {
+        Pos pos = combatants_[index].pos_;
+        Eligible(pos).Insert(index);
+        ++eligible_nums_[FieldIndex(pos)];
+    }
+
+    void BattleStore::RemoveEligible(uint32_t index) {
+        Pos pos = combatants_[index].pos_;
+        assert (eligible_nums_[FieldIndex(pos)] != 0);
+        Eligible(pos).Erase(index);
+        --eligible_nums_[FieldIndex(pos)];
+    }
+
+    void BattleStore::RebuildProtection(alpha::TimeStamp now) {
+        std::fill(eligible_links_.begin(), eligible_links_.end(), TreeLinks());
+        std::fill(protection_links_.begin(), protection_links_.end(), TimerLinks());
+        eligible_roots_.fill(EligibleTree::kNil);
+        eligible_nums_.fill(0);
+        protection_wheel_.Reset(now);
+        protection_built_ = true;
+
+        std::vector<std::vector<uint32_t>> eligible(kBattleFieldCount);
+        for (uint32_t index = 1; index <= header_->high_water; ++index) {
+            if (combatants_[index].uin_ != 0 && !protection_wheel_.Schedule(index)) {
+                eligible[FieldIndex(combatants_[index].pos_)].push_back(index);
+            }
+        }
+        EligibleAccessor accessor(this);
+        for (int i = 0; i < kBattleFieldCount; ++i) {
+            std::sort(eligible[i].begin(), eligible[i].end(),
+                    [&accessor](uint32_t lhs, uint32_t rhs) {
+                return accessor.Less(lhs, rhs);
+            });
+            EligibleTree(&eligible_roots_[i], accessor).BuildFromSorted(
+                    eligible[i].data(), eligible[i].size());
+            eligible_nums_[i] = eligible[i].size();
+        }
+    }
+
+    void BattleStore::LinkSect(uint32_t index) {
+        Combatant& combatant = combatants_[index];
+        Sect& sect = GetSect(combatant.sect_);
+        combatant.sect_prev_ = 0;
+        combatant.sect_next_ = sect.member_head_;
+        if (sect.member_head_ != 0) {
+            combatants_[sect.member_head_].sect_prev_ = index;
+        }
+        sect.member_head_ = index;
+        ++sect.member_count_;
+    }
+
+    void BattleStore::UnlinkSect(uint32_t index) {
+        Combatant& combatant = combatants_[index];
+        Sect& sect = GetSect(combatant.sect_);
+        assert (sect.member_count_ != 0);
+        if (combatant.sect_prev_ != 0) {
+            combatants_[combatant.sect_prev_].sect_next_ = combatant.sect_next_;
+        } else {
+            assert (sect.member_head_ == index);
+            sect.member_head_ = combatant.sect_next_;
+        }
+        if (combatant.sect_next_ != 0) {
+            combatants_[combatant.sect_next_].sect_prev_ = combatant.sect_prev_;
+        }
+        combatant.sect_prev_ = combatant.sect_next_ = 0;
+        --sect.member_count_;
+    }
+
+    bool BattleStore::SampleOpponents(const EligibleTree& eligible, uint32_t first,
+            uint32_t last, unsigned needs, OpponentList* opponents) {
+        assert (opponents);
+        //这个等级段没人满足条件
+        if (first == last) {
+            return false;
+        }
+        //蓄水池抽样, 结果放在栈上, 不用alpha::Random::Sample返回的vector
+        assert (needs <= OpponentList::kCapacity);
+        std::array<uint32_t, OpponentList::kCapacity> sampled;
+        unsigned n = 0;
+        uint32_t seen = 0;
+        for (auto it = eligible.At(first), end = eligible.At(last); it != end; ++it, ++seen) {
+            if (n < needs) {
+                sampled[n++] = *it;
+            } else {
+                auto j = random_->Uniform(seen + 1);
+                if (j < needs) {
+                    sampled[j] = *it;
+                }
+            }
+        }
+        for (unsigned i = 0; i < n; ++i) {
+            opponents->push_back(combatants_[sampled[i]].uin_);
+        }
+        return n == needs;
+    }
+}
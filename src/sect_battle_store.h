@@ -0,0 +1,354 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_store.h
+ *        Created:  06/04/15 16:40:12
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  战场的全部状态, 直接放在mmap文件中
+ *                  运行时只有这一份数据, 启动时不需要再从SkipList构造一遍
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_STORE_H__
+#define  __SECT_BATTLE_STORE_H__
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include "sect_battle_server_def.h"
+#include "sect_battle_intrusive_tree.h"
+#include "sect_battle_timer_wheel.h"
+#include "sect_battle_random.h"
+
+namespace SectBattle {
+    //文件布局:
+    //  Header | uin哈希桶 | Combatant数组
+    //所有的关联都用Combatant数组的下标表示, 下标0不使用(作为红黑树的哨兵)
+    //Combatant数组就是一个slab, 空闲的位置串成链表, 运行时不会再分配内存
+    //每个赛季一个epoch, 哈希桶带上epoch, 重置赛场时不需要清空整个数组
+    //
+    //保护期的索引只在内存中:
+    //  在保护期的参战人员挂在时间轮上, 到期后移到所在格子的可挑战树中
+    //  可挑战树和驻军一样按(等级, uin)排序, 找对手时只需要看这棵树
+    class BattleStore {
+        public:
+            struct SlabStats {
+                uint64_t allocations; //创建以来分配的次数
+                uint64_t frees; //创建以来释放的次数
+                uint32_t live;
+                uint32_t high_water;
+                uint32_t capacity;
+                uint32_t epoch;
+            };
+
+            //赛季存档或者mmap文件中的数据, 指针都指向原来的数据, 不会修改
+            struct SnapshotView {
+                uint32_t version;
+                uint32_t size;
+                uint32_t capacity;
+                uint32_t epoch;
+                uint32_t mutating; //不为0时索引可能不完整
+                uint64_t allocations;
+                uint64_t frees;
+                const Field* fields; //kBattleFieldCount个
+                const Sect* sects; //kSectCount个
+                //[1, high_water], Uin()为0的是空位
+                //赛季存档的开头中没有, 为nullptr, 要接着从存档中读
+                const Combatant* combatants;
+                uint32_t high_water;
+            };
+
+            //Header或Combatant的布局变化时加1, 不兼容的版本直接拒绝
+            static const uint32_t kVersion = 1;
+            static const int kSectCount = static_cast<int>(SectType::kMax) - 1;
+
+            static std::unique_ptr<BattleStore> Create(char* data, size_t size);
+            static std::unique_ptr<BattleStore> Restore(char* data, size_t size);
+            static int FieldIndex(Pos pos);
+            //赛季存档开头的大小, 后面是Combatant[0, high_water]
+            static size_t ArchiveHeaderSize();
+            //存档开头的格式不对时返回false
+            static bool ParseArchiveHeader(const char* data, size_t size, SnapshotView* view);
+            //只读地检查mmap文件的内容, 和Restore的检查一样, 但不构造BattleStore
+            static bool ParseFile(const char* data, size_t size, SnapshotView* view);
+
+            //上次修改中途退出(比如assert失败)时索引可能不完整
+            //这时需要从Combatant数组重建uin索引和格子驻军
+            bool NeedsRebuild() const;
+            void RebuildIndexes(int threads);
+            //新建之后格子, 门派和旧数据都导入完成时才设置
+            //没有设置说明上次初始化中途失败或者退出了, 需要重新Create
+            bool Initialized() const;
+            void SetInitialized();
+
+            //清空格子, 门派和所有参战人员, 之后需要重新InitField和InitSect
+            //不随人数增长, 上个赛季留在文件里的数据由Scrub清零
+            //archive_header不为nullptr时填入赛季存档的开头(Header和下标0)
+            //剩下的Combatant之后用ArchiveSlice分批取走
+            void Clear(std::string* archive_header = nullptr);
+            //把上个赛季还没取走的Combatant按下标顺序追加到out中, 每次最多max_slots个
+            //返回还剩多少个, 在事件循环中分批调用
+            //取完之前新赛季分配到的位置会先把旧数据拷走, 不会被覆盖
+            uint32_t ArchiveSlice(uint32_t max_slots, std::string* out);
+            //把Clear之前用过, 现在还没有重新分配的位置清零, 每次最多max_slots个
+            //返回还剩多少个, 在事件循环中分批调用, 存档取完之前不会清零
+            uint32_t Scrub(uint32_t max_slots);
+            void InitField(Pos pos, SectType owner, FieldType type);
+            void InitSect(SectType type, Pos born_pos);
+
+            Field& GetField(Pos pos);
+            Sect& GetSect(SectType type);
+            Combatant* FindCombatant(UinType uin);
+            //已经满了返回nullptr
+            Combatant* AddCombatant(UinType uin, SectType sect, Pos pos, LevelType level,
+                    alpha::TimeStamp last_defeated_time = 0);
+            void RemoveCombatant(Combatant* combatant);
+            //换格子的同时清空已经刷新的对手
+            void MoveCombatant(Combatant* combatant, Pos new_pos, LevelType level);
+            void UpdateLevel(Combatant* combatant, LevelType level);
+            void UpdateLastDefeatedTime(Combatant* combatant,
+                    alpha::TimeStamp last_defeated_time);
+            void ChangeSect(Combatant* combatant, SectType new_sect);
+            void ChangeOwner(Pos pos, SectType new_owner);
+            //格子的主人或驻军人数变化时加1, 只在内存中
+            uint64_t FieldVersion() const;
+            //重放时从记录开始时的版本接着加, 只能在处理请求之前调用
+            void SetFieldVersion(uint64_t version);
+            //被打败后duration毫秒内在保护期, 会按now重建保护期的索引
+            void SetProtection(int duration, alpha::TimeStamp now);
+            //把now之前保护期已经结束的人移到可挑战树中, 找对手之前调用
+            void AdvanceProtection(alpha::TimeStamp now);
+            //格子中不在保护期的驻军人数
+            uint32_t EligibleNum(Pos pos) const;
+            //在保护期的总人数
+            size_t ProtectedNum() const;
+            //以AdvanceProtection的时间为准, 最多比实际结束时间晚一个tick
+            bool InProtection(const Combatant* combatant) const;
+            //在pos对应的格子中找不在保护期的对手, 优先等级接近的
+            OpponentList GetOpponents(Pos pos, LevelType level);
+            //抽样对手用的随机数, 不归BattleStore所有, nullptr时用自己的(种子为0)
+            //相同的随机数序列和请求序列得到相同的对手
+            void SetRandom(Random* random);
+
+            template<typename Function>
+            void ForEachCombatant(Function f) const;
+            //按加入门派的先后倒序遍历, f返回false时停止
+            template<typename Function>
+            void ForEachSectMember(SectType type, Function f) const;
+            //分页用, 从after之后接着遍历, after已经不在这个门派时返回false
+            //期间新加入的成员在链表头部, 不会被遍历到
+            template<typename Function>
+            bool ForEachSectMember(SectType type, UinType after, Function f);
+            //按(等级, uin)从小到大遍历pos格子的驻军, 从after之后开始, f返回false时停止
+            //after为(0, 0)时从头开始, 两页之间升级或移动的人可能重复或漏掉
+            template<typename Function>
+            void ForEachGarrison(Pos pos, const CombatantIdentity& after, Function f);
+            size_t size() const;
+            size_t max_size() const;
+            SlabStats GetSlabStats() const;
+
+        private:
+            struct Header {
+                int64_t magic;
+                uint32_t version;
+                uint32_t combatant_size;
+                uint32_t capacity;
+                uint32_t bucket_count;
+                uint32_t size;
+                //[1, high_water]范围内的位置被分配过
+                uint32_t high_water;
+                uint32_t free_head;
+                uint32_t mutating;
+                uint32_t epoch;
+                uint32_t initialized;
+                uint64_t allocations;
+                uint64_t frees;
+                Field fields[kBattleFieldCount];
+                Sect sects[kSectCount];
+            };
+
+            struct Bucket {
+                uint32_t epoch;
+                uint32_t head;
+            };
+
+            class GarrisonAccessor {
+                public:
+                    GarrisonAccessor(Combatant* combatants)
+                        :combatants_(combatants) {
+                    }
+                    TreeLinks& Links(uint32_t index) const {
+                        return combatants_[index].garrison_links_;
+                    }
+                    bool Less(uint32_t lhs, uint32_t rhs) const {
+                        return CompareCombatantIdentity()(combatants_[lhs].Identity(),
+                                combatants_[rhs].Identity());
+                    }
+
+                private:
+                    Combatant* combatants_;
+            };
+            using GarrisonTree = IntrusiveTree<GarrisonAccessor>;
+
+            class EligibleAccessor {
+                public:
+                    EligibleAccessor(BattleStore* store)
+                        :store_(store) {
+                    }
+                    TreeLinks& Links(uint32_t index) const {
+                        return store_->eligible_links_[index];
+                    }
+                    bool Less(uint32_t lhs, uint32_t rhs) const {
+                        return CompareCombatantIdentity()(
+                                store_->combatants_[lhs].Identity(),
+                                store_->combatants_[rhs].Identity());
+                    }
+
+                private:
+                    BattleStore* store_;
+            };
+            using EligibleTree = IntrusiveTree<EligibleAccessor>;
+
+            class ProtectionAccessor {
+                public:
+                    ProtectionAccessor(BattleStore* store)
+                        :store_(store) {
+                    }
+                    TimerLinks& Links(uint32_t index) const {
+                        return store_->protection_links_[index];
+                    }
+                    alpha::TimeStamp Expire(uint32_t index) const {
+                        return store_->combatants_[index].last_defeated_time_
+                            + store_->protection_duration_;
+                    }
+
+                private:
+                    BattleStore* store_;
+            };
+            using ProtectionWheel = TimerWheel<ProtectionAccessor>;
+            static const int kProtectionTick = 10; //10ms
+
+            //修改索引的过程中设置标记, 正常结束时清除
+            class MutationGuard {
+                public:
+                    MutationGuard(Header* header);
+                    ~MutationGuard();
+
+                private:
+                    Header* header_;
+            };
+
+            static const int64_t kMagic = 0x5ec7ba771e5707e1;
+            static void FillView(const Header* header, const char* combatants,
+                    SnapshotView* view);
+            static bool Layout(size_t size, uint32_t* capacity, uint32_t* bucket_count,
+                    size_t* bucket_offset, size_t* combatant_offset);
+            BattleStore(char* data, uint32_t capacity, size_t bucket_offset,
+                    size_t combatant_offset);
+            GarrisonTree Garrison(Field& field);
+            EligibleTree Eligible(Pos pos);
+            uint32_t Index(const Combatant* combatant) const;
+            uint32_t& BucketHead(UinType uin);
+            void NextEpoch();
+            uint32_t FindIndex(UinType uin);
+            void LinkHash(uint32_t index);
+            void UnlinkHash(uint32_t index);
+            uint32_t AllocateSlot();
+            void FreeSlot(uint32_t index);
+            void AddGarrison(uint32_t index);
+            void ReduceGarrison(uint32_t index);
+            void RepositionGarrison(uint32_t index);
+            void AddEligible(uint32_t index);
+            void RemoveEligible(uint32_t index);
+            void RebuildProtection(alpha::TimeStamp now);
+            void LinkSect(uint32_t index);
+            void UnlinkSect(uint32_t index);
+            template<typename Function>
+            void ForEachSectMemberFrom(uint32_t index, Function f) const;
+            //从[first, last)中随机选最多needs个, 选够了返回true
+            bool SampleOpponents(const EligibleTree& eligible, uint32_t first,
+                    uint32_t last, unsigned needs, OpponentList* opponents);
+
+            Header* header_;
+            Bucket* buckets_;
+            Combatant* combatants_;
+            uint64_t field_version_;
+            //(high_water, scrub_end_]中是上个赛季的数据, 只在内存中
+            uint32_t scrub_end_ = 0;
+            //[archive_next_, archive_end_]中是还没取走存档的上个赛季的数据
+            uint32_t archive_next_ = 1;
+            uint32_t archive_end_ = 0;
+            //新赛季分配到archive_next_时先把旧数据拷到这里, ArchiveSlice时一起取走
+            std::string archive_pending_;
+            //以下只在内存中, 启动时从Combatant数组构造
+            int protection_duration_;
+            std::vector<TreeLinks> eligible_links_;
+            std::array<uint32_t, kBattleFieldCount> eligible_roots_;
+            std::array<uint32_t, kBattleFieldCount> eligible_nums_;
+            std::vector<TimerLinks> protection_links_;
+            ProtectionWheel protection_wheel_;
+            //第一次SetProtection之前保护期的索引是空的
+            bool protection_built_ = false;
+            Random default_random_;
+            Random* random_ = &default_random_;
+    };
+
+    template<typename Function>
+    void BattleStore::ForEachCombatant(Function f) const {
+        for (uint32_t index = 1; index <= header_->high_water; ++index) {
+            const Combatant& combatant = combatants_[index];
+            if (combatant.Uin() != 0) {
+                f(combatant);
+            }
+        }
+    }
+
+    template<typename Function>
+    void BattleStore::ForEachSectMember(SectType type, Function f) const {
+        assert (IsValidSectType(static_cast<int>(type)));
+        ForEachSectMemberFrom(header_->sects[static_cast<int>(type) - 1].member_head_, f);
+    }
+
+    template<typename Function>
+    bool BattleStore::ForEachSectMember(SectType type, UinType after, Function f) {
+        assert (IsValidSectType(static_cast<int>(type)));
+        const Combatant* cursor = FindCombatant(after);
+        if (cursor == nullptr || cursor->CurrentSect() != type) {
+            return false;
+        }
+        ForEachSectMemberFrom(cursor->sect_next_, f);
+        return true;
+    }
+
+    template<typename Function>
+    void BattleStore::ForEachSectMemberFrom(uint32_t index, Function f) const {
+        while (index != 0) {
+            const Combatant& combatant = combatants_[index];
+            index = combatant.sect_next_;
+            if (!f(combatant)) {
+                break;
+            }
+        }
+    }
+
+    template<typename Function>
+    void BattleStore::ForEachGarrison(Pos pos, const CombatantIdentity& after, Function f) {
+        GarrisonTree garrison = Garrison(GetField(pos));
+        //第一个比after大的节点
+        uint32_t index = garrison.PartitionPoint([this, &after](uint32_t node) {
+            return !CompareCombatantIdentity()(after, combatants_[node].Identity());
+        });
+        while (index != GarrisonTree::kNil) {
+            const Combatant& combatant = combatants_[index];
+            index = garrison.Next(index);
+            if (!f(combatant)) {
+                break;
+            }
+        }
+    }
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_STORE_H__  ----- */
@@ -0,0 +1,215 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_timer_wheel.h
+ *        Created:  06/10/15 10:12:45
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  侵入式时间轮, 节点用数组下标表示, 到期时间由Accessor给出
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_TIMER_WHEEL_H__
+#define  __SECT_BATTLE_TIMER_WHEEL_H__
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <alpha/time_util.h>
+
+namespace SectBattle {
+    //嵌在节点里的双向链表
+    struct TimerLinks {
+        uint32_t prev;
+        uint32_t next;
+        uint32_t slot; //所在的槽加1, 0表示没有在时间轮中
+    };
+
+    //Accessor需要提供:
+    //  TimerLinks& Links(uint32_t index) const;
+    //  alpha::TimeStamp Expire(uint32_t index) const;
+    //下标0表示空, 不能作为节点
+    //分层的时间轮, 每层64个槽, 第n层一个槽对应64^n个tick
+    //节点先放在能放下的最低层, 低层转完一圈时把上一层的一个槽分散到下面
+    //一个tick完整过去之后才处理这个tick到期的节点, 所以到期通知最多晚一个tick
+    template<typename Accessor>
+    class TimerWheel {
+        public:
+            static const uint32_t kNil = 0;
+            static const int kLevels = 4;
+            static const int kSlotBits = 6;
+            static const int kSlots = 1 << kSlotBits;
+
+            TimerWheel(const Accessor& accessor, int tick)
+                :accessor_(accessor), tick_(tick) {
+                assert (tick_ > 0);
+                heads_.fill(kNil);
+            }
+
+            //清空时间轮, 节点的Links由调用者负责清零
+            void Reset(alpha::TimeStamp now);
+            //已经到期(Expire <= Now())的节点不会加入, 返回false
+            bool Schedule(uint32_t node);
+            void Cancel(uint32_t node);
+            bool Scheduled(uint32_t node) const { return L(node).slot != 0; }
+            //处理完整过去的tick, 对每个到期的节点调用f(node), 调用前节点已经移出时间轮
+            template<typename Function>
+            void Advance(alpha::TimeStamp now, Function f);
+            alpha::TimeStamp Now() const { return now_; }
+            size_t size() const { return size_; }
+
+        private:
+            static const uint32_t kSlotMask = kSlots - 1;
+
+            TimerLinks& L(uint32_t node) const { return accessor_.Links(node); }
+            int64_t TickOf(alpha::TimeStamp t) const { return t / tick_; }
+            //按和current_tick_的距离选层
+            void Link(uint32_t node);
+            void Unlink(uint32_t node);
+            //把level层的slot槽中的节点重新放到下面的层, 返回slot
+            uint32_t Cascade(int level, uint32_t slot);
+
+            Accessor accessor_;
+            const int tick_;
+            std::array<uint32_t, kLevels * kSlots> heads_;
+            alpha::TimeStamp now_ = 0;
+            //小于current_tick_的tick都已经处理过了
+            int64_t current_tick_ = 0;
+            size_t size_ = 0;
+    };
+
+    template<typename Accessor>
+    const uint32_t TimerWheel<Accessor>::kNil;
+    template<typename Accessor>
+    const int TimerWheel<Accessor>::kLevels;
+    template<typename Accessor>
+    const int TimerWheel<Accessor>::kSlotBits;
+    template<typename Accessor>
+    const int TimerWheel<Accessor>::kSlots;
+    template<typename Accessor>
+    const uint32_t TimerWheel<Accessor>::kSlotMask;
+
+    template<typename Accessor>
+    void TimerWheel<Accessor>::Reset(alpha::TimeStamp now) {
+        heads_.fill(kNil);
+        now_ = now;
+        current_tick_ = TickOf(now);
+        size_ = 0;
+    }
+
+    template<typename Accessor>
+    bool TimerWheel<Accessor>::Schedule(uint32_t node) {
+        assert (node != kNil);
+        assert (!Scheduled(node));
+        if (accessor_.Expire(node) <= now_) {
+            return false;
+        }
+        Link(node);
+        ++size_;
+        return true;
+    }
+
+    template<typename Accessor>
+    void TimerWheel<Accessor>::Cancel(uint32_t node) {
+        assert (Scheduled(node));
+        Unlink(node);
+        assert (size_ != 0);
+        --size_;
+    }
+
+    template<typename Accessor>
+    void TimerWheel<Accessor>::Link(uint32_t node) {
+        const int64_t expire_tick = TickOf(accessor_.Expire(node));
+        //Schedule时expire > now_, 所以所在的tick一定还没处理
+        //Cascade时current_tick_就是正在处理的tick, 一样不会落到已经处理过的槽
+        const int64_t delta = std::max<int64_t>(expire_tick - current_tick_, 0);
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (int64_t(1) << (kSlotBits * (level + 1)))) {
+            ++level;
+        }
+        //超过最高层一圈的先放在最远的槽, 转到时再重新分配
+        const int64_t max_delta = (int64_t(1) << (kSlotBits * kLevels)) - 1;
+        const int64_t tick = current_tick_ + std::min(delta, max_delta);
+        const uint32_t slot = level * kSlots + ((tick >> (kSlotBits * level)) & kSlotMask);
+        TimerLinks& links = L(node);
+        links.prev = kNil;
+        links.next = heads_[slot];
+        links.slot = slot + 1;
+        if (heads_[slot] != kNil) {
+            L(heads_[slot]).prev = node;
+        }
+        heads_[slot] = node;
+    }
+
+    template<typename Accessor>
+    void TimerWheel<Accessor>::Unlink(uint32_t node) {
+        TimerLinks& links = L(node);
+        if (links.prev != kNil) {
+            L(links.prev).next = links.next;
+        } else {
+            assert (heads_[links.slot - 1] == node);
+            heads_[links.slot - 1] = links.next;
+        }
+        if (links.next != kNil) {
+            L(links.next).prev = links.prev;
+        }
+        links.prev = links.next = links.slot = 0;
+    }
+
+    template<typename Accessor>
+    uint32_t TimerWheel<Accessor>::Cascade(int level, uint32_t slot) {
+        uint32_t node = heads_[level * kSlots + slot];
+        heads_[level * kSlots + slot] = kNil;
+        while (node != kNil) {
+            const uint32_t next = L(node).next;
+            L(node).slot = 0;
+            Link(node);
+            node = next;
+        }
+        return slot;
+    }
+
+    template<typename Accessor>
+    template<typename Function>
+    void TimerWheel<Accessor>::Advance(alpha::TimeStamp now, Function f) {
+        if (now <= now_) {
+            return;
+        }
+        now_ = now;
+        //[current_tick_, end_tick)已经完整过去了
+        const int64_t end_tick = TickOf(now);
+        if (size_ == 0) {
+            current_tick_ = std::max(current_tick_, end_tick);
+            return;
+        }
+        for (; current_tick_ < end_tick && size_ != 0; ++current_tick_) {
+            const int64_t tick = current_tick_;
+            //最低层转完一圈, 把上一层的下一个槽分散下来, 上一层也转完一圈时继续往上
+            if ((tick & kSlotMask) == 0) {
+                for (int level = 1; level < kLevels; ++level) {
+                    if (Cascade(level, (tick >> (kSlotBits * level)) & kSlotMask) != 0) {
+                        break;
+                    }
+                }
+            }
+            uint32_t node = heads_[tick & kSlotMask];
+            while (node != kNil) {
+                const uint32_t next = L(node).next;
+                Unlink(node);
+                if (TickOf(accessor_.Expire(node)) <= tick) {
+                    --size_;
+                    f(node);
+                } else {
+                    //超过最高层一圈的, 放回去等下次
+                    Link(node);
+                }
+                node = next;
+            }
+        }
+        current_tick_ = std::max(current_tick_, end_tick);
+    }
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_TIMER_WHEEL_H__  ----- */
@@ -0,0 +1,174 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_traffic_capture.cc
+ *        Created:  06/11/15 15:41:02
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:
+ *
+ * =============================================================================
+ */
+
+#include "sect_battle_traffic_capture.h"
+#include <cassert>
+#include <cstring>
+#include <chrono>
+#include <alpha/logger.h>
+
+namespace SectBattle {
+    namespace {
+        //后台线程最多隔这么久写一次文件
+        const int kFlushInterval = 100; //ms
+    }
+
+    std::unique_ptr<TrafficCapture> TrafficCapture::Create(const std::string& path,
+            size_t buffer_size, int64_t start_time, uint64_t field_version) {
+        if (buffer_size <= kTrafficRecordHeaderSize) {
+            LOG_ERROR << "Capture buffer too small, buffer_size = " << buffer_size;
+            return nullptr;
+        }
+        FILE* fp = ::fopen(path.data(), "wb");
+        if (fp == nullptr) {
+            LOG_ERROR << "fopen failed, path = " << path;
+            return nullptr;
+        }
+        if (::fwrite(kTrafficCaptureMagic, 1, kTrafficCaptureMagicSize, fp)
+                    != kTrafficCaptureMagicSize
+                || ::fwrite(&start_time, sizeof(start_time), 1, fp) != 1
+                || ::fwrite(&field_version, sizeof(field_version), 1, fp) != 1) {
+            LOG_ERROR << "Write capture header failed, path = " << path;
+            ::fclose(fp);
+            return nullptr;
+        }
+        LOG_INFO << "Capture traffic to " << path << ", buffer_size = " << buffer_size
+            << ", start_time = " << start_time << ", field_version = " << field_version;
+        return std::unique_ptr<TrafficCapture>(new TrafficCapture(fp, buffer_size));
+    }
+
+    TrafficCapture::TrafficCapture(FILE* fp, size_t buffer_size)
+        :fp_(fp), buffer_(buffer_size) {
+        flush_thread_ = std::thread(&TrafficCapture::FlushRoutine, this);
+    }
+
+    TrafficCapture::~TrafficCapture() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        cond_.notify_one();
+        flush_thread_.join();
+        ::fclose(fp_);
+        LOG_INFO << "Capture stopped, captured = " << captured_
+            << ", dropped = " << dropped_
+            << ", written_bytes = " << written_bytes_;
+    }
+
+    bool TrafficCapture::Append(int64_t timestamp, alpha::Slice packet) {
+        const uint32_t size = packet.size();
+        const size_t record_size = kTrafficRecordHeaderSize + size;
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        const uint64_t tail = tail_.load(std::memory_order_acquire);
+        if (record_size > buffer_.size() - (head - tail)) {
+            ++dropped_;
+            return false;
+        }
+        char header[kTrafficRecordHeaderSize];
+        ::memcpy(header, &timestamp, sizeof(timestamp));
+        ::memcpy(header + sizeof(timestamp), &size, sizeof(size));
+        //可能绕回缓冲区开头, 分两段拷贝
+        auto copy = [this](uint64_t pos, const char* data, size_t n) {
+            const size_t offset = pos % buffer_.size();
+            const size_t first = std::min(n, buffer_.size() - offset);
+            ::memcpy(&buffer_[offset], data, first);
+            ::memcpy(&buffer_[0], data + first, n - first);
+        };
+        copy(head, header, sizeof(header));
+        copy(head + sizeof(header), packet.data(), size);
+        head_.store(head + record_size, std::memory_order_release);
+        ++captured_;
+        //超过一半时提前叫醒后台线程, 其他时候等它自己醒来, 不在这里加锁
+        if (head + record_size - tail > buffer_.size() / 2) {
+            cond_.notify_one();
+        }
+        return true;
+    }
+
+    void TrafficCapture::FlushRoutine() {
+        bool stopped = false;
+        while (!stopped) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait_for(lock, std::chrono::milliseconds(kFlushInterval));
+                stopped = stopped_;
+            }
+            if (Flush(head_.load(std::memory_order_acquire))) {
+                ::fflush(fp_);
+            }
+        }
+    }
+
+    bool TrafficCapture::Flush(uint64_t head) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head) {
+            return false;
+        }
+        while (tail != head) {
+            const size_t offset = tail % buffer_.size();
+            const size_t n = std::min<uint64_t>(head - tail, buffer_.size() - offset);
+            auto nbytes = ::fwrite(&buffer_[offset], 1, n, fp_);
+            if (nbytes != n) {
+                LOG_WARNING << "fwrite failed, n = " << n << ", nbytes = " << nbytes;
+            }
+            tail += n;
+            written_bytes_ += nbytes;
+            tail_.store(tail, std::memory_order_release);
+        }
+        return true;
+    }
+
+    std::unique_ptr<TrafficCaptureReader> TrafficCaptureReader::Open(
+            const std::string& path) {
+        FILE* fp = ::fopen(path.data(), "rb");
+        if (fp == nullptr) {
+            LOG_ERROR << "fopen failed, path = " << path;
+            return nullptr;
+        }
+        char magic[kTrafficCaptureMagicSize];
+        int64_t start_time;
+        uint64_t field_version;
+        if (::fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+                || ::memcmp(magic, kTrafficCaptureMagic, sizeof(magic)) != 0
+                || ::fread(&start_time, sizeof(start_time), 1, fp) != 1
+                || ::fread(&field_version, sizeof(field_version), 1, fp) != 1) {
+            LOG_ERROR << "Not a capture file, path = " << path;
+            ::fclose(fp);
+            return nullptr;
+        }
+        return std::unique_ptr<TrafficCaptureReader>(
+                new TrafficCaptureReader(fp, start_time, field_version));
+    }
+
+    TrafficCaptureReader::TrafficCaptureReader(FILE* fp, int64_t start_time,
+            uint64_t field_version)
+        :fp_(fp), start_time_(start_time), field_version_(field_version) {
+    }
+
+    TrafficCaptureReader::~TrafficCaptureReader() {
+        ::fclose(fp_);
+    }
+
+    bool TrafficCaptureReader::Next(int64_t* timestamp, std::string* packet) {
+        assert (timestamp && packet);
+        char header[kTrafficRecordHeaderSize];
+        if (::fread(header, 1, sizeof(header), fp_) != sizeof(header)) {
+            return false;
+        }
+        uint32_t size;
+        ::memcpy(timestamp, header, sizeof(*timestamp));
+        ::memcpy(&size, header + sizeof(*timestamp), sizeof(size));
+        packet->resize(size);
+        //服务器停止时最后一条记录可能只写了一半
+        return size == 0 || ::fread(&(*packet)[0], 1, size, fp_) == size;
+    }
+}
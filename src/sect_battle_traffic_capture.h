@@ -0,0 +1,90 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_traffic_capture.h
+ *        Created:  06/11/15 15:20:36
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  把收到的请求原样记到文件里, 离线时按原来的节奏重放
+ *
+ * =============================================================================
+ */
+
+#ifndef  __SECT_BATTLE_TRAFFIC_CAPTURE_H__
+#define  __SECT_BATTLE_TRAFFIC_CAPTURE_H__
+
+#include <cstdio>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <alpha/slice.h>
+
+namespace SectBattle {
+    //文件格式:
+    //  magic(8字节) | 开始时间(int64, us) | 开始时的战场版本(uint64) | 记录 | 记录 | ...
+    //  记录: 收到的时间(int64, us) | 包长(uint32) | 包的内容
+    //整数都是本机字节序, 只在同一种机器上重放
+    static const char kTrafficCaptureMagic[] = "SBCAP001";
+    static const size_t kTrafficCaptureMagicSize = sizeof(kTrafficCaptureMagic) - 1;
+    static const size_t kTrafficRecordHeaderSize = sizeof(int64_t) + sizeof(uint32_t);
+
+    //单生产者单消费者的环形缓冲区
+    //事件循环线程只做memcpy, 写文件在后台线程中, 缓冲区满了直接丢掉新的包
+    class TrafficCapture {
+        public:
+            //start_time和field_version是服务器开始记录时的时钟和战场版本, 重放时从这里开始
+            static std::unique_ptr<TrafficCapture> Create(const std::string& path,
+                    size_t buffer_size, int64_t start_time, uint64_t field_version);
+            //把缓冲区中剩下的都写完再返回
+            ~TrafficCapture();
+
+            //只能在一个线程中调用
+            bool Append(int64_t timestamp, alpha::Slice packet);
+            uint64_t captured() const { return captured_; }
+            uint64_t dropped() const { return dropped_; }
+            uint64_t written_bytes() const { return written_bytes_; }
+
+        private:
+            TrafficCapture(FILE* fp, size_t buffer_size);
+            void FlushRoutine();
+            //把[tail_, head)写到文件
+            bool Flush(uint64_t head);
+
+            FILE* fp_;
+            std::vector<char> buffer_;
+            //都是累计的字节数, 对buffer_.size()取模才是位置
+            std::atomic<uint64_t> head_ {0};
+            std::atomic<uint64_t> tail_ {0};
+            std::atomic<uint64_t> captured_ {0};
+            std::atomic<uint64_t> dropped_ {0};
+            std::atomic<uint64_t> written_bytes_ {0};
+            std::atomic<bool> stopped_ {false};
+            std::mutex mutex_;
+            std::condition_variable cond_;
+            std::thread flush_thread_;
+    };
+
+    class TrafficCaptureReader {
+        public:
+            static std::unique_ptr<TrafficCaptureReader> Open(const std::string& path);
+            ~TrafficCaptureReader();
+
+            int64_t start_time() const { return start_time_; }
+            uint64_t field_version() const { return field_version_; }
+            //读到文件末尾或者记录不完整时返回false
+            bool Next(int64_t* timestamp, std::string* packet);
+
+        private:
+            TrafficCaptureReader(FILE* fp, int64_t start_time, uint64_t field_version);
+
+            FILE* fp_;
+            int64_t start_time_;
+            uint64_t field_version_;
+    };
+}
+
+#endif   /* ----- #ifndef __SECT_BATTLE_TRAFFIC_CAPTURE_H__  ----- */
@@ -0,0 +1,238 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_inspect.cc
+ *        Created:  06/12/15 17:35:22
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  不启动服务器, 只读地打开data_path下的mmap文件
+ *                  检查格式和计数是否一致, 输出每个格子的人数, 等级分布等统计
+ *
+ * =============================================================================
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <array>
+#include <map>
+#include <memory>
+#include <string>
+#include <gflags/gflags.h>
+#include <alpha/logger.h>
+#include "sect_battle_server_def.h"
+#include "sect_battle_store.h"
+#include "sect_battle_backup_metadata.h"
+
+DEFINE_string(data_path, "/tmp", "mmap文件存放路径");
+DEFINE_int32(level_bucket, 10, "等级分布每一档的宽度");
+
+namespace {
+    using namespace SectBattle;
+
+    //按MAP_PRIVATE映射, 即使Restore改了内容也不会写回文件
+    class MappedFile {
+        public:
+            static std::unique_ptr<MappedFile> Open(const std::string& path);
+            ~MappedFile() { ::munmap(data_, size_); }
+
+            char* data() const { return data_; }
+            size_t size() const { return size_; }
+            //已经扫描过的部分不再需要, 让内核回收
+            void Release(size_t offset, size_t length);
+
+        private:
+            MappedFile(char* data, size_t size) :data_(data), size_(size) {}
+
+            char* data_;
+            size_t size_;
+    };
+
+    std::unique_ptr<MappedFile> MappedFile::Open(const std::string& path) {
+        int fd = ::open(path.data(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        void* data = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            ::perror("mmap");
+            return nullptr;
+        }
+        ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+        return std::unique_ptr<MappedFile>(new MappedFile(static_cast<char*>(data),
+                    st.st_size));
+    }
+
+    void MappedFile::Release(size_t offset, size_t length) {
+        const size_t kPageSize = ::sysconf(_SC_PAGESIZE);
+        size_t begin = (offset + kPageSize - 1) / kPageSize * kPageSize;
+        size_t end = (offset + length) / kPageSize * kPageSize;
+        if (begin < end) {
+            ::madvise(data_ + begin, end - begin, MADV_DONTNEED);
+        }
+    }
+
+    std::string PathOf(const char* key) {
+        return FLAGS_data_path + "/" + std::string(key) + ".mmap";
+    }
+
+    int errors = 0;
+
+    void Error(const char* what, const std::string& detail) {
+        ::printf("ERROR: %s: %s\n", what, detail.c_str());
+        ++errors;
+    }
+
+    void InspectBackupMetadata() {
+        const auto path = PathOf(kBackupMetaDataKey);
+        auto file = MappedFile::Open(path);
+        if (file == nullptr) {
+            ::printf("[backup_metadata] %s not found\n", path.c_str());
+            return;
+        }
+        auto md = BackupMetadata::Restore(file->data(), file->size());
+        if (md == nullptr) {
+            Error("invalid backup_metadata", path);
+            return;
+        }
+        ::printf("[backup_metadata] %s\n", path.c_str());
+        ::printf("  latest_backup_prefix = %s\n", md->LatestBackupPrefix().c_str());
+        ::printf("  backup_start_time = %" PRId64 "\n", static_cast<int64_t>(md->StartTime()));
+        ::printf("  backup_end_time = %" PRId64 "\n", static_cast<int64_t>(md->EndTime()));
+        ::printf("  latest_battle_field_reset_time = %" PRId64 "\n",
+                static_cast<int64_t>(md->LatestBattleFieldResetTime()));
+    }
+
+    void InspectBattleStore() {
+        const auto path = PathOf(kBattleStoreDataKey);
+        auto file = MappedFile::Open(path);
+        if (file == nullptr) {
+            ::printf("[battle_store] %s not found\n", path.c_str());
+            return;
+        }
+        BattleStore::SnapshotView view;
+        if (!BattleStore::ParseFile(file->data(), file->size(), &view)) {
+            Error("invalid battle_store", path);
+            return;
+        }
+        ::printf("[battle_store] %s, file size = %zu\n", path.c_str(), file->size());
+        ::printf("  version = %u, epoch = %u, mutating = %u\n",
+                view.version, view.epoch, view.mutating);
+        ::printf("  size = %u, capacity = %u, fill = %.2f%%, high_water = %u (%.2f%%)\n",
+                view.size, view.capacity, 100.0 * view.size / view.capacity,
+                view.high_water, 100.0 * view.high_water / view.capacity);
+        ::printf("  allocations = %" PRIu64 ", frees = %" PRIu64 ", free slots = %u\n",
+                view.allocations, view.frees, view.high_water - view.size);
+        if (view.mutating) {
+            Error("battle_store was being modified when the server stopped",
+                    "indexes will be rebuilt on next start");
+        }
+
+        //顺序扫一遍Combatant数组, 扫过的部分马上释放
+        std::array<uint32_t, kBattleFieldCount> garrison_nums {};
+        std::array<uint32_t, BattleStore::kSectCount> member_counts {};
+        std::map<int, uint32_t> levels;
+        uint32_t live = 0;
+        const size_t kReleaseBytes = 64 << 20;
+        const char* begin = reinterpret_cast<const char*>(&view.combatants[1]);
+        size_t released = begin - file->data();
+        for (uint32_t index = 1; index <= view.high_water; ++index) {
+            const Combatant& combatant = view.combatants[index];
+            const size_t offset = reinterpret_cast<const char*>(&combatant) - file->data();
+            if (offset - released >= kReleaseBytes) {
+                file->Release(released, offset - released);
+                released = offset;
+            }
+            if (combatant.Uin() == 0) {
+                continue;
+            }
+            ++live;
+            Pos pos = combatant.CurrentPos();
+            int sect = static_cast<int>(combatant.CurrentSect());
+            if (!pos.Valid() || !IsValidSectType(sect)) {
+                Error("invalid combatant", "uin = " + std::to_string(combatant.Uin()));
+                continue;
+            }
+            ++garrison_nums[BattleStore::FieldIndex(pos)];
+            ++member_counts[sect - 1];
+            ++levels[combatant.Level() / FLAGS_level_bucket];
+        }
+
+        if (live != view.size) {
+            Error("mismatch size", std::to_string(live) + " combatants, header says "
+                    + std::to_string(view.size));
+        }
+        ::printf("  fields (x, y, type, owner, garrison_num):\n");
+        for (int i = 0; i < kBattleFieldCount; ++i) {
+            const Field& field = view.fields[i];
+            const int x = i % (Pos::kMaxPos + 1), y = i / (Pos::kMaxPos + 1);
+            ::printf("    (%d, %d) type = %d, owner = %d, garrison_num = %u\n", x, y,
+                    static_cast<int>(field.Type()), static_cast<int>(field.Owner()),
+                    garrison_nums[i]);
+            if (field.GarrisonNum() != garrison_nums[i]) {
+                Error("mismatch garrison_num", "(" + std::to_string(x) + ", "
+                        + std::to_string(y) + ") says "
+                        + std::to_string(field.GarrisonNum()));
+            }
+        }
+        ::printf("  sects (type, member_count):\n");
+        for (int i = 0; i < BattleStore::kSectCount; ++i) {
+            const Sect& sect = view.sects[i];
+            ::printf("    %d member_count = %u\n", i + 1, member_counts[i]);
+            if (sect.MemberCount() != member_counts[i]) {
+                Error("mismatch member_count", "sect " + std::to_string(i + 1)
+                        + " says " + std::to_string(sect.MemberCount()));
+            }
+        }
+        ::printf("  levels:\n");
+        for (const auto & p : levels) {
+            ::printf("    [%d, %d) %u\n", p.first * FLAGS_level_bucket,
+                    (p.first + 1) * FLAGS_level_bucket, p.second);
+        }
+    }
+
+    template<typename Map>
+    void InspectLegacyMap(const char* key) {
+        const auto path = PathOf(key);
+        auto file = MappedFile::Open(path);
+        if (file == nullptr) {
+            return;
+        }
+        auto map = Map::Restore(file->data(), file->size());
+        if (map == nullptr) {
+            Error("invalid legacy map", path);
+            return;
+        }
+        ::printf("[%s] %s, size = %zu, max_size = %zu\n", key, path.c_str(),
+                map->size(), map->max_size());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("Inspect sect_battle_svrd mmap files offline");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    alpha::Logger::Init(argv[0]);
+    if (FLAGS_level_bucket <= 0) {
+        ::fprintf(stderr, "--level_bucket must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    InspectBackupMetadata();
+    InspectBattleStore();
+    //导入之前的旧版本数据
+    InspectLegacyMap<OwnerMap>(kOwnerMapDataKey);
+    InspectLegacyMap<CombatantMap>(kCombatantMapDataKey);
+    InspectLegacyMap<OpponentMap>(kOpponentMapDataKey);
+    ::printf("%d error(s)\n", errors);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
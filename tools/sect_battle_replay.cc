@@ -0,0 +1,259 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_replay.cc
+ *        Created:  06/11/15 17:02:44
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  把--capture_path记录下来的请求按顺序重新发给服务器
+ *                  服务器要从记录开始时的数据和同一个--random_seed启动,
+ *                  并且带上--replay_capture_path, 这样保护期, 赛季重置和战场版本
+ *                  都按记录里的时间走, 和重放的快慢无关
+ *                  同步收发, 每个请求等到回包或者超时再发下一个
+ *
+ * =============================================================================
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gflags/gflags.h>
+#include <alpha/logger.h>
+#include "sect_battle_protocol.pb.h"
+#include "sect_battle_message_pool.h"
+#include "sect_battle_traffic_capture.h"
+
+DEFINE_string(capture_path, "", "记录下来的请求文件");
+DEFINE_string(server_ip, "127.0.0.1", "服务器IP地址");
+DEFINE_int32(server_port, 9123, "服务器端口");
+DEFINE_double(speed, 0, "重放速度, 1为原来的节奏, 2为两倍速, 0为尽快发送");
+DEFINE_int32(timeout_ms, 1000, "等待回包的超时时间(毫秒)");
+DEFINE_uint64(limit, 0, "最多重放多少个请求, 0为全部");
+
+namespace {
+    using namespace SectBattle;
+    using Clock = std::chrono::steady_clock;
+
+    struct Statistics {
+        std::vector<uint32_t> latencies; //微秒
+        uint64_t timeouts = 0;
+        uint64_t errors = 0; //发送失败或者回包解析失败
+        uint64_t not_ok = 0; //code不为0
+    };
+
+    //FNV-1a, 相同的数据, 种子和记录文件重放两次应该得到相同的值
+    uint64_t Digest(uint64_t h, const char* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    class Replayer {
+        public:
+            bool Connect();
+            bool Run(TrafficCaptureReader* reader);
+            void Report() const;
+
+        private:
+            //name对应的回包类型, 请求名的Request换成Response
+            google::protobuf::Message* ResponseOf(const std::string& name);
+            void Call(const std::string& name, const std::string& packet);
+
+            int fd_ = -1;
+            MessagePool pool_;
+            ProtocolMessage wrapper_;
+            std::array<char, 65536> recv_buffer_;
+            std::map<std::string, Statistics> statistics_;
+            uint64_t total_ = 0;
+            uint64_t invalid_ = 0;
+            uint64_t send_errors_ = 0;
+            uint64_t digest_ = 14695981039346656037ull;
+            Clock::duration elapsed_ {};
+    };
+
+    bool Replayer::Connect() {
+        fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd_ < 0) {
+            ::perror("socket");
+            return false;
+        }
+        struct sockaddr_in addr;
+        ::memset(&addr, 0x0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(FLAGS_server_port);
+        if (::inet_pton(AF_INET, FLAGS_server_ip.c_str(), &addr.sin_addr) != 1) {
+            ::fprintf(stderr, "Invalid server_ip %s\n", FLAGS_server_ip.c_str());
+            return false;
+        }
+        if (::connect(fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::perror("connect");
+            return false;
+        }
+        struct timeval tv;
+        tv.tv_sec = FLAGS_timeout_ms / 1000;
+        tv.tv_usec = (FLAGS_timeout_ms % 1000) * 1000;
+        if (::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+            ::perror("setsockopt");
+            return false;
+        }
+        return true;
+    }
+
+    google::protobuf::Message* Replayer::ResponseOf(const std::string& name) {
+        static const std::string kRequest = "Request";
+        if (name.size() <= kRequest.size()
+                || name.compare(name.size() - kRequest.size(), kRequest.size(),
+                    kRequest) != 0) {
+            return nullptr;
+        }
+        return pool_.Get(name.substr(0, name.size() - kRequest.size()) + "Response");
+    }
+
+    bool Replayer::Run(TrafficCaptureReader* reader) {
+        int64_t timestamp;
+        std::string packet;
+        int64_t first_timestamp = -1;
+        auto start = Clock::now();
+        while ((FLAGS_limit == 0 || total_ < FLAGS_limit)
+                && reader->Next(&timestamp, &packet)) {
+            if (first_timestamp < 0) {
+                first_timestamp = timestamp;
+            }
+            if (FLAGS_speed > 0) {
+                auto offset = std::chrono::microseconds(static_cast<int64_t>(
+                            (timestamp - first_timestamp) / FLAGS_speed));
+                std::this_thread::sleep_until(start + offset);
+            }
+            ++total_;
+            //非法的包也照样发, 服务器上的统计才和记录时一致
+            if (!wrapper_.ParseFromString(packet)) {
+                ++invalid_;
+                if (::send(fd_, packet.data(), packet.size(), 0) < 0) {
+                    ++send_errors_;
+                }
+            } else {
+                //服务器以记录时的收包时间为时钟
+                wrapper_.set_replay_time(timestamp);
+                wrapper_.SerializeToString(&packet);
+                Call(wrapper_.name(), packet);
+            }
+            //少发一个包服务器的状态就和记录时不一样了, 后面的不再重放
+            if (send_errors_ != 0) {
+                ::perror("send");
+                ::fprintf(stderr, "Replay stopped, requests = %lu\n", total_);
+                break;
+            }
+        }
+        elapsed_ = Clock::now() - start;
+        ::close(fd_);
+        if (total_ == 0) {
+            ::fprintf(stderr, "Nothing replayed\n");
+            return false;
+        }
+        return send_errors_ == 0;
+    }
+
+    void Replayer::Call(const std::string& name, const std::string& packet) {
+        auto & statistics = statistics_[name];
+        auto resp = ResponseOf(name);
+        auto begin = Clock::now();
+        if (::send(fd_, packet.data(), packet.size(), 0) < 0) {
+            ++statistics.errors;
+            ++send_errors_;
+            return;
+        }
+        //服务器不认识的消息没有回包
+        if (resp == nullptr) {
+            ++invalid_;
+            return;
+        }
+        ssize_t n;
+        do {
+            n = ::recv(fd_, recv_buffer_.data(), recv_buffer_.size(), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ++statistics.timeouts;
+            } else {
+                ++statistics.errors;
+            }
+            return;
+        }
+        statistics.latencies.push_back(std::chrono::duration_cast<
+                std::chrono::microseconds>(Clock::now() - begin).count());
+        digest_ = Digest(digest_, recv_buffer_.data(), n);
+        if (!resp->ParseFromArray(recv_buffer_.data(), n)) {
+            ++statistics.errors;
+            return;
+        }
+        //ReportFightResponse的code是uint32, 其他的是sint32
+        auto field = resp->GetDescriptor()->FindFieldByName("code");
+        auto reflection = resp->GetReflection();
+        if (field && reflection->HasField(*resp, field)) {
+            bool ok = field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_INT32
+                ? reflection->GetInt32(*resp, field) == 0
+                : reflection->GetUInt32(*resp, field) == 0;
+            if (!ok) {
+                ++statistics.not_ok;
+            }
+        }
+    }
+
+    void Replayer::Report() const {
+        auto seconds = std::chrono::duration<double>(elapsed_).count();
+        ::printf("requests = %lu, invalid = %lu, send_errors = %lu"
+                ", elapsed = %.3fs, qps = %.0f\n", total_, invalid_, send_errors_,
+                seconds, seconds > 0 ? total_ / seconds : 0);
+        ::printf("%-40s %10s %10s %10s %10s %10s %10s\n", "message",
+                "ok", "not_ok", "timeouts", "errors", "p50(us)", "p99(us)");
+        for (const auto & p : statistics_) {
+            auto latencies = p.second.latencies;
+            std::sort(latencies.begin(), latencies.end());
+            auto at = [&latencies](double q) -> uint32_t {
+                return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1,
+                        static_cast<size_t>(q * latencies.size()))];
+            };
+            ::printf("%-40s %10lu %10lu %10lu %10lu %10u %10u\n", p.first.c_str(),
+                    latencies.size() - p.second.not_ok, p.second.not_ok,
+                    p.second.timeouts, p.second.errors, at(0.5), at(0.99));
+        }
+        ::printf("response digest = %016lx\n", digest_);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("Replay captured sect_battle_svrd traffic");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    alpha::Logger::Init(argv[0]);
+    if (FLAGS_capture_path.empty()) {
+        ::fprintf(stderr, "--capture_path is required\n");
+        return EXIT_FAILURE;
+    }
+    auto reader = TrafficCaptureReader::Open(FLAGS_capture_path);
+    if (reader == nullptr) {
+        return EXIT_FAILURE;
+    }
+    Replayer replayer;
+    if (!replayer.Connect()) {
+        return EXIT_FAILURE;
+    }
+    //中途停下来时也输出统计, 但返回失败
+    bool ok = replayer.Run(reader.get());
+    replayer.Report();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
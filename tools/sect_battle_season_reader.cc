@@ -0,0 +1,95 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  sect_battle_season_reader.cc
+ *        Created:  06/12/15 15:18:37
+ *         Author:  Peng Wang
+ *          Email:  pw2191195@gmail.com
+ *    Description:  读取重置赛季时存下的sect_battle_season_*.gz
+ *                  按行输出格子, 门派和所有参战人员, 方便导入分析
+ *                  参战人员分批读, 不把整个存档读进内存
+ *
+ * =============================================================================
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <alpha/logger.h>
+#include "sect_battle_store.h"
+#include "sect_battle_season_archive.h"
+
+DEFINE_string(path, "", "赛季存档路径");
+DEFINE_bool(summary, false, "只输出格子和门派, 不输出参战人员");
+DEFINE_int32(batch_size, 4096, "每次从存档中读多少个参战人员");
+
+namespace {
+    using namespace SectBattle;
+
+    void PrintSummary(const BattleStore::SnapshotView& view) {
+        ::printf("# version = %u, epoch = %u, combatants = %u, high_water = %u\n",
+                view.version, view.epoch, view.size, view.high_water);
+        ::printf("field,x,y,type,owner,garrison_num\n");
+        for (int i = 0; i < kBattleFieldCount; ++i) {
+            const Field& field = view.fields[i];
+            ::printf("field,%d,%d,%d,%d,%u\n", i % (Pos::kMaxPos + 1),
+                    i / (Pos::kMaxPos + 1), static_cast<int>(field.Type()),
+                    static_cast<int>(field.Owner()), field.GarrisonNum());
+        }
+        ::printf("sect,type,born_x,born_y,member_count\n");
+        for (int i = 0; i < BattleStore::kSectCount; ++i) {
+            const Sect& sect = view.sects[i];
+            ::printf("sect,%d,%d,%d,%u\n", static_cast<int>(sect.Type()),
+                    sect.BornPos().X(), sect.BornPos().Y(), sect.MemberCount());
+        }
+    }
+
+    void PrintCombatant(const Combatant& combatant) {
+        //Uin()为0的是空位
+        if (combatant.Uin() == 0) {
+            return;
+        }
+        ::printf("combatant,%u,%d,%d,%d,%u,%" PRId64 "\n", combatant.Uin(),
+                static_cast<int>(combatant.CurrentSect()),
+                combatant.CurrentPos().X(), combatant.CurrentPos().Y(),
+                static_cast<unsigned>(combatant.Level()),
+                static_cast<int64_t>(combatant.LastDefeatedTime()));
+    }
+
+    bool PrintCombatants(SeasonArchiveReader* reader) {
+        ::printf("combatant,uin,sect,x,y,level,last_defeated_time\n");
+        std::vector<Combatant> batch(std::max(FLAGS_batch_size, 1));
+        int n;
+        while ((n = reader->Next(batch.data(), batch.size())) > 0) {
+            for (int i = 0; i < n; ++i) {
+                PrintCombatant(batch[i]);
+            }
+        }
+        return n == 0;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("Dump an archived sect battle season as CSV");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    alpha::Logger::Init(argv[0]);
+    if (FLAGS_path.empty()) {
+        ::fprintf(stderr, "--path is required\n");
+        return EXIT_FAILURE;
+    }
+    BattleStore::SnapshotView view;
+    auto reader = SeasonArchiveReader::Open(FLAGS_path, &view);
+    if (reader == nullptr) {
+        ::fprintf(stderr, "Invalid season archive %s\n", FLAGS_path.c_str());
+        return EXIT_FAILURE;
+    }
+    PrintSummary(view);
+    if (!FLAGS_summary && !PrintCombatants(reader.get())) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}